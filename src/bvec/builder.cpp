@@ -0,0 +1,144 @@
+#include "builder.h"
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+
+// bits of the key sorted by each pass of radixSort()
+#define RADIX_BITS 11
+
+template <class Word>
+BasicBitVectorBuilder<Word>::BasicBitVectorBuilder(size_t chunk, size_t threads)
+    : chunk(chunk > 0 ? chunk : 1), threads(threads > 0 ? threads : 1), size(0)
+{
+    pending.reserve(this->chunk * this->threads);
+}
+
+template <class Word>
+BasicBitVectorBuilder<Word>::~BasicBitVectorBuilder() {
+    for (size_t i=0; i < sorted.size(); i++)
+        delete sorted[i];
+}
+
+template <class Word>
+void BasicBitVectorBuilder<Word>::add(const Word *xs, size_t n) {
+    while (n > 0) {
+        size_t room = chunk * threads - pending.size();
+        size_t take = (n < room) ? n : room;
+        pending.insert(pending.end(), xs, xs + take);
+        xs += take;
+        n -= take;
+        if (pending.size() >= chunk * threads)
+            flush();
+    }
+}
+
+template <class Word>
+void BasicBitVectorBuilder<Word>::addRun(Word from, Word n) {
+    if (n > 0)
+        runs.push_back(make_pair(from, n));
+}
+
+// one pass per RADIX_BITS bits of the key, from the lowest. a pass where
+// every key has the same digit (the high bits of small positions) is
+// skipped
+template <class Word>
+void BasicBitVectorBuilder<Word>::radixSort(Word *keys, size_t n, Word *tmp) {
+    if (n < 2) return;
+    const size_t nbuckets = (size_t)1 << RADIX_BITS;
+    vector<size_t> offset(nbuckets);
+    Word *from = keys;
+    Word *to = tmp;
+    for (size_t shift = 0; shift < sizeof(Word) * 8; shift += RADIX_BITS) {
+        fill(offset.begin(), offset.end(), 0);
+        for (size_t i=0; i < n; i++)
+            offset[(from[i] >> shift) & (nbuckets - 1)]++;
+        if (offset[(from[0] >> shift) & (nbuckets - 1)] == n)
+            continue;
+        size_t sum = 0;
+        for (size_t b=0; b < nbuckets; b++) {
+            size_t c = offset[b];
+            offset[b] = sum;
+            sum += c;
+        }
+        for (size_t i=0; i < n; i++)
+            to[offset[(from[i] >> shift) & (nbuckets - 1)]++] = from[i];
+        swap(from, to);
+    }
+    if (from != keys)
+        memcpy(keys, from, n * sizeof(Word));
+}
+
+// sort, dedupe and compress n positions into a new bitvector
+template <class Word>
+void BasicBitVectorBuilder<Word>::sortChunk(Word *keys, size_t n, BasicBitVector<Word> **res) {
+    vector<Word> tmp(n);
+    radixSort(keys, n, tmp.data());
+    tmp.assign(keys, unique(keys, keys + n));
+    *res = new BasicBitVector<Word>(tmp);
+    if (!(*res)->compressed())
+        (*res)->compress();
+}
+
+template <class Word>
+void BasicBitVectorBuilder<Word>::flush() {
+    if (pending.empty()) return;
+    size_t nchunks = (pending.size() + chunk - 1) / chunk;
+    size_t first = sorted.size();
+    sorted.resize(first + nchunks);
+    if (nchunks == 1)
+        sortChunk(pending.data(), pending.size(), &sorted[first]);
+    else {
+        boost::thread_group tg;
+        for (size_t i=0; i < nchunks; i++) {
+            size_t from = i * chunk;
+            size_t n = (from + chunk < pending.size()) ? chunk : pending.size() - from;
+            tg.create_thread(boost::bind(&BasicBitVectorBuilder<Word>::sortChunk,
+                                         pending.data() + from, n, &sorted[first + i]));
+        }
+        tg.join_all();
+    }
+    pending.clear();
+}
+
+template <class Word>
+void BasicBitVectorBuilder<Word>::build(BasicBitVector<Word>& res) {
+    flush();
+    vector<BasicBitVector<Word>*> inputs(sorted);
+    // the runs in order of their starts, overlapping ones merged
+    BasicBitVector<Word> fills(true);
+    if (!runs.empty()) {
+        sort(runs.begin(), runs.end());
+        Word start = runs[0].first;
+        Word end = start + runs[0].second;
+        for (size_t i=1; i <= runs.size(); i++) {
+            if (i < runs.size() && runs[i].first <= end) {
+                if (runs[i].first + runs[i].second > end)
+                    end = runs[i].first + runs[i].second;
+                continue;
+            }
+            fills.appendFill(false, start - fills.getSize());
+            fills.appendFill(true, end - start);
+            if (i < runs.size()) {
+                start = runs[i].first;
+                end = start + runs[i].second;
+            }
+        }
+        inputs.push_back(&fills);
+    }
+    if (inputs.empty())
+        res.copy(fills);
+    else if (inputs.size() == 1)
+        res.copy(*inputs[0]);
+    else
+        BasicBitVector<Word>::orAll(inputs, res);
+    if (size > res.getSize())
+        res.appendFill(false, size - res.getSize());
+
+    for (size_t i=0; i < sorted.size(); i++)
+        delete sorted[i];
+    sorted.clear();
+    runs.clear();
+    size = 0;
+}
+
+template class BasicBitVectorBuilder<uint32_t>;
+template class BasicBitVectorBuilder<uint64_t>;
@@ -0,0 +1,60 @@
+#ifndef SNAPDRAGON_BUILDER_H
+#define SNAPDRAGON_BUILDER_H
+
+#include <utility>
+#include "bvec.h"
+
+/*
+    Builds a compressed bitvector from positions in any order, with
+    repeats, and from runs of set bits, instead of setBit() on a growing
+    vector. Positions are buffered, and every chunk of them is radix
+    sorted, deduplicated and compressed on its own, so the buffer stays
+    small. build() then ORs the chunks and the runs together in one pass
+    over all their words (see BitVector::orAll).
+
+    With threads > 1, threads chunks are buffered and each is sorted on a
+    thread of its own.
+*/
+template <class Word>
+class BasicBitVectorBuilder {
+    size_t                         chunk;   // positions per sorted chunk
+    size_t                         threads;
+    vector<Word>                   pending; // positions not sorted yet
+    vector< pair<Word, Word> >     runs;    // start and length of each run
+    vector<BasicBitVector<Word>*>  sorted;  // the compressed chunks
+    Word                           size;    // see setSize()
+
+public:
+    BasicBitVectorBuilder(size_t chunk = 1 << 22, size_t threads = 1);
+    ~BasicBitVectorBuilder();
+
+    // set bit x, or the n bits in xs
+    void add(Word x) {
+        pending.push_back(x);
+        if (pending.size() >= chunk * threads)
+            flush();
+    }
+    void add(const Word *xs, size_t n);
+    // set bits [from, from + n)
+    void addRun(Word from, Word n);
+    // make the result at least n bits long. otherwise it ends in the
+    // literal word of the last set bit
+    void setSize(Word n) { if (n > size) size = n; }
+
+    // res = everything added so far, compressed. the builder is then
+    // empty again
+    void build(BasicBitVector<Word>& res);
+
+    // LSD radix sort of n keys, using n more as scratch
+    static void radixSort(Word *keys, size_t n, Word *tmp);
+
+private:
+    // sort the pending positions into chunks
+    void flush();
+    static void sortChunk(Word *keys, size_t n, BasicBitVector<Word> **res);
+};
+
+typedef BasicBitVectorBuilder<uint32_t> BitVectorBuilder;
+typedef BasicBitVectorBuilder<uint64_t> BitVector64Builder;
+
+#endif // SNAPDRAGON_BUILDER_H
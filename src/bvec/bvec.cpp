@@ -1,7 +1,8 @@
 #include "bvec.h"
 
-// constructor - given a sorted vector of distinct 32bit integers
-BitVector::BitVector(vector<word_t>& vals) {
+// constructor - given a sorted vector of distinct positions
+template <class Word>
+BasicBitVector<Word>::BasicBitVector(vector<Word>& vals) {
     count = vals.size();
     // if the density is too low, run length encoding will take MORE space
     if (lowDensity(vals)) {
@@ -16,184 +17,285 @@ BitVector::BitVector(vector<word_t>& vals) {
     }
 }
 
-vector<word_t>& BitVector::getWords() {
+template <class Word>
+vector<Word>& BasicBitVector<Word>::getWords() {
     return words;
 }
 
-word_t BitVector::getSize() { return size; }
-word_t BitVector::bytes() { return 4 * words.size(); }
+template <class Word>
+Word BasicBitVector<Word>::getSize() { return size; }
+template <class Word>
+Word BasicBitVector<Word>::bytes() { return sizeof(Word) * (words.size() + skips.size()); }
 
-void BitVector::compress() {
+template <class Word>
+void BasicBitVector<Word>::compress() {
     if (rle) { /* Throw exception? */ return; }
-    vector<word_t> tmp;
+    vector<Word> tmp;
     tmp.swap(words);
     constructRLE(tmp);
 }
 
 // in place version of the bitwise OR operator.
-void BitVector::operator|=(BitVector& bv) {
-    // decide which version we'll be using
-    if (rle)
-        if (bv.rle)
-            rleORrle(bv);
-        else
-            rleORnon(bv);
-    else
-        if (bv.rle)
-            nonORrle(bv);
-        else
-            nonORnon(bv);
+template <class Word>
+void BasicBitVector<Word>::operator|=(BasicBitVector& bv) {
+    vector<Word> res;
+    opWith(bv, OR, res);
 }
 // in place version of the bitwise AND operator.
-void BitVector::operator&=(BitVector& bv) {
-    // decide which version we'll be using
-    if (rle)
-        if (bv.rle)
-            rleANDrle(bv);
+template <class Word>
+void BasicBitVector<Word>::operator&=(BasicBitVector& bv) {
+    vector<Word> res;
+    opWith(bv, AND, res);
+}
+// in place version of the bitwise XOR operator.
+template <class Word>
+void BasicBitVector<Word>::operator^=(BasicBitVector& bv) {
+    vector<Word> res;
+    opWith(bv, XOR, res);
+}
+template <class Word>
+void BasicBitVector<Word>::andNot(BasicBitVector& bv) {
+    vector<Word> res;
+    opWith(bv, ANDNOT, res);
+}
+template <class Word>
+BasicBitVector<Word>* BasicBitVector<Word>::operator|(BasicBitVector& rhs) {
+    BasicBitVector *res = new BasicBitVector();
+    opInto(rhs, OR, *res);
+    return res;
+}
+template <class Word>
+BasicBitVector<Word>* BasicBitVector<Word>::operator&(BasicBitVector& rhs) {
+    BasicBitVector *res = new BasicBitVector();
+    opInto(rhs, AND, *res);
+    return res;
+}
+template <class Word>
+BasicBitVector<Word>* BasicBitVector<Word>::operator^(BasicBitVector& rhs) {
+    BasicBitVector *res = new BasicBitVector();
+    opInto(rhs, XOR, *res);
+    return res;
+}
+
+template <class Word>
+void BasicBitVector<Word>::andWith(BasicBitVector& bv, vector<Word>& scratch) { opWith(bv, AND, scratch); }
+template <class Word>
+void BasicBitVector<Word>::orWith(BasicBitVector& bv, vector<Word>& scratch) { opWith(bv, OR, scratch); }
+template <class Word>
+void BasicBitVector<Word>::xorWith(BasicBitVector& bv, vector<Word>& scratch) { opWith(bv, XOR, scratch); }
+template <class Word>
+void BasicBitVector<Word>::andNotWith(BasicBitVector& bv, vector<Word>& scratch) { opWith(bv, ANDNOT, scratch); }
+template <class Word>
+void BasicBitVector<Word>::andInto(BasicBitVector& bv, BasicBitVector& res) { opInto(bv, AND, res); }
+template <class Word>
+void BasicBitVector<Word>::orInto(BasicBitVector& bv, BasicBitVector& res) { opInto(bv, OR, res); }
+template <class Word>
+void BasicBitVector<Word>::xorInto(BasicBitVector& bv, BasicBitVector& res) { opInto(bv, XOR, res); }
+template <class Word>
+void BasicBitVector<Word>::andNotInto(BasicBitVector& bv, BasicBitVector& res) { opInto(bv, ANDNOT, res); }
+
+template <class Word>
+void BasicBitVector<Word>::opWith(BasicBitVector& bv, Op op, vector<Word>& scratch) {
+    size = combine(bv, op, scratch, rle);
+    words.swap(scratch);
+    reset();
+}
+template <class Word>
+void BasicBitVector<Word>::opInto(BasicBitVector& bv, Op op, BasicBitVector& res) {
+    res.size = combine(bv, op, res.words, res.rle);
+    res.reset();
+}
+template <class Word>
+void BasicBitVector<Word>::flipInto(BasicBitVector& res) {
+    if (!rle)
+        compress();
+    res.copy(*this);
+    res.flip();
+}
+
+// decide which version we'll be using
+template <class Word>
+Word BasicBitVector<Word>::combine(BasicBitVector& bv, Op op, vector<Word>& res, bool& resRle) {
+    Word res_size = size;
+    bool res_rle = rle;
+    if (rle && bv.rle) {
+        if (op == AND)
+            rleANDrle(bv, res);
+        else if (op == OR)
+            rleORrle(bv, res);
         else
-            rleANDnon(bv);
-    else
-        if (bv.rle)
-            nonANDrle(bv);
+            rleOPrle(bv, op, res);
+        res_size = size; // both have the same size now
+    }
+    else if (!rle && !bv.rle)
+        nonOPnon(bv, op, res);
+    else if (op == AND) { // a list of the bits of the list in the rle vector
+        res_rle = false;
+        if (rle)
+            bv.nonANDrle(*this, false, res);
         else
-            nonANDnon(bv);
-}
-BitVector* BitVector::operator|(BitVector& rhs) {
-    BitVector *res = new BitVector();
-    if (words.size() > rhs.words.size()) {
-        res->copy(rhs);
-        *res |= *this;
-        return res;
+            nonANDrle(bv, false, res);
     }
-    res->copy(*this);
-    *res |= rhs;
-    return res;
-}
-BitVector* BitVector::operator&(BitVector& rhs) {
-    BitVector *res = new BitVector();
-    if (words.size() > rhs.words.size()) {
-        res->copy(rhs);
-        *res &= *this;
-        return res;
+    else if (op == ANDNOT && !rle)
+        nonANDrle(bv, true, res);
+    else if (rle) // merge the list into the words of this
+        res_size = rleOPnon(bv, op, res);
+    else { // OR and XOR are symmetric
+        res_rle = true;
+        res_size = bv.rleOPnon(*this, op, res);
     }
-    res->copy(*this);
-    *res &= rhs;
-    return res;
+    resRle = res_rle;
+    return res_size;
 }
 
-bool BitVector::operator==(BitVector& other) const {
+template <class Word>
+void BasicBitVector<Word>::reset() {
+    skips.clear();
+    count = rle ? 0 : words.size(); // recount on demand
+    frontier = Cursor();
+}
+
+template <class Word>
+bool BasicBitVector<Word>::operator==(BasicBitVector& other) const {
     return (words == other.words) &&
            (count == other.count) &&
            (size  == other.size)  &&
            (rle   == other.rle);
 }
 
-bool BitVector::equals(const BitVector& other) const {
+template <class Word>
+bool BasicBitVector<Word>::equals(const BasicBitVector& other) const {
     return (words == other.words) &&
            (count == other.count) &&
            (size  == other.size)  &&
            (rle   == other.rle);
 }
 
-BitVector* BitVector::copyflip() {
-    BitVector *res = new BitVector();
-    res->copy(*this);
-    res->flip();
+template <class Word>
+BasicBitVector<Word>* BasicBitVector<Word>::copyflip() {
+    BasicBitVector *res = new BasicBitVector();
+    flipInto(*res);
     return res;
 }
 
-void BitVector::nonORnon(BitVector& bv) {
-    
-    vector<word_t> res;
-    vector<word_t>::iterator a = words.begin();
-    vector<word_t>::iterator b = bv.words.begin();
-    res.push_back(*a < *b ? *a : *b);
+// merge two sorted lists
+template <class Word>
+void BasicBitVector<Word>::nonOPnon(BasicBitVector& bv, Op op, vector<Word>& res) {
+    res.clear();
+    typename vector<Word>::iterator a = words.begin();
+    typename vector<Word>::iterator b = bv.words.begin();
     while(a != words.end() && b != bv.words.end()) {
         if (*a < *b) {
-            if (*a != res.back())
+            if (op != AND)
                 res.push_back(*a);
             ++a;
         }
         else if (*b < *a) {
-            if (*b != res.back())
+            if (op == OR || op == XOR)
                 res.push_back(*b);
             ++b;
         }
         else {
-            if (*a != res.back())
+            if (op == AND || op == OR)
                 res.push_back(*a);
             ++a;
             ++b;
         }
     }
-    if (a != words.end())
+    if (op != AND)
         res.insert(res.end(),a,words.end());
-    else if (b != bv.words.end())
+    if (op == OR || op == XOR)
         res.insert(res.end(),b,bv.words.end());
-
-    count = res.size();
     // TODO: check if it's worth compressing
-
-    words.swap(res);
 }
 
-void BitVector::nonANDnon(BitVector& bv) {
-    
-    vector<word_t> res;
-    vector<word_t>::iterator a = words.begin();
-    vector<word_t>::iterator b = bv.words.begin();
-    res.push_back(*a < *b ? *a : *b);
-    while(a != words.end() && b != bv.words.end()) {
-        if (*a < *b)
-            ++a;
-        else if (*b < *a)
-            ++b;
-        else {
+// the set bits of this that are (or with negate, are not) also set in bv.
+// find() is fast on ascending positions, so there's no need to decompress
+template <class Word>
+void BasicBitVector<Word>::nonANDrle(BasicBitVector& bv, bool negate, vector<Word>& res) {
+    res.clear();
+    for (typename vector<Word>::iterator a = words.begin(); a != words.end(); ++a)
+        if ((*a < bv.size && bv.find(*a)) != negate)
             res.push_back(*a);
-            ++a;
-            ++b;
-        }
-    }
-    count = res.size();
-    words.swap(res);
-}
-
-void BitVector::nonANDrle(BitVector& bv) {
-    // decompress
-    // run nonANDnon
-    BitVector *tmp = new BitVector();
-    tmp->copy(bv);
-    tmp->decompress();
-    nonANDnon(*tmp);
-    delete tmp;
-}
-
-void BitVector::rleANDnon(BitVector& bv) {
-    // decompress
-    // run nonANDnon
-    decompress();
-    nonANDnon(bv);
 }
 
-void BitVector::nonORrle(BitVector& bv) {
-    // compress
-    // run rleORrle
-    compress();
-    rleORrle(bv);
+// flip the bits at positions [b, b_end) that are < end in fills of bit
+// from pos to end, which are both word aligned
+template <class Word>
+void BasicBitVector<Word>::flipPositions(vector<Word>& res, bool bit, Word pos, Word end,
+                              typename vector<Word>::iterator& b,
+                              typename vector<Word>::iterator b_end) {
+    while (b != b_end && *b < end) {
+        Word gap = (*b - pos) / LITERAL_SIZE;
+        if (gap > 0) {
+            pushFill(res, bit, gap);
+            pos += gap * LITERAL_SIZE;
+        }
+        Word word = 0;
+        Word word_end = pos + LITERAL_SIZE;
+        for (; b != b_end && *b < word_end; ++b)
+            word |= (Word)1 << (word_end - 1 - *b);
+        pushWord(res, bit ? ALL1S & ~word : word);
+        pos = word_end;
+    }
+    if (end > pos)
+        pushFill(res, bit, (end - pos) / LITERAL_SIZE);
 }
 
-void BitVector::rleORnon(BitVector& bv) {
-    // compress
-    // run rleORrle
-    BitVector *tmp = new BitVector();
-    tmp->copy(bv);
-    tmp->compress();
-    rleORrle(*tmp);
-    delete tmp;
+// apply the set bits of bv to the words of this (OR sets, XOR flips and
+// ANDNOT clears them) without compressing bv first. returns the size of
+// the result
+template <class Word>
+Word BasicBitVector<Word>::rleOPnon(BasicBitVector& bv, Op op, vector<Word>& res) {
+    res.clear();
+    typename vector<Word>::iterator b = bv.words.begin();
+    typename vector<Word>::iterator b_end = bv.words.end();
+    // bits past the end of this extend it to a whole number of words
+    Word res_size = size;
+    if (op == ANDNOT)
+        b_end = lower_bound(b, b_end, size);
+    else if (!bv.words.empty() && bv.words.back() >= size)
+        res_size = LITERAL_SIZE * (bv.words.back() / LITERAL_SIZE + 1);
+    Word pos = 0; // first bit of the current word
+    for (typename vector<Word>::iterator a = words.begin(); a != words.end() && pos < size; ++a) {
+        if (*a & BIT1) {
+            bool bit = (*a & ONEFILL) == ONEFILL;
+            Word end = pos + LITERAL_SIZE * (*a & FILLMASK);
+            if ((op == OR && bit) || (op == ANDNOT && !bit)) { // unchanged
+                pushFill(res, bit, *a & FILLMASK);
+                while (b != b_end && *b < end) ++b;
+            }
+            else
+                flipPositions(res, bit, pos, end, b, b_end);
+            pos = end;
+        }
+        else {
+            Word word = 0;
+            Word end = pos + LITERAL_SIZE;
+            for (; b != b_end && *b < end; ++b)
+                word |= (Word)1 << (end - 1 - *b);
+            word = (op == OR) ? *a | word : (op == XOR) ? *a ^ word : *a & ~word;
+            if (end <= res_size)
+                pushWord(res, word);
+            else // a partial literal at the end stays a literal
+                res.push_back(word);
+            pos = end;
+        }
+    }
+    if (pos < res_size)
+        flipPositions(res, false, pos, res_size, b, b_end);
+    if (res.empty())
+        res.push_back(0); // empty literal, like an empty rle bitvector
+    return res_size;
 }
 
-void BitVector::setBit(word_t x) {
-    if (rle) { // this should really be done in an rle specific way.
+template <class Word>
+void BasicBitVector<Word>::setBit(Word x) {
+    if (rle && x >= size) { // past the end, so just append it
+        appendFill(false, x - size);
+        appendFill(true, 1);
+    }
+    else if (rle) { // to build a vector out of order, see builder.h
         decompress();
         setBit(x);
         compress();
@@ -203,7 +305,7 @@ void BitVector::setBit(word_t x) {
             words.push_back(x);
         }
         else {
-            vector<word_t>::iterator lb = lower_bound(words.begin(),words.end(),x);
+            typename vector<Word>::iterator lb = lower_bound(words.begin(),words.end(),x);
             if (*lb == x) return;
             words.insert(lb,x);
         }
@@ -212,33 +314,34 @@ void BitVector::setBit(word_t x) {
     }
 }
 
-BitVector&
-BitVector::copy(const BitVector& bv) {
+template <class Word>
+BasicBitVector<Word>&
+BasicBitVector<Word>::copy(const BasicBitVector& bv) {
     words = bv.words;
+    skips = bv.skips;
     count = bv.count;
     size = bv.size;
     rle = bv.rle;
+    frontier = Cursor();
     return *this;
 }
 
-ostream& operator<<(ostream &os, const vector<word_t> vec) {
-    return os << vec;
-}
-
-ostream& operator<<(ostream &os, const BitVector &vec) {
-    return os << vec;
-}
-
+template <class Word>
 void
-BitVector::save(const BitVector &bv, const char *filename) {
+BasicBitVector<Word>::save(const BasicBitVector &bv, const char *filename) {
     std::ofstream ofs(filename);
     boost::archive::text_oarchive oa(ofs);
     oa << bv;
 }
 
+template <class Word>
 void
-BitVector::restore(BitVector &bv, const char *filename) {
+BasicBitVector<Word>::restore(BasicBitVector &bv, const char *filename) {
     std::ifstream ifs(filename);
     boost::archive::text_iarchive ia(ifs);
     ia >> bv;
+    bv.skips.clear();
 }
+
+template class BasicBitVector<uint32_t>;
+template class BasicBitVector<uint64_t>;
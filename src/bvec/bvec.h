@@ -16,94 +16,223 @@
 
 using namespace std;
 
-typedef uint32_t word_t;
+/*
+    A WAH compressed bitvector in words of type Word (uint32_t or uint64_t),
+    which is also the type of its positions. Each word is a literal of
+    LITERAL_SIZE bits, with the top bit clear, or a fill: BIT1 set, BIT2 the
+    fill bit and the rest (FILLMASK) its length in literals. A bitvector of
+    low density keeps the sorted positions of its set bits instead.
+*/
+template <class Word>
+class BasicBitVector {
+public:
+    static const Word WORD_SIZE    = sizeof(Word) * 8;
+    static const Word LITERAL_SIZE = WORD_SIZE - 1;
+    static const Word BIT1         = (Word)1 << (WORD_SIZE - 1);
+    static const Word BIT2         = (Word)1 << (WORD_SIZE - 2);
+    static const Word FILLMASK     = BIT2 - 1;
+    static const Word ALL1S        = BIT1 - 1;
+    static const Word ONEFILL      = BIT1 | BIT2;
+    static const Word ONEFILL1     = ONEFILL | 1;
+    static const Word ONEFULL      = ONEFILL | FILLMASK;
+    static const Word ZEROFULL     = BIT1 | FILLMASK;
+    static const Word ZEROFILL1    = BIT1 | 1;
+    // words between the entries of the skip index
+    static const Word SKIP_WORDS   = 64;
+
+    // where a caller is in the words of a compressed bitvector. find()
+    // and nextOne() start from it and leave it at the word they stopped
+    // at, so ascending queries through the same cursor never rescan. the
+    // bitvector itself is not changed, so any number of threads can query
+    // it at once, each with its own cursors
+    struct Cursor {
+        size_t word;    // index of the word
+        Word   bit_pos; // position of its first bit
+        Cursor() : word(0), bit_pos(0) {}
+    };
 
-class BitVector {
-    vector<word_t> words;
+private:
+    vector<Word> words;
     bool rle;
-    word_t count; // cache the number of set bits
-    word_t size; // bits in the uncompressed bitvector
+    Word count; // cache the number of set bits
+    Word size; // bits in the uncompressed bitvector
+    // optional skip index of a compressed bitvector: for every SKIP_WORDS-th
+    // word, the position of its first bit and the number of set bits before
+    // it. empty until needed, and cleared whenever the words change
+    vector<Word> skips;
 
     friend class boost::serialization::access;
-    friend ostream & operator <<(ostream &, const BitVector &);
 
     template<class Archive>
     void serialize(Archive & ar, const unsigned int version) {
         ar & words & count & size & rle;
     }
 
-    // checkpoint: active word and associated info
-    struct checkpoint {
-        vector<word_t>::iterator active_word;
-        word_t bit_pos;
-    } frontier;
+    // the cursor of find(x) and nextOne(x)
+    Cursor frontier;
 
 public:
     // Destructor
-    ~BitVector() {};
+    ~BasicBitVector() {};
 
     // Constructors
-    BitVector()                     : rle(false), count(0), size(0) {};
-    BitVector(bool wah)             : rle(false), count(0), size(0) {
+    BasicBitVector()           : rle(false), count(0), size(0) {};
+    BasicBitVector(bool wah)   : rle(false), count(0), size(0) {
         compress();
     };
-    BitVector(vector<word_t>& vals);
-    BitVector(word_t* buf); // DIY deserialization
+    BasicBitVector(vector<Word>& vals);
+    BasicBitVector(Word* buf); // DIY deserialization
     
-    BitVector& copy(const BitVector& bv);
+    BasicBitVector& copy(const BasicBitVector& bv);
     
     void   print();
     void   compress();
     void   decompress();
-    size_t dump(word_t **buf); // DIY serialization
+    size_t dump(Word **buf); // DIY serialization
 
     // logical set operations
-    void                 flip();
-    BitVector *          copyflip();
-    void        operator |= (BitVector& rhs);
-    BitVector * operator |  (BitVector&);
-    void        operator &= (BitVector& rhs);
-    BitVector * operator &  (BitVector&);
-    bool        operator ==(BitVector&) const;
+    void                  flip();
+    BasicBitVector *      copyflip();
+    void                  operator |= (BasicBitVector& rhs);
+    BasicBitVector *      operator |  (BasicBitVector&);
+    void                  operator &= (BasicBitVector& rhs);
+    BasicBitVector *      operator &  (BasicBitVector&);
+    void                  operator ^= (BasicBitVector& rhs);
+    BasicBitVector *      operator ^  (BasicBitVector&);
+    // this & ~rhs, without complementing rhs
+    void                  andNot(BasicBitVector& rhs);
+    bool                  operator ==(BasicBitVector&) const;
+
+    // the same operations without allocating a result. res = this & rhs
+    // (or |, ^, & ~rhs, or ~this) reuses the words res already holds, so a
+    // loop that passes the same res every time stops allocating once res
+    // is big enough. res must not be this or rhs
+    void andInto(BasicBitVector& rhs, BasicBitVector& res);
+    void orInto(BasicBitVector& rhs, BasicBitVector& res);
+    void xorInto(BasicBitVector& rhs, BasicBitVector& res);
+    void andNotInto(BasicBitVector& rhs, BasicBitVector& res);
+    void flipInto(BasicBitVector& res);
+    // in place, building the result in scratch, which is then swapped with
+    // the words of this. pass the same scratch to a chain of operations
+    void andWith(BasicBitVector& rhs, vector<Word>& scratch);
+    void orWith(BasicBitVector& rhs, vector<Word>& scratch);
+    void xorWith(BasicBitVector& rhs, vector<Word>& scratch);
+    void andNotWith(BasicBitVector& rhs, vector<Word>& scratch);
+
+    // res = the AND (OR) of all the inputs, in one pass over the words of
+    // all of them. a 0-fill (1-fill) in any input skips ahead over all the
+    // others. shorter inputs count as padded with 0s
+    static void andAll(vector<BasicBitVector*>& inputs, BasicBitVector& res);
+    static void orAll(vector<BasicBitVector*>& inputs, BasicBitVector& res);
     
-    bool                 equals(const BitVector&) const;
-    vector<word_t>&      getWords();
+    bool                  equals(const BasicBitVector&) const;
+    vector<Word>&         getWords();
+    // are the words WAH (rather than sorted positions)?
+    bool                  compressed() const { return rle; }
 
     // is x in the set?
-    bool find(word_t x);
+    bool find(Word x, Cursor& cur) const;
+
+    // find the position of the first set bit at or after x
+    Word nextOne(Word x, Cursor& cur) const;
+
+    // the same through a cursor of the bitvector's own, which also builds
+    // the skip index when asked for a position behind the last one. these
+    // are not safe to call from more than one thread
+    bool find(Word x);
+    Word nextOne(Word x);
+
+    // the number of set bits before position x
+    Word rank(Word x) const;
 
-    // find the position of the next set bit after x
-    word_t nextOne(word_t x);
+    // the position of set bit i (counting from 0), or the size if there
+    // are not that many
+    Word select(Word i) const;
 
-    // insert x into an existing BitVector (at the end is faster)
-    void setBit(word_t x);
+    // build the skip index, unless there are too few words to need one.
+    // the const queries only use it if it is there, so build it before
+    // sharing a bitvector between threads. dump() saves it, if it was
+    // built
+    void buildSkips();
 
-    // for constructing a rle BitVector one bit at a time
-    void appendFill(bool bit, word_t count);
+    // insert x into an existing bitvector (at the end is faster)
+    void setBit(Word x);
+
+    // for constructing a rle bitvector one bit at a time
+    void appendFill(bool bit, Word count);
+
+    // append the leading nbits of a literal word (the first bit is BIT2)
+    void appendWord(Word word, Word nbits);
+
+    // concatenate another bitvector onto the end of this one
+    void append(const BasicBitVector& bv);
 
     // basic metrics
-    word_t cnt();
-    word_t getSize();
-    word_t bytes();
+    Word cnt();
+    Word getSize();
+    Word bytes();
     
-    static void save(const BitVector &bv, const char *filename);
-    static void restore(BitVector &bv, const char *filename);
+    static void save(const BasicBitVector &bv, const char *filename);
+    static void restore(BasicBitVector &bv, const char *filename);
 
 private:
 
-    bool   lowDensity(vector<word_t>& vals);
-    void   constructRLE(vector<word_t>& vals);
-    void   matchSize(BitVector& bv);
-    void   rleORrle(BitVector& rhs);
-    void   rleORnon(BitVector& rhs);
-    void   nonORrle(BitVector& rhs);
-    void   nonORnon(BitVector& rhs);
-    void   rleANDrle(BitVector& rhs);
-    void   rleANDnon(BitVector& rhs);
-    void   nonANDrle(BitVector& rhs);
-    void   nonANDnon(BitVector& rhs);
-    word_t popCount(word_t val) const;
+    bool   lowDensity(vector<Word>& vals);
+    void   constructRLE(vector<Word>& vals);
+    static void pushWord(vector<Word>& words, Word word);
+    static void pushFill(vector<Word>& words, bool bit, Word n);
+    void   matchSize(BasicBitVector& bv);
+    enum Op { AND, OR, XOR, ANDNOT };
+    // this op rhs into res, which is cleared first. the result is rle if
+    // both operands are, or if this one is and the result can have bits
+    // that only this one has. returns its size
+    Word   combine(BasicBitVector& rhs, Op op, vector<Word>& res, bool& resRle);
+    void   opWith(BasicBitVector& rhs, Op op, vector<Word>& scratch);
+    void   opInto(BasicBitVector& rhs, Op op, BasicBitVector& res);
+    void   rleORrle(BasicBitVector& rhs, vector<Word>& res);
+    void   rleANDrle(BasicBitVector& rhs, vector<Word>& res);
+    void   rleOPrle(BasicBitVector& rhs, Op op, vector<Word>& res);
+    // when a and b are both at literals, combine the run of full literals
+    // they share through the word kernels (see simd.h), and step past it
+    bool   opLiterals(typename vector<Word>::iterator& a, Word& a_pos,
+                      typename vector<Word>::iterator& b, Word& b_pos,
+                      Word& res_pos, Op op, vector<Word>& res);
+    Word   rleOPnon(BasicBitVector& rhs, Op op, vector<Word>& res);
+    void   nonOPnon(BasicBitVector& rhs, Op op, vector<Word>& res);
+    void   nonANDrle(BasicBitVector& rhs, bool negate, vector<Word>& res);
+    static void flipPositions(vector<Word>& res, bool bit, Word pos, Word end,
+                              typename vector<Word>::iterator& b,
+                              typename vector<Word>::iterator b_end);
+    static void combineAll(vector<BasicBitVector*>& inputs, bool isAnd, BasicBitVector& res);
+    // point the frontier at the first word and let cnt() recount
+    void   reset();
+    // the last skip index entry at or before position x, by position or
+    // (with byRank) by the number of set bits before it
+    size_t findSkip(Word x, bool byRank) const;
+    // move cur to a word at or before position x, through the skip index
+    // if it is there and x is behind cur or far ahead of it
+    void   seek(Word x, Cursor& cur) const;
 
 };
 
+
+template <class Word> const Word BasicBitVector<Word>::WORD_SIZE;
+template <class Word> const Word BasicBitVector<Word>::LITERAL_SIZE;
+template <class Word> const Word BasicBitVector<Word>::BIT1;
+template <class Word> const Word BasicBitVector<Word>::BIT2;
+template <class Word> const Word BasicBitVector<Word>::FILLMASK;
+template <class Word> const Word BasicBitVector<Word>::ALL1S;
+template <class Word> const Word BasicBitVector<Word>::ONEFILL;
+template <class Word> const Word BasicBitVector<Word>::ONEFILL1;
+template <class Word> const Word BasicBitVector<Word>::ONEFULL;
+template <class Word> const Word BasicBitVector<Word>::ZEROFULL;
+template <class Word> const Word BasicBitVector<Word>::ZEROFILL1;
+template <class Word> const Word BasicBitVector<Word>::SKIP_WORDS;
+
+// 31 bit literals, as in the index files, and 63 bit literals with
+// positions past 2^32
+typedef uint32_t word_t;
+typedef BasicBitVector<uint32_t> BitVector;
+typedef BasicBitVector<uint64_t> BitVector64;
+
 #endif
@@ -1,84 +1,95 @@
-#include "bvec32.h"
 #include "bvec.h"
+#include "simd.h"
 
-// constructor - given a previously dumped BitVector
-BitVector::BitVector(word_t *buf) {
-    word_t nwords = buf[0];
+// constructor - given a previously dumped bitvector
+template <class Word>
+BasicBitVector<Word>::BasicBitVector(Word *buf) {
+    Word nwords = buf[0] & FILLMASK;
     size = buf[1];
     count = buf[2];
-    rle = false;
-    if (nwords & BIT1) {
-        nwords -= BIT1;
-        rle=true;
-    }
+    rle = (buf[0] & BIT1) != 0;
     words.resize(nwords);
-    memcpy(words.data(),buf+3,nwords*4);
-    frontier.active_word = words.begin();
-    frontier.bit_pos=0;
+    memcpy(words.data(),buf+3,nwords*sizeof(Word));
+    if (buf[0] & BIT2) { // followed by the skip index
+        Word nskips = buf[3 + nwords];
+        skips.assign(buf + 4 + nwords, buf + 4 + nwords + nskips);
+    }
+    frontier = Cursor();
 }
 
-// DIY serialization
+// DIY serialization. the first word has the number of words, BIT1 if it
+// is compressed and BIT2 if the words are followed by the length of the
+// skip index and the skip index
+template <class Word>
 size_t
-BitVector::dump(word_t **buf) {
+BasicBitVector<Word>::dump(Word **buf) {
     // allocate space in buf
-    size_t dbytes = sizeof(word_t)*(3 + words.size());
-    *buf = (word_t*)malloc(dbytes);
+    size_t nskips = skips.size();
+    size_t dbytes = sizeof(Word)*(3 + words.size() + (nskips ? 1 + nskips : 0));
+    *buf = (Word*)malloc(dbytes);
     if (*buf == NULL) {
         fprintf(stderr,"failed to allocate %zi bytes\n",dbytes);
         return 0;
     }
     (*buf)[0] = words.size();
     if (rle) (*buf)[0] |= BIT1;
+    if (nskips) (*buf)[0] |= BIT2;
     (*buf)[1] = size;
     (*buf)[2] = count;
-    memcpy(*buf + 3, words.data(), bytes());
+    memcpy(*buf + 3, words.data(), sizeof(Word) * words.size());
+    if (nskips) {
+        (*buf)[3 + words.size()] = nskips;
+        memcpy(*buf + 4 + words.size(), skips.data(), sizeof(Word) * nskips);
+    }
     return dbytes;
 }
 
+template <class Word>
 bool
-BitVector::lowDensity(vector<word_t>& vals) {
-    if (DEBUG) printf("lowDensity() %u/%u %c %f\n", (word_t)vals.size(),
-        vals.back() - vals.front() + 1,
+BasicBitVector<Word>::lowDensity(vector<Word>& vals) {
+    if (DEBUG) printf("lowDensity() %zu/%zu %c %f\n", vals.size(),
+        (size_t)(vals.back() - vals.front() + 1),
             ((double)vals.size()/(double)(vals.back() - vals.front() + 1) < 1.0/(double)LITERAL_SIZE) ? '<' : '>',
                 1.0/(double)LITERAL_SIZE);
     return (double)vals.size()/(double)(vals.back() - vals.front() + 1) < 1.0/(double)LITERAL_SIZE;
     
 }
 
+template <class Word>
 void
-BitVector::print() {
+BasicBitVector<Word>::print() {
     printf("rle: %c\n",rle ? 'T' : 'F');
     printf("words:\n");
-    for(int i=0;i<words.size();i++) {
-        printf(" %i ",i);
+    for(size_t i=0;i<words.size();i++) {
+        printf(" %zu ",i);
         if (rle)
             if ((words[i] & ONEFILL) == ONEFILL) 
-                printf("1-fill %zi %zi\n",words[i] & FILLMASK, LITERAL_SIZE*(words[i] & FILLMASK));
+                printf("1-fill %zi %zi\n",(size_t)(words[i] & FILLMASK), (size_t)(LITERAL_SIZE*(words[i] & FILLMASK)));
             else if (words[i] & BIT1)
-                printf("0-fill %zi %zi\n",words[i] & FILLMASK, LITERAL_SIZE*(words[i] & FILLMASK));
+                printf("0-fill %zi %zi\n",(size_t)(words[i] & FILLMASK), (size_t)(LITERAL_SIZE*(words[i] & FILLMASK)));
             else
-                printf("literal %u\n",words[i]);
+                printf("literal %llu\n",(unsigned long long)words[i]);
         else
-            printf("direct %u\n",words[i]);
+            printf("direct %llu\n",(unsigned long long)words[i]);
     }
 }
 
+template <class Word>
 void
-BitVector::constructRLE(vector<word_t>& vals) {
+BasicBitVector<Word>::constructRLE(vector<Word>& vals) {
     rle = true;
-    frontier.bit_pos=0;
+    skips.clear();
+    frontier = Cursor();
     if (vals.size() == 0) {
         size=0;
         count=0;
         words.clear();
         words.push_back(0); // current word is an empty literal
-        frontier.active_word = words.begin();
         return;
     }
-    frontier.active_word = words.begin();
-    word_t word_end = LITERAL_SIZE - 1;
-    word_t word=0;
-    word_t gap_words = vals.front()/LITERAL_SIZE;
+    Word word_end = LITERAL_SIZE - 1;
+    Word word=0;
+    Word gap_words = vals.front()/LITERAL_SIZE;
     if (gap_words > 0) {
         word_end += LITERAL_SIZE*gap_words;
         while (gap_words > FILLMASK) {
@@ -88,11 +99,11 @@ BitVector::constructRLE(vector<word_t>& vals) {
         if (gap_words > 0)
             words.push_back(gap_words | BIT1);
     }
-    for(vector<word_t>::iterator ii = vals.begin(); ii != vals.end(); ++ii) {
+    for(typename vector<Word>::iterator ii = vals.begin(); ii != vals.end(); ++ii) {
         if (*ii == word_end)
             word |= 1;
         else if (*ii < word_end)
-            word |= ((word_t)1 << (word_end - *ii));
+            word |= ((Word)1 << (word_end - *ii));
         else {
             if (word == ALL1S)
                 if ((words.size() != 0) &&
@@ -112,7 +123,7 @@ BitVector::constructRLE(vector<word_t>& vals) {
                 words.push_back(gap_words | BIT1);
             word_end += (gap_words+1)*LITERAL_SIZE;
             word = (word_end - *ii == LITERAL_SIZE)
-                ? 1 : (word_t)1 << (word_end - *ii);
+                ? 1 : (Word)1 << (word_end - *ii);
         }
     }
     // add the last word
@@ -129,132 +140,151 @@ BitVector::constructRLE(vector<word_t>& vals) {
     size = word_end+1;
 }
 
+template <class Word>
 void
-BitVector::decompress() {
+BasicBitVector<Word>::decompress() {
     if (!rle) { /* Throw exception? */ return; }
-    // retrieve the set bits from the compressed vector
-    vector<word_t> res;
-    res.reserve(cnt());
-    word_t pos=0;
-    for(vector<word_t>::iterator ii = words.begin(); ii != words.end(); ++ii) {
-        if ((*ii & ONEFILL) == ONEFILL) {
-            word_t n_ones = LITERAL_SIZE*(*ii & FILLMASK);
-            for(word_t i=0;i < n_ones; i++) {
-                res.push_back(pos);
-                pos++;
-            }
+    // retrieve the set bits from the compressed vector. the kernel may
+    // write a few positions past the last one
+    vector<Word> res(cnt() + 8);
+    size_t n = 0;
+    Word pos=0;
+    for (size_t i = 0; i < words.size(); ) {
+        if ((words[i] & ONEFILL) == ONEFILL) {
+            Word n_ones = LITERAL_SIZE*(words[i] & FILLMASK);
+            for(Word j=0;j < n_ones; j++)
+                res[n++] = pos + j;
+            pos += n_ones;
+            i++;
         }
-        else if (*ii & BIT1)
-            pos += LITERAL_SIZE*(*ii & FILLMASK);
-        else { // desconstruct the literal word
-            for(word_t bit=1; bit<=LITERAL_SIZE; bit++)
-                if (*ii & ((word_t)1 << (LITERAL_SIZE-bit)))
-                    res.push_back(pos+bit-1);
-            pos += LITERAL_SIZE;
+        else if (words[i] & BIT1) {
+            pos += LITERAL_SIZE*(words[i] & FILLMASK);
+            i++;
+        }
+        else { // a run of literal words
+            size_t end = i + 1;
+            while (end < words.size() && !(words[end] & BIT1)) end++;
+            n += expand(&words[i], end - i, pos, &res[n]);
+            pos += LITERAL_SIZE * (end - i);
+            i = end;
         }
     }
+    res.resize(n);
     words.swap(res);
+    skips.clear();
     count = words.size();
     rle = false;
 }
 
-// only works with compressed - return the position of the next set bit after position x
-word_t
-BitVector::nextOne(word_t x) {
+// only works with compressed - return the position of the first set bit at or after position x
+template <class Word>
+Word
+BasicBitVector<Word>::nextOne(Word x, Cursor& cur) const {
     if (!rle) { fprintf(stderr,"next_one() only works on compressed bitvectors\n"); exit(1); }
 
-    x++;
-    if (frontier.bit_pos > x) {
-        frontier.active_word = words.begin();
-        frontier.bit_pos = 0;
-    }
+    seek(x, cur);
     
-    while(frontier.active_word != words.end()) {
+    for (; cur.word < words.size(); cur.word++) {
+        Word word = words[cur.word];
         // what type of word is it?
-        if (*(frontier.active_word) & BIT1) { // fill word
-            word_t span = (*(frontier.active_word) & FILLMASK) * LITERAL_SIZE;
-            if ((frontier.bit_pos + span >= x) && (*(frontier.active_word) & BIT2)) // x is within a 1-fill
-                return x;
-            frontier.bit_pos += span;
-            x += span;
+        if (word & BIT1) { // fill word
+            Word span = (word & FILLMASK) * LITERAL_SIZE;
+            if ((x < cur.bit_pos + span) && (word & BIT2)) // x is within or before a 1-fill
+                return (x > cur.bit_pos) ? x : cur.bit_pos;
+            cur.bit_pos += span;
         }
         else { // literal word
-            if ((frontier.bit_pos + LITERAL_SIZE >= x) &&
-                ((1UL << (frontier.bit_pos + LITERAL_SIZE - x)) & *(frontier.active_word)))
-                return x;
-            frontier.bit_pos += LITERAL_SIZE;
-            x += LITERAL_SIZE;
+            if (x < cur.bit_pos + LITERAL_SIZE) {
+                Word skip = (x > cur.bit_pos) ? x - cur.bit_pos : 0;
+                Word rest = word & (ALL1S >> skip);
+                if (rest) // offset of the highest remaining set bit
+                    return cur.bit_pos + leadingZeros(rest) - 1;
+            }
+            cur.bit_pos += LITERAL_SIZE;
         }
-        frontier.active_word++;
     }
     return size; // no next set bit, so return the number of bits
 }
 
+template <class Word>
+Word
+BasicBitVector<Word>::nextOne(Word x) {
+    if (rle && frontier.bit_pos > x && skips.empty())
+        buildSkips();
+    return nextOne(x, frontier);
+}
+
+template <class Word>
 void
-BitVector::flip() {
+BasicBitVector<Word>::flip() {
     if (!rle)
         compress();
-    for(vector<word_t>::iterator it = words.begin(); it!=words.end(); ++it) {
-        if (*it & BIT1) { // fill word - flip BIT2
-            if (*it & BIT2) { // 1-fill
-                // convert to 0-fill
-                *it &= ~BIT2;
-            }
-            else {
-                // convert to 1-fill
-                *it |= BIT2;
-            }
-        }
-        else { // literal word - flip all bits
-            *it = ~*it;
-        }
-    }
-    count = size-count;
+    Word ones = cnt(); // count may not be up to date
+    skips.clear();
+    // fills flip BIT2, literals flip all their bits
+    wahFlip(words.data(), words.size());
+    // keep the unused bits of a partial literal at the end clear
+    Word used = size % LITERAL_SIZE;
+    if (used > 0 && !words.empty() && !(words.back() & BIT1))
+        words.back() &= ALL1S & ~(((Word)1 << (LITERAL_SIZE - used)) - 1);
+    count = size-ones;
 }
 
+template <class Word>
 void
-BitVector::matchSize(BitVector &bv) {
+BasicBitVector<Word>::matchSize(BasicBitVector &bv) {
+    // pad the shorter vector with 0-fills up to the word count of the longer
+    Word n_words = (size + LITERAL_SIZE - 1)/LITERAL_SIZE;
+    Word bv_words = (bv.size + LITERAL_SIZE - 1)/LITERAL_SIZE;
+    // the padded words may move, so the frontier and skips start over
     if (size < bv.size) {
-        word_t gap_words = (bv.size - size)/LITERAL_SIZE;
+        Word gap_words = bv_words - n_words;
         while (gap_words > FILLMASK) {
-            words.push_back(ZEROFULL);
+            words.push_back(BIT1 | FILLMASK);
             gap_words -= FILLMASK;
         }
         if (gap_words > 0)
             words.push_back(BIT1 | gap_words);
         size = bv.size;
+        reset();
     }
     else if (size > bv.size) {
-        word_t gap_words = (size - bv.size)/LITERAL_SIZE;
+        Word gap_words = n_words - bv_words;
         while (gap_words > FILLMASK) {
-            bv.words.push_back(ZEROFULL);
+            bv.words.push_back(BIT1 | FILLMASK);
             gap_words -= FILLMASK;
         }
         if (gap_words > 0)
             bv.words.push_back(BIT1 | gap_words);
         bv.size = size;
+        bv.reset();
     }
 }
 
+// bitwise OR of two rle BitVectors into res
+template <class Word>
 void
-BitVector::rleORrle(BitVector& bv) {
+BasicBitVector<Word>::rleORrle(BasicBitVector& bv, vector<Word>& res) {
     // ensure that both bvecs are the same size
     this->matchSize(bv);
-    if (size == 0)
+    res.clear();
+    if (size == 0) {
+        res.push_back(0); // empty literal, like an empty rle bitvector
         return;
-    
-    vector<word_t> res; // fill this then swap with this.words
-    vector<word_t>::iterator a = words.begin();
-    vector<word_t>::iterator b = bv.words.begin();
+    }
+
+    typename vector<Word>::iterator a = words.begin();
+    typename vector<Word>::iterator b = bv.words.begin();
 
     // maintain the end position of the current word
-    word_t a_pos = (*a & BIT1) ? (*a & FILLMASK) : 1;
-    word_t b_pos = (*b & BIT1) ? (*b & FILLMASK) : 1;
-    word_t res_pos=0;
-    word_t next_word;
+    Word a_pos = (*a & BIT1) ? (*a & FILLMASK) : 1;
+    Word b_pos = (*b & BIT1) ? (*b & FILLMASK) : 1;
+    Word res_pos=0;
+    Word next_word;
     bool incr_a = false;
     bool incr_b = false;
-    word_t last_pos = size/LITERAL_SIZE;
+    // a partial literal at the end counts as a word
+    Word last_pos = (size + LITERAL_SIZE - 1)/LITERAL_SIZE;
     while(res_pos != last_pos) {
         if (incr_a) {
             while(a_pos <= res_pos) {
@@ -270,6 +300,11 @@ BitVector::rleORrle(BitVector& bv) {
             }
             incr_b = false;
         }
+        if (opLiterals(a, a_pos, b, b_pos, res_pos, OR, res)) {
+            if (res_pos == last_pos)
+                break;
+            continue;
+        }
         if (a_pos == b_pos) {
             if ((*a & ONEFILL) == ONEFILL || (*b & ONEFILL) == ONEFILL)
                 next_word = ONEFILL | (a_pos - res_pos);
@@ -283,7 +318,7 @@ BitVector::rleORrle(BitVector& bv) {
                     if (*b & BIT1) // zero fill
                         next_word = *a;
                     else {
-                        word_t u = *a | *b;
+                        Word u = *a | *b;
                         next_word = (u == ALL1S) ? ONEFILL1 : u;
                     }
             incr_a = true;
@@ -326,53 +361,37 @@ BitVector::rleORrle(BitVector& bv) {
                 incr_b = true;
             }
         }
-        if ((next_word & BIT1)
-            && res.size() > 0
-            && (res.back() & BIT1)
-            && (res.back() & BIT2) == (next_word & BIT2)
-            && (res.back() & FILLMASK) < FILLMASK
-        ) {
-            // merge fill words
-            // but just don't exceed the capacity
-            word_t n_words = (res.back() & FILLMASK) + (next_word & FILLMASK);
-            if (n_words >= FILLMASK) {
-                res.back() |= FILLMASK;
-                n_words -= FILLMASK;
-                if (n_words > 0)
-                     res.push_back((next_word & ONEFILL) | n_words);
-            }
-            else
-                res.push_back(next_word);
-        }
+        if (next_word & BIT1) // merge fill words
+            pushFill(res, (next_word & BIT2) != 0, next_word & FILLMASK);
         else
             res.push_back(next_word);
     }
-    words.swap(res);
-    count=0;
-    
-    // decide whether to decompress
 }
 
-// in place version of the bitwise AND operator.
+// bitwise AND of two rle BitVectors into res
+template <class Word>
 void
-BitVector::rleANDrle(BitVector& bv) {
+BasicBitVector<Word>::rleANDrle(BasicBitVector& bv, vector<Word>& res) {
     // ensure that both bvecs are the same size
     this->matchSize(bv);
-    if (size == 0)
+    res.clear();
+    if (size == 0) {
+        res.push_back(0); // empty literal, like an empty rle bitvector
         return;
-    
-    vector<word_t> res; // fill this then swap with this.words
-    vector<word_t>::iterator a = words.begin();
-    vector<word_t>::iterator b = bv.words.begin();
+    }
+
+    typename vector<Word>::iterator a = words.begin();
+    typename vector<Word>::iterator b = bv.words.begin();
 
     // maintain the end position of the current word
-    word_t a_pos = (*a & BIT1) ? *a & FILLMASK : 1;
-    word_t b_pos = (*b & BIT1) ? *b & FILLMASK : 1;
-    word_t res_pos=0;
-    word_t next_word;
+    Word a_pos = (*a & BIT1) ? *a & FILLMASK : 1;
+    Word b_pos = (*b & BIT1) ? *b & FILLMASK : 1;
+    Word res_pos=0;
+    Word next_word;
     bool incr_a = false;
     bool incr_b = false;
-    word_t last_pos = size/LITERAL_SIZE;
+    // a partial literal at the end counts as a word
+    Word last_pos = (size + LITERAL_SIZE - 1)/LITERAL_SIZE;
     while(res_pos != last_pos) {
         if (incr_a) {
             while(a_pos <= res_pos) {
@@ -388,14 +407,24 @@ BitVector::rleANDrle(BitVector& bv) {
             }
             incr_b = false;
         }
+        if (opLiterals(a, a_pos, b, b_pos, res_pos, AND, res)) {
+            if (res_pos == last_pos)
+                break;
+            continue;
+        }
         if (a_pos == b_pos) {
             if ((*a & ONEFILL) == ONEFILL && (*b & ONEFILL) == ONEFILL)
                 next_word = ONEFILL | (a_pos - res_pos);
+            else if ((*a & ONEFILL) == ONEFILL) // a 1-fill passes b through
+                next_word = (*b & BIT1) ? BIT1 | (a_pos - res_pos) : *b;
+            else if ((*b & ONEFILL) == ONEFILL)
+                next_word = (*a & BIT1) ? BIT1 | (a_pos - res_pos) : *a;
             else if ((*a & BIT1) || (*b & BIT1))
                 next_word = BIT1 | (a_pos - res_pos);
             else {
-                word_t u = *a & *b;
-                next_word = (u == 0) ? BIT1 | 1 : u;
+                // a partial literal at the end stays a literal
+                Word u = *a & *b;
+                next_word = (u == 0 && a_pos * LITERAL_SIZE <= size) ? BIT1 | 1 : u;
             }
             incr_a = true;
             incr_b = true;
@@ -437,151 +466,518 @@ BitVector::rleANDrle(BitVector& bv) {
                 incr_b = true;
             }
         }
-        if ((next_word & BIT1)
-            && res.size() > 0
-            && (res.back() & BIT1)
-            && (res.back() & BIT2) == (next_word & BIT2)
-            && (res.back() & FILLMASK) < FILLMASK
-        ) {
-            // merge fill words
-            // but just don't exceed the capacity
-            word_t n_words = (res.back() & FILLMASK) + (next_word & FILLMASK);
-            if (n_words >= FILLMASK) {
-                res.back() |= FILLMASK;
-                n_words -= FILLMASK;
-                if (n_words > 0)
-                     res.push_back((next_word & ONEFILL) | n_words);
+        if (next_word & BIT1) // merge fill words
+            pushFill(res, (next_word & BIT2) != 0, next_word & FILLMASK);
+        else
+            res.push_back(next_word);
+    }
+}
+
+// bitwise XOR or ANDNOT of two rle BitVectors into res. both vectors
+// advance together to the end of whichever word ends first, so runs of
+// fills in both cost one step
+template <class Word>
+void
+BasicBitVector<Word>::rleOPrle(BasicBitVector& bv, Op op, vector<Word>& res) {
+    // ensure that both bvecs are the same size
+    this->matchSize(bv);
+    res.clear();
+    if (size == 0) {
+        res.push_back(0); // empty literal, like an empty rle bitvector
+        return;
+    }
+    typename vector<Word>::iterator a = words.begin();
+    typename vector<Word>::iterator b = bv.words.begin();
+
+    // maintain the end position of the current word
+    Word a_pos = (*a & BIT1) ? *a & FILLMASK : 1;
+    Word b_pos = (*b & BIT1) ? *b & FILLMASK : 1;
+    Word res_pos = 0;
+    // a partial literal at the end counts as a word
+    Word last_pos = (size + LITERAL_SIZE - 1)/LITERAL_SIZE;
+    for (;;) {
+        if (opLiterals(a, a_pos, b, b_pos, res_pos, op, res)) {
+            if (res_pos == last_pos)
+                break;
+            continue;
+        }
+        Word next_pos = (a_pos < b_pos) ? a_pos : b_pos;
+        // a fill is a run of words that are all 0s or all 1s
+        Word x = (*a & BIT1) ? (*a & BIT2) ? ALL1S : 0 : *a;
+        Word y = (*b & BIT1) ? (*b & BIT2) ? ALL1S : 0 : *b;
+        Word z = (op == XOR) ? x ^ y : x & ~y & ALL1S;
+        if ((*a & BIT1) && (*b & BIT1))
+            pushFill(res, z != 0, next_pos - res_pos);
+        else if (next_pos * LITERAL_SIZE > size) {
+            // a partial literal at the end stays a literal, with 0s past size
+            Word unused = next_pos * LITERAL_SIZE - size;
+            res.push_back(z & ~(((Word)1 << unused) - 1));
+        }
+        else
+            pushWord(res, z);
+        res_pos = next_pos;
+        if (res_pos == last_pos)
+            break;
+        if (a_pos == res_pos) {
+            ++a;
+            a_pos += (*a & BIT1) ? *a & FILLMASK : 1;
+        }
+        if (b_pos == res_pos) {
+            ++b;
+            b_pos += (*b & BIT1) ? *b & FILLMASK : 1;
+        }
+    }
+}
+
+template <class Word>
+bool
+BasicBitVector<Word>::opLiterals(typename vector<Word>::iterator& a, Word& a_pos,
+                      typename vector<Word>::iterator& b, Word& b_pos,
+                      Word& res_pos, Op op, vector<Word>& res) {
+    // a partial literal at the end is left to the caller
+    Word full = size / LITERAL_SIZE;
+    if (((*a | *b) & BIT1) || res_pos >= full)
+        return false;
+    size_t n = 1;
+    while (res_pos + n < full && !((a[n] | b[n]) & BIT1))
+        n++;
+    Word buf[256];
+    for (size_t done = 0; done < n; done += 256) {
+        size_t m = (n - done < 256) ? n - done : 256;
+        literalOp(op, &a[done], &b[done], buf, m);
+        for (size_t i = 0; i < m; i++)
+            pushWord(res, buf[i]);
+    }
+    res_pos += n;
+    if (res_pos < (size + LITERAL_SIZE - 1)/LITERAL_SIZE) {
+        a += n;
+        b += n;
+        a_pos = res_pos + ((*a & BIT1) ? *a & FILLMASK : 1);
+        b_pos = res_pos + ((*b & BIT1) ? *b & FILLMASK : 1);
+    }
+    return true;
+}
+
+template <class Word>
+void
+BasicBitVector<Word>::andAll(vector<BasicBitVector*>& inputs, BasicBitVector& res) {
+    combineAll(inputs, true, res);
+}
+
+template <class Word>
+void
+BasicBitVector<Word>::orAll(vector<BasicBitVector*>& inputs, BasicBitVector& res) {
+    combineAll(inputs, false, res);
+}
+
+// walk the words of all the inputs together. a fill of the absorbing bit
+// (0 for AND, 1 for OR) decides the result up to its end, so the result
+// gets the longest such fill and every input skips to its end. if all the
+// inputs are at fills of the other bit, so is the result up to the first
+// of them to end. otherwise the literals are combined one word at a time.
+template <class Word>
+void
+BasicBitVector<Word>::combineAll(vector<BasicBitVector*>& inputs, bool isAnd, BasicBitVector& res) {
+    const size_t n = inputs.size();
+    res.words.clear();
+    res.rle = true;
+    res.size = 0;
+    bool all_rle = true;
+    for (size_t i=0; i < n; i++) {
+        if (inputs[i]->size > res.size)
+            res.size = inputs[i]->size;
+        all_rle = all_rle && inputs[i]->rle;
+    }
+    if (n > 0 && !all_rle) { // fold them pairwise
+        vector<Word> scratch;
+        res.copy(*inputs[0]);
+        for (size_t i=1; i < n; i++)
+            if (isAnd)
+                res.andWith(*inputs[i], scratch);
+            else
+                res.orWith(*inputs[i], scratch);
+        return;
+    }
+    const Word absorb = isAnd ? BIT1 : ONEFILL;
+    const Word last_pos = (res.size + LITERAL_SIZE - 1)/LITERAL_SIZE;
+    // the current word of each input and its end position in words. an
+    // input that runs out continues as a 0-fill
+    vector<typename vector<Word>::iterator> at(n);
+    vector<Word> cur(n);
+    vector<Word> end(n);
+    for (size_t i=0; i < n; i++) {
+        at[i] = inputs[i]->words.begin();
+        cur[i] = (at[i] == inputs[i]->words.end()) ? BIT1 : *at[i];
+        end[i] = (at[i] == inputs[i]->words.end()) ? last_pos
+               : (cur[i] & BIT1) ? cur[i] & FILLMASK : 1;
+    }
+    Word pos = 0;
+    while (pos < last_pos) {
+        Word jump = pos; // end of the longest absorbing fill
+        Word step = last_pos; // end of the first other fill
+        bool all_fills = true;
+        for (size_t i=0; i < n; i++) {
+            if (!(cur[i] & BIT1))
+                all_fills = false;
+            else if ((cur[i] & ONEFILL) == absorb) {
+                if (end[i] > jump) jump = end[i];
             }
+            else if (end[i] < step)
+                step = end[i];
+        }
+        if (jump > pos) {
+            pushFill(res.words, !isAnd, jump - pos);
+            pos = jump;
+        }
+        else if (all_fills) {
+            pushFill(res.words, isAnd, step - pos);
+            pos = step;
+        }
+        else {
+            // the other fills pass the literals through
+            Word word = isAnd ? ALL1S : 0;
+            for (size_t i=0; i < n; i++)
+                if (!(cur[i] & BIT1))
+                    word = isAnd ? word & cur[i] : word | cur[i];
+            pos++;
+            if (pos * LITERAL_SIZE > res.size) // a partial literal at the end stays a literal
+                res.words.push_back(word);
             else
-                res.push_back(next_word);
+                pushWord(res.words, word);
+        }
+        if (pos == last_pos) break;
+        for (size_t i=0; i < n; i++) {
+            while (end[i] <= pos) {
+                if (++at[i] == inputs[i]->words.end()) {
+                    cur[i] = BIT1;
+                    end[i] = last_pos;
+                }
+                else {
+                    cur[i] = *at[i];
+                    end[i] += (cur[i] & BIT1) ? cur[i] & FILLMASK : 1;
+                }
+            }
         }
-        else
-            res.push_back(next_word);
     }
-    words.swap(res);
-    count=0;
+    if (res.words.empty())
+        res.words.push_back(0); // empty literal, like an empty rle bitvector
+    res.reset();
 }
 
+template <class Word>
 bool
-BitVector::find(word_t x) {
+BasicBitVector<Word>::find(Word x, Cursor& cur) const {
     if (!rle) return binary_search(words.begin(), words.end(), x);
     // This function may be called on a sequence of increasing values
-    // Use a checkpoint to determine if we can start at the active word
-    // or if we need to go back to words.begin().
-    if (frontier.bit_pos > x) {
-        frontier.active_word = words.begin();
-        frontier.bit_pos = 0;
-    }
-    while(frontier.active_word != words.end()) {
+    // Use the cursor to determine if we can start at its word or if we
+    // need to go back, through the skip index if there is one.
+    seek(x, cur);
+    for (; cur.word < words.size(); cur.word++) {
+        Word word = words[cur.word];
         // what type of word is it?
-        if (*(frontier.active_word) & BIT1) { // fill word
-            word_t span = (*(frontier.active_word) & FILLMASK) * LITERAL_SIZE;
-            if (frontier.bit_pos + span >= x) {
-                if (*(frontier.active_word) & BIT2) // 1-fill
+        if (word & BIT1) { // fill word
+            Word span = (word & FILLMASK) * LITERAL_SIZE;
+            if (x < cur.bit_pos + span) {
+                if (word & BIT2) // 1-fill
                     return true;
                 return false;
             }
-            frontier.bit_pos += span;
+            cur.bit_pos += span;
         }
         else { // literal word
-            if (frontier.bit_pos + LITERAL_SIZE >= x) {
-                if ((1UL << (frontier.bit_pos + LITERAL_SIZE - x)) & *(frontier.active_word))
+            if (x < cur.bit_pos + LITERAL_SIZE) {
+                if (((Word)1 << (cur.bit_pos + LITERAL_SIZE - 1 - x)) & word)
                     return true;
                 return false;
             }
-            frontier.bit_pos += LITERAL_SIZE;
+            cur.bit_pos += LITERAL_SIZE;
         }
-        frontier.active_word++;
     }
     return false;
 }
 
-// use the frontier instead of words.back() because we have frontier.bit_pos
-// advance the frontier after appending
+// going back builds the skip index, so that a bitvector probed in random
+// order stops rescanning from the start
+template <class Word>
+bool
+BasicBitVector<Word>::find(Word x) {
+    if (rle && frontier.bit_pos > x && skips.empty())
+        buildSkips();
+    return find(x, frontier);
+}
+
+template <class Word>
 void
-BitVector::appendFill(bool bit, word_t n) {
-    if (bit) count += n;
-    if ((*(frontier.active_word) & BIT1) == 0) { // current word is a literal word
-        word_t bits_available = LITERAL_SIZE - frontier.bit_pos; // size % LITERAL_SIZE;
-//      fprintf(stderr,"bits_available: %u\n",bits_available);
-        if(bit) {
-            // append some ones
-            if (n < bits_available) {
-                size += n;
-                frontier.bit_pos += n;
-                *(frontier.active_word) |= ((1UL << n) - 1) << (bits_available - n);
-                return;
-            }
-            else {
-                size += bits_available;
-                n -= bits_available;
-                frontier.bit_pos = 0;
-                *(frontier.active_word) |= (1 << bits_available) - 1;
-                // the word is full, check if we should convert to a 1-fill
-                if (*(frontier.active_word) == ALL1S) {
-                    *(frontier.active_word) = ONEFILL1;
-                }
-            }
+BasicBitVector<Word>::buildSkips() {
+    skips.clear();
+    if (!rle || words.size() <= SKIP_WORDS) return; // short enough to scan
+    Word pos = 0;
+    Word ones = 0;
+    for (size_t i = 0; i < words.size(); i++) {
+        if (i % SKIP_WORDS == 0) {
+            skips.push_back(pos);
+            skips.push_back(ones);
+        }
+        if (words[i] & BIT1) {
+            Word span = (words[i] & FILLMASK) * LITERAL_SIZE;
+            if (words[i] & BIT2) ones += span;
+            pos += span;
         }
         else {
-            // append some zeros
-            if (n < bits_available) {
-                size += n;
-                frontier.bit_pos += n;
-                return;
-            }
-            else {
-                size += bits_available;
-                n -= bits_available;
-                frontier.bit_pos = 0;
-                // the word is full, check if we should convert to a 0-fill
-                if (*(frontier.active_word) == 0) {
-                    *(frontier.active_word) = ZEROFILL1;
-                }
-            }
+            ones += popCount(words[i]);
+            pos += LITERAL_SIZE;
         }
     }
-//  print();
-    if (n==0) return;
-    // append/update fill words
-    word_t n_fills = n/LITERAL_SIZE;
-    if (n_fills > 0) {
-        if (bit) {
-            if (*(frontier.active_word) & ONEFILL) { // extend previous 1-fill
-                *(frontier.active_word) += n_fills;
-            }
-            else { // append a 1-fill
-                words.push_back(ONEFILL | n_fills);
-                frontier.active_word = words.end() - 1;
-            }
+}
+
+template <class Word>
+size_t
+BasicBitVector<Word>::findSkip(Word x, bool byRank) const {
+    size_t lo = 0, hi = skips.size() / 2;
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (skips[2*mid + byRank] <= x)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// going back or far ahead uses the skip index if it's there
+template <class Word>
+void
+BasicBitVector<Word>::seek(Word x, Cursor& cur) const {
+    bool back = cur.bit_pos > x;
+    if (!back && x - cur.bit_pos < SKIP_WORDS * LITERAL_SIZE)
+        return;
+    if (skips.empty()) {
+        if (back)
+            cur = Cursor();
+        return;
+    }
+    size_t i = findSkip(x, false);
+    if (back || skips[2*i] > cur.bit_pos) {
+        cur.word = i * SKIP_WORDS;
+        cur.bit_pos = skips[2*i];
+    }
+}
+
+template <class Word>
+Word
+BasicBitVector<Word>::rank(Word x) const {
+    if (!rle) return lower_bound(words.begin(), words.end(), x) - words.begin();
+    size_t w = 0;
+    Word pos = 0;
+    Word ones = 0;
+    if (!skips.empty()) {
+        size_t i = findSkip(x, false);
+        w = i * SKIP_WORDS;
+        pos = skips[2*i];
+        ones = skips[2*i + 1];
+    }
+    for (; w < words.size() && pos < x; w++) {
+        if (words[w] & BIT1) {
+            Word span = (words[w] & FILLMASK) * LITERAL_SIZE;
+            if (words[w] & BIT2)
+                ones += (x - pos < span) ? x - pos : span;
+            pos += span;
         }
         else {
-            if (*(frontier.active_word) & BIT1 && !(*frontier.active_word & BIT2)) { // extend previous 0-fill
-                *(frontier.active_word) += n_fills;
+            if (x - pos < LITERAL_SIZE) // the leading x - pos bits
+                return ones + popCount(words[w] >> (LITERAL_SIZE - (x - pos)));
+            ones += popCount(words[w]);
+            pos += LITERAL_SIZE;
+        }
+    }
+    return ones;
+}
+
+template <class Word>
+Word
+BasicBitVector<Word>::select(Word i) const {
+    if (!rle) return (i < words.size()) ? words[i] : size;
+    size_t w = 0;
+    Word pos = 0;
+    Word ones = 0;
+    if (!skips.empty()) {
+        size_t s = findSkip(i, true);
+        w = s * SKIP_WORDS;
+        pos = skips[2*s];
+        ones = skips[2*s + 1];
+    }
+    for (; w < words.size(); w++) {
+        if (words[w] & BIT1) {
+            Word span = (words[w] & FILLMASK) * LITERAL_SIZE;
+            if (words[w] & BIT2) {
+                if (i - ones < span)
+                    return pos + (i - ones);
+                ones += span;
             }
-            else { // append a 1-fill
-                words.push_back(BIT1 | n_fills);
-                frontier.active_word = words.end()-1;
+            pos += span;
+        }
+        else {
+            Word word = words[w];
+            Word c = popCount(word);
+            if (i - ones < c) {
+                // drop the leading set bits before the one we want
+                for (Word r = i - ones; r > 0; r--)
+                    word &= ~((Word)1 << (WORD_SIZE - 1 - leadingZeros(word)));
+                return pos + leadingZeros(word) - 1;
             }
+            ones += c;
+            pos += LITERAL_SIZE;
+        }
+    }
+    return size;
+}
+
+// append n copies of bit. Only the last word may be a partial literal, so
+// the number of bits already used in it is size % LITERAL_SIZE.
+template <class Word>
+void
+BasicBitVector<Word>::appendFill(bool bit, Word n) {
+    if (n == 0) return;
+    if (size == 0) words.clear(); // drop the empty placeholder literal
+    skips.clear();
+    if (bit) count = cnt() + n;
+    Word used = size % LITERAL_SIZE;
+    if (used > 0) { // top up the partial literal word
+        Word bits_available = LITERAL_SIZE - used;
+        Word take = (n < bits_available) ? n : bits_available;
+        if (bit)
+            words.back() |= (((Word)1 << take) - 1) << (bits_available - take);
+        size += take;
+        n -= take;
+        if (take == bits_available) {
+            // the literal is full, check if we should convert it to a fill
+            Word last = words.back();
+            words.pop_back();
+            pushWord(words, last);
         }
+    }
+    // append/update fill words
+    Word n_fills = n/LITERAL_SIZE;
+    if (n_fills > 0) {
+        pushFill(words, bit, n_fills);
         n -= n_fills*LITERAL_SIZE;
         size += n_fills*LITERAL_SIZE;
     }
     // add the remaining bits to a literal word
-    if (n>0) {
+    if (n > 0) {
         if (bit)
-            words.push_back(((1<<n)-1) << (LITERAL_SIZE - n));
+            words.push_back((((Word)1 << n) - 1) << (LITERAL_SIZE - n));
         else
             words.push_back(0);
         size += n;
-        frontier.active_word = words.end() - 1;
-        frontier.bit_pos = n;
     }
+    frontier = Cursor();
+}
+
+// append the leading nbits of word. Used by the bit slice encoder to emit
+// 31 rows at a time, and to concatenate vectors that aren't word aligned.
+template <class Word>
+void
+BasicBitVector<Word>::appendWord(Word word, Word nbits) {
+    if (nbits == 0) return;
+    if (size == 0) words.clear();
+    skips.clear();
+    word &= ALL1S & ~(((Word)1 << (LITERAL_SIZE - nbits)) - 1);
+    if (word) count = cnt() + popCount(word);
+    Word used = size % LITERAL_SIZE;
+    if (used == 0) {
+        if (nbits == LITERAL_SIZE)
+            pushWord(words, word);
+        else
+            words.push_back(word);
+        size += nbits;
+    }
+    else {
+        Word bits_available = LITERAL_SIZE - used;
+        words.back() |= word >> used;
+        if (nbits < bits_available) {
+            size += nbits;
+        }
+        else {
+            size += bits_available;
+            nbits -= bits_available;
+            Word last = words.back();
+            words.pop_back();
+            pushWord(words, last);
+            if (nbits > 0) {
+                words.push_back((word << bits_available) & ALL1S);
+                size += nbits;
+            }
+        }
+    }
+    frontier = Cursor();
 }
 
-word_t BitVector::cnt() {
+// concatenate bv onto the end of this rle bitvector
+template <class Word>
+void
+BasicBitVector<Word>::append(const BasicBitVector& bv) {
+    if (!bv.rle) {
+        BasicBitVector tmp;
+        tmp.copy(bv);
+        tmp.compress();
+        append(tmp);
+        return;
+    }
+    Word remaining = bv.size;
+    for (typename vector<Word>::const_iterator ii = bv.words.begin();
+            ii != bv.words.end() && remaining > 0; ++ii) {
+        if (*ii & BIT1) {
+            Word nbits = LITERAL_SIZE*(*ii & FILLMASK);
+            if (nbits > remaining) nbits = remaining;
+            appendFill((*ii & ONEFILL) == ONEFILL, nbits);
+            remaining -= nbits;
+        }
+        else {
+            Word nbits = (remaining < LITERAL_SIZE) ? remaining : LITERAL_SIZE;
+            appendWord(*ii, nbits);
+            remaining -= nbits;
+        }
+    }
+}
+
+// append a complete literal word, collapsing it into a fill if possible
+template <class Word>
+void
+BasicBitVector<Word>::pushWord(vector<Word>& words, Word word) {
+    if (word == 0)
+        pushFill(words, false, 1);
+    else if (word == ALL1S)
+        pushFill(words, true, 1);
+    else
+        words.push_back(word);
+}
+
+// append n fill words, extending the last word if it is a matching fill
+template <class Word>
+void
+BasicBitVector<Word>::pushFill(vector<Word>& words, bool bit, Word n) {
+    Word fill = bit ? ONEFILL : BIT1;
+    if (!words.empty() && (words.back() & ONEFILL) == fill) {
+        Word room = FILLMASK - (words.back() & FILLMASK);
+        Word add = (n < room) ? n : room;
+        words.back() += add;
+        n -= add;
+    }
+    while (n > 0) {
+        Word add = (n < FILLMASK) ? n : FILLMASK;
+        words.push_back(fill | add);
+        n -= add;
+    }
+}
+
+template <class Word>
+Word BasicBitVector<Word>::cnt() {
+   if (!rle) return count = words.size();
    if (count == 0)
-       for(vector<word_t>::iterator it = words.begin(); it != words.end(); ++it)
-           count += (*it & BIT2) ? (*it & BIT1) ? (*it & FILLMASK) * LITERAL_SIZE : 0 : __builtin_popcount(*it);
+       count = wahCount(words.data(), words.size());
    return count;
 }
+
+template class BasicBitVector<uint32_t>;
+template class BasicBitVector<uint64_t>;
@@ -1,22 +1,22 @@
 #ifndef SNAPDRAGON_BVEC32_H
 #define SNAPDRAGON_BVEC32_H
 
-#include <stdint.h>
+#include "bvec.h"
 
-#define DEBUG false
+// the constants of the 32 bit BitVector, for code that reads its words
+const word_t WORD_SIZE    = BitVector::WORD_SIZE;
+const word_t LITERAL_SIZE = BitVector::LITERAL_SIZE;
+const word_t BIT1         = BitVector::BIT1;
+const word_t BIT2         = BitVector::BIT2;
+const word_t FILLMASK     = BitVector::FILLMASK;
+const word_t ALL1S        = BitVector::ALL1S;
+const word_t ONEFILL      = BitVector::ONEFILL;
+const word_t ONEFILL1     = BitVector::ONEFILL1;
+const word_t ONEFULL      = BitVector::ONEFULL;
+const word_t ZEROFULL     = BitVector::ZEROFULL;
+const word_t ZEROFILL1    = BitVector::ZEROFILL1;
 
-#define WORD_SIZE               32
-#define LITERAL_SIZE            31
-#define BIT1          0x80000000UL
-#define BIT2          0x40000000UL
-#define FILLMASK      0x3FFFFFFFUL
-#define ALL1S         0x7FFFFFFFUL
-#define ONEFILL       0xC0000000UL
-#define ONEFILL1      0xC0000001UL
-#define ONEFULL       0xFFFFFFFFUL
-#define ZEROFULL      0xAFFFFFFFUL
-#define ZEROFILL1     0x80000001UL
+// words between the entries of the skip index of a compressed BitVector
+const word_t SKIP_WORDS   = BitVector::SKIP_WORDS;
 
-typedef uint32_t word_t;
-
-#endif // SNAPDRAGON_BVEC32_H
\ No newline at end of file
+#endif // SNAPDRAGON_BVEC32_H
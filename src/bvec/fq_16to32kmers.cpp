@@ -5,7 +5,7 @@
 #include <vector>
 #include <algorithm>
 #include "kseq.h"
-#include "bvec64.h"
+#include "bvec.h"
 using namespace std;
 
 inline uint64_t revcomp(uint64_t val) {
@@ -63,7 +63,7 @@ int main(int argc, char *argv[])
 	}
 	unsigned int qual = atoi(argv[3]);
 	seq = kseq_init(fp);
-	vector<bvec64*> seq2vec;
+	vector<BitVector64*> seq2vec;
 	uint64_t kmask = (k==32) ? 0xFFFFFFFFFFFFFFFF : ((uint64_t)1 << (2*k)) - 1;
 
 	while ((length = kseq_read(seq)) >= 0) {
@@ -95,14 +95,14 @@ int main(int argc, char *argv[])
 					merged.push_back(*ki);
 				ki++;
 			}
-			seq2vec.push_back(new bvec64(merged));
+			seq2vec.push_back(new BitVector64(merged));
 		}
 	}
 	kseq_destroy(seq);
 	gzclose(fp);
 	printf("finished reading %i-mers from %zi sequences\n",k,seq2vec.size());
-	vector<bvec64*>::iterator si = seq2vec.begin();
-	bvec64 *merged = *si;
+	vector<BitVector64*>::iterator si = seq2vec.begin();
+	BitVector64 *merged = *si;
 	++si;
 	while (si != seq2vec.end()) {
 		*merged |= **si;
@@ -0,0 +1,486 @@
+#include "bvec32.h"
+#include "hybrid.h"
+
+// the first set (or clear) bit at or after x in a chunk's bitmap, or
+// HYBRID_CHUNK if there is none. bit x is bit x % 64 of word x / 64
+static uint32_t nextBit(const vector<uint64_t>& words, uint32_t x, bool set) {
+    if (x >= HYBRID_CHUNK) return HYBRID_CHUNK;
+    size_t i = x >> 6;
+    uint64_t word = (set ? words[i] : ~words[i]) & (~0ULL << (x & 63));
+    while (word == 0) {
+        if (++i == HYBRID_WORDS) return HYBRID_CHUNK;
+        word = set ? words[i] : ~words[i];
+    }
+    return (i << 6) + __builtin_ctzll(word);
+}
+
+// set bits [from, to) of a chunk's bitmap
+static void setRange(vector<uint64_t>& words, uint32_t from, uint32_t to) {
+    if (from >= to) return;
+    size_t first = from >> 6;
+    size_t last = (to - 1) >> 6;
+    uint64_t head = ~0ULL << (from & 63);
+    uint64_t tail = ~0ULL >> (63 - ((to - 1) & 63));
+    if (first == last) {
+        words[first] |= head & tail;
+        return;
+    }
+    words[first] |= head;
+    for (size_t i = first + 1; i < last; i++)
+        words[i] = ~0ULL;
+    words[last] |= tail;
+}
+
+// append the run [start, end] to runs, joining it to the last run if they
+// touch
+static void pushRun(vector<uint16_t>& runs, uint32_t start, uint32_t end) {
+    if (!runs.empty()) {
+        uint32_t last_end = runs[runs.size() - 2] + runs.back();
+        if (start <= last_end + 1) {
+            if (end > last_end)
+                runs.back() = end - runs[runs.size() - 2];
+            return;
+        }
+    }
+    runs.push_back(start);
+    runs.push_back(end - start);
+}
+
+bool HybridBitVector::Container::contains(uint16_t x) const {
+    if (type == ARRAY)
+        return binary_search(values.begin(), values.end(), x);
+    if (type == BITMAP)
+        return (bits[x >> 6] >> (x & 63)) & 1;
+    // the last run that starts at or before x
+    size_t lo = 0, hi = values.size() / 2;
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (values[2*mid] <= x)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return hi > 0 && values[2*lo] <= x && x <= (uint32_t)values[2*lo] + values[2*lo + 1];
+}
+
+uint32_t HybridBitVector::Container::nextOne(uint32_t x) const {
+    if (type == ARRAY) {
+        vector<uint16_t>::const_iterator it = lower_bound(values.begin(), values.end(), x);
+        return (it == values.end()) ? HYBRID_CHUNK : *it;
+    }
+    if (type == BITMAP)
+        return nextBit(bits, x, true);
+    // the first run that ends at or after x
+    size_t lo = 0, hi = values.size() / 2;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if ((uint32_t)values[2*mid] + values[2*mid + 1] < x)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == values.size() / 2) return HYBRID_CHUNK;
+    return (values[2*lo] > x) ? values[2*lo] : x;
+}
+
+uint32_t HybridBitVector::Container::rank(uint32_t x) const {
+    if (type == ARRAY)
+        return lower_bound(values.begin(), values.end(), x) - values.begin();
+    uint32_t ones = 0;
+    if (type == BITMAP) {
+        for (size_t i = 0; i < (x >> 6); i++)
+            ones += __builtin_popcountll(bits[i]);
+        if (x & 63)
+            ones += __builtin_popcountll(bits[x >> 6] & ((1ULL << (x & 63)) - 1));
+        return ones;
+    }
+    for (size_t i = 0; i < values.size() && values[i] < x; i += 2) {
+        uint32_t len = values[i + 1] + 1;
+        ones += (x - values[i] < len) ? x - values[i] : len;
+    }
+    return ones;
+}
+
+uint16_t HybridBitVector::Container::select(uint32_t i) const {
+    if (type == ARRAY)
+        return values[i];
+    if (type == BITMAP) {
+        for (size_t w = 0; ; w++) {
+            uint32_t c = __builtin_popcountll(bits[w]);
+            if (i < c) {
+                uint64_t word = bits[w];
+                for (; i > 0; i--)
+                    word &= word - 1; // drop the lowest set bit
+                return (w << 6) + __builtin_ctzll(word);
+            }
+            i -= c;
+        }
+    }
+    for (size_t r = 0; ; r += 2) {
+        uint32_t len = values[r + 1] + 1;
+        if (i < len)
+            return values[r] + i;
+        i -= len;
+    }
+}
+
+void HybridBitVector::Container::toBitmap(vector<uint64_t>& words) const {
+    if (type == BITMAP) {
+        words = bits;
+        return;
+    }
+    words.assign(HYBRID_WORDS, 0);
+    if (type == ARRAY)
+        for (size_t i = 0; i < values.size(); i++)
+            words[values[i] >> 6] |= 1ULL << (values[i] & 63);
+    else
+        for (size_t i = 0; i < values.size(); i += 2)
+            setRange(words, values[i], (uint32_t)values[i] + values[i + 1] + 1);
+}
+
+// pick the smallest container for the bits. may take the words
+void HybridBitVector::Container::fromBitmap(vector<uint64_t>& words) {
+    uint32_t ones = 0;
+    uint32_t nruns = 0;
+    uint64_t carry = 0; // the last bit of the previous word
+    for (size_t i = 0; i < HYBRID_WORDS; i++) {
+        uint64_t w = words[i];
+        ones += __builtin_popcountll(w);
+        nruns += __builtin_popcountll(w & ~((w << 1) | carry)); // run starts
+        carry = w >> 63;
+    }
+    card = ones;
+    values.clear();
+    bits.clear();
+    size_t array_bytes = (ones <= HYBRID_ARRAY_MAX) ? 2 * ones : 8 * HYBRID_WORDS + 1;
+    size_t run_bytes = 4 * nruns;
+    if (run_bytes < array_bytes && run_bytes < 8 * HYBRID_WORDS) {
+        type = RUNS;
+        for (uint32_t x = nextBit(words, 0, true); x < HYBRID_CHUNK; ) {
+            uint32_t end = nextBit(words, x, false);
+            values.push_back(x);
+            values.push_back(end - x - 1);
+            x = nextBit(words, end, true);
+        }
+    }
+    else if (array_bytes <= 8 * HYBRID_WORDS) {
+        type = ARRAY;
+        values.reserve(ones);
+        for (size_t i = 0; i < HYBRID_WORDS; i++)
+            for (uint64_t w = words[i]; w; w &= w - 1)
+                values.push_back((i << 6) + __builtin_ctzll(w));
+    }
+    else {
+        type = BITMAP;
+        bits.swap(words);
+    }
+}
+
+size_t HybridBitVector::Container::bytes() const {
+    return 2 * values.size() + 8 * bits.size();
+}
+
+HybridBitVector::HybridBitVector(BitVector& bv) : size(0), pendingKey(-1) {
+    vector<word_t>& words = bv.getWords();
+    if (!bv.compressed()) {
+        // runs of consecutive positions
+        for (size_t i = 0; i < words.size(); ) {
+            size_t j = i + 1;
+            while (j < words.size() && words[j] == words[j - 1] + 1) j++;
+            append(words[i], j - i);
+            i = j;
+        }
+    }
+    else {
+        word_t pos = 0;
+        for (size_t i = 0; i < words.size(); i++) {
+            if (words[i] & BIT1) {
+                word_t span = (words[i] & FILLMASK) * LITERAL_SIZE;
+                if (words[i] & BIT2)
+                    append(pos, span);
+                pos += span;
+            }
+            else {
+                // the first bit is 1 << 30
+                word_t word = words[i];
+                while (word) {
+                    word_t lead = __builtin_clz(word) - 1;
+                    word_t ones = __builtin_clz(~(word << (lead + 1)));
+                    append(pos + lead, ones);
+                    word &= ((word_t)1 << (LITERAL_SIZE - lead - ones)) - 1;
+                }
+                pos += LITERAL_SIZE;
+            }
+        }
+    }
+    finish();
+    // a vector of sorted positions reports its last position as its size
+    setSize(bv.getSize());
+}
+
+void HybridBitVector::append(word_t from, word_t n) {
+    word_t to = from + n;
+    while (from < to) {
+        int32_t key = from >> 16;
+        if (key != pendingKey) {
+            flushPending();
+            pending.assign(HYBRID_WORDS, 0);
+            pendingKey = key;
+        }
+        uint64_t chunk_end = ((uint64_t)key + 1) << 16;
+        word_t end = (to < chunk_end) ? to : chunk_end;
+        setRange(pending, from & 0xFFFF, end - ((word_t)key << 16));
+        from = end;
+    }
+    setSize(to);
+}
+
+void HybridBitVector::flushPending() {
+    if (pendingKey < 0) return;
+    chunks.push_back(Container());
+    chunks.back().fromBitmap(pending);
+    if (chunks.back().card == 0)
+        chunks.pop_back();
+    else
+        keys.push_back(pendingKey);
+    pendingKey = -1;
+}
+
+void HybridBitVector::finish() {
+    flushPending();
+    vector<uint64_t>().swap(pending);
+    countBefore();
+}
+
+void HybridBitVector::countBefore() {
+    before.resize(chunks.size());
+    word_t ones = 0;
+    for (size_t c = 0; c < chunks.size(); c++) {
+        before[c] = ones;
+        ones += chunks[c].card;
+    }
+}
+
+void HybridBitVector::toBitVector(BitVector& res) const {
+    BitVector empty(true);
+    res.copy(empty);
+    word_t pos = 0;
+    vector<uint64_t> words;
+    for (size_t c = 0; c < chunks.size(); c++) {
+        word_t base = (word_t)keys[c] << 16;
+        const Container& chunk = chunks[c];
+        if (chunk.type == RUNS) {
+            for (size_t i = 0; i < chunk.values.size(); i += 2) {
+                res.appendFill(false, base + chunk.values[i] - pos);
+                res.appendFill(true, chunk.values[i + 1] + 1);
+                pos = base + chunk.values[i] + chunk.values[i + 1] + 1;
+            }
+        }
+        else {
+            chunk.toBitmap(words);
+            for (uint32_t x = nextBit(words, 0, true); x < HYBRID_CHUNK; ) {
+                uint32_t end = nextBit(words, x, false);
+                res.appendFill(false, base + x - pos);
+                res.appendFill(true, end - x);
+                pos = base + end;
+                x = nextBit(words, end, true);
+            }
+        }
+    }
+    res.appendFill(false, size - pos);
+}
+
+bool HybridBitVector::find(word_t x) const {
+    vector<uint16_t>::const_iterator it = lower_bound(keys.begin(), keys.end(), x >> 16);
+    return it != keys.end() && *it == (x >> 16)
+        && chunks[it - keys.begin()].contains(x & 0xFFFF);
+}
+
+word_t HybridBitVector::nextOne(word_t x) const {
+    size_t c = lower_bound(keys.begin(), keys.end(), x >> 16) - keys.begin();
+    if (c < keys.size() && keys[c] == (x >> 16)) {
+        uint32_t next = chunks[c].nextOne(x & 0xFFFF);
+        if (next < HYBRID_CHUNK)
+            return ((word_t)keys[c] << 16) + next;
+        c++;
+    }
+    if (c == keys.size()) return size;
+    return ((word_t)keys[c] << 16) + chunks[c].nextOne(0);
+}
+
+word_t HybridBitVector::rank(word_t x) const {
+    size_t c = lower_bound(keys.begin(), keys.end(), x >> 16) - keys.begin();
+    if (c == keys.size()) return cnt();
+    if (keys[c] > (x >> 16)) return before[c];
+    return before[c] + chunks[c].rank(x & 0xFFFF);
+}
+
+word_t HybridBitVector::select(word_t i) const {
+    if (i >= cnt()) return size;
+    // the last chunk with no more than i set bits before it
+    size_t c = upper_bound(before.begin(), before.end(), i) - before.begin() - 1;
+    return ((word_t)keys[c] << 16) + chunks[c].select(i - before[c]);
+}
+
+word_t HybridBitVector::cnt() const {
+    return chunks.empty() ? 0 : before.back() + chunks.back().card;
+}
+
+size_t HybridBitVector::bytes() const {
+    size_t total = 2 * keys.size() + sizeof(word_t) * before.size();
+    for (size_t c = 0; c < chunks.size(); c++)
+        total += chunks[c].bytes();
+    return total;
+}
+
+void HybridBitVector::containerCounts(size_t counts[3]) const {
+    counts[ARRAY] = counts[BITMAP] = counts[RUNS] = 0;
+    for (size_t c = 0; c < chunks.size(); c++)
+        counts[chunks[c].type]++;
+}
+
+void HybridBitVector::andInto(const HybridBitVector& rhs, HybridBitVector& res) const {
+    combine(rhs, AND, res);
+}
+void HybridBitVector::orInto(const HybridBitVector& rhs, HybridBitVector& res) const {
+    combine(rhs, OR, res);
+}
+void HybridBitVector::xorInto(const HybridBitVector& rhs, HybridBitVector& res) const {
+    combine(rhs, XOR, res);
+}
+void HybridBitVector::andNotInto(const HybridBitVector& rhs, HybridBitVector& res) const {
+    combine(rhs, ANDNOT, res);
+}
+
+// walk the chunks of both in key order. a chunk in only one of them is
+// copied or dropped as the operation says, the others are combined
+void HybridBitVector::combine(const HybridBitVector& rhs, Op op, HybridBitVector& res) const {
+    res.keys.clear();
+    res.chunks.clear();
+    res.size = (size > rhs.size) ? size : rhs.size;
+    size_t i = 0, j = 0;
+    while (i < keys.size() || j < rhs.keys.size()) {
+        bool in_a = i < keys.size() && (j == rhs.keys.size() || keys[i] <= rhs.keys[j]);
+        bool in_b = j < rhs.keys.size() && (i == keys.size() || rhs.keys[j] <= keys[i]);
+        if (in_a && in_b) {
+            res.chunks.push_back(Container());
+            combine(chunks[i], rhs.chunks[j], op, res.chunks.back());
+            if (res.chunks.back().card == 0)
+                res.chunks.pop_back();
+            else
+                res.keys.push_back(keys[i]);
+            i++;
+            j++;
+        }
+        else if (in_a) {
+            if (op != AND) {
+                res.keys.push_back(keys[i]);
+                res.chunks.push_back(chunks[i]);
+            }
+            i++;
+        }
+        else {
+            if (op == OR || op == XOR) {
+                res.keys.push_back(rhs.keys[j]);
+                res.chunks.push_back(rhs.chunks[j]);
+            }
+            j++;
+        }
+    }
+    res.countBefore();
+}
+
+// dispatch on the pair of container types. arrays are merged or probed,
+// runs are intersected or merged as intervals, and anything else goes
+// through a bitmap
+void HybridBitVector::combine(const Container& a, const Container& b, Op op, Container& res) {
+    res.values.clear();
+    res.bits.clear();
+    if (a.type == ARRAY && b.type == ARRAY) {
+        vector<uint16_t>::const_iterator x = a.values.begin(), y = b.values.begin();
+        while (x != a.values.end() && y != b.values.end()) {
+            if (*x < *y) {
+                if (op != AND) res.values.push_back(*x);
+                ++x;
+            }
+            else if (*y < *x) {
+                if (op == OR || op == XOR) res.values.push_back(*y);
+                ++y;
+            }
+            else {
+                if (op == AND || op == OR) res.values.push_back(*x);
+                ++x;
+                ++y;
+            }
+        }
+        if (op != AND)
+            res.values.insert(res.values.end(), x, a.values.end());
+        if (op == OR || op == XOR)
+            res.values.insert(res.values.end(), y, b.values.end());
+        res.type = ARRAY;
+        res.card = res.values.size();
+        if (res.card > HYBRID_ARRAY_MAX) {
+            vector<uint64_t> words;
+            res.toBitmap(words);
+            res.fromBitmap(words);
+        }
+        return;
+    }
+    if (a.type == ARRAY && (op == AND || op == ANDNOT)) {
+        for (size_t i = 0; i < a.values.size(); i++)
+            if (b.contains(a.values[i]) == (op == AND))
+                res.values.push_back(a.values[i]);
+        res.type = ARRAY;
+        res.card = res.values.size();
+        return;
+    }
+    if (b.type == ARRAY && op == AND) {
+        combine(b, a, op, res);
+        return;
+    }
+    if (a.type == RUNS && b.type == RUNS) {
+        // one segment between run boundaries of either at a time
+        const size_t na = a.values.size(), nb = b.values.size();
+        size_t i = 0, j = 0;
+        uint32_t pos = 0;
+        while (i < na || j < nb) {
+            bool in_a = i < na && a.values[i] <= pos;
+            bool in_b = j < nb && b.values[j] <= pos;
+            uint32_t a_next = (i == na) ? HYBRID_CHUNK
+                            : in_a ? (uint32_t)a.values[i] + a.values[i + 1] + 1 : a.values[i];
+            uint32_t b_next = (j == nb) ? HYBRID_CHUNK
+                            : in_b ? (uint32_t)b.values[j] + b.values[j + 1] + 1 : b.values[j];
+            uint32_t next = (a_next < b_next) ? a_next : b_next;
+            bool bit = (op == AND) ? in_a && in_b
+                     : (op == OR)  ? in_a || in_b
+                     : (op == XOR) ? in_a != in_b
+                     : in_a && !in_b;
+            if (bit)
+                pushRun(res.values, pos, next - 1);
+            pos = next;
+            if (in_a && pos == a_next) i += 2;
+            if (in_b && pos == b_next) j += 2;
+        }
+        res.type = RUNS;
+        res.card = 0;
+        for (size_t r = 0; r < res.values.size(); r += 2)
+            res.card += res.values[r + 1] + 1;
+        // many short runs are smaller as an array or a bitmap
+        if ((res.card <= HYBRID_ARRAY_MAX && res.card < res.values.size())
+            || res.values.size() > 4 * HYBRID_WORDS) {
+            vector<uint64_t> words;
+            res.toBitmap(words);
+            res.fromBitmap(words);
+        }
+        return;
+    }
+    vector<uint64_t> x, y;
+    a.toBitmap(x);
+    const vector<uint64_t>& other = (b.type == BITMAP) ? b.bits : (b.toBitmap(y), y);
+    for (size_t i = 0; i < HYBRID_WORDS; i++)
+        x[i] = (op == AND) ? x[i] & other[i]
+             : (op == OR)  ? x[i] | other[i]
+             : (op == XOR) ? x[i] ^ other[i]
+             : x[i] & ~other[i];
+    res.fromBitmap(x);
+}
@@ -0,0 +1,100 @@
+#ifndef SNAPDRAGON_HYBRID_H
+#define SNAPDRAGON_HYBRID_H
+
+#include <stdint.h>
+#include <vector>
+#include "bvec.h"
+
+/*
+    Roaring style alternative to the WAH BitVector. The positions are split
+    into chunks of 2^16 by their high 16 bits, and each chunk with any set
+    bits keeps its low 16 bits in whichever of three containers is smallest:
+
+        ARRAY   sorted positions, up to HYBRID_ARRAY_MAX of them (2 bytes each)
+        BITMAP  HYBRID_WORDS 64 bit words (8 KB)
+        RUNS    sorted pairs of start and length - 1 (4 bytes per run)
+
+    Operations are dispatched on the pair of container types and each
+    result is converted to its smallest container. Any position is reached
+    by a binary search over the chunks, so there is no frontier and nothing
+    is ever decompressed for a mixed operation.
+*/
+
+#define HYBRID_CHUNK      65536
+#define HYBRID_ARRAY_MAX  4096
+#define HYBRID_WORDS      (HYBRID_CHUNK / 64)
+
+class HybridBitVector {
+public:
+    enum Type { ARRAY, BITMAP, RUNS };
+    enum Op { AND, OR, XOR, ANDNOT };
+
+    struct Container {
+        Type             type;
+        uint32_t         card;   // set bits
+        vector<uint16_t> values; // ARRAY: positions. RUNS: start, length - 1
+        vector<uint64_t> bits;   // BITMAP
+
+        Container() : type(ARRAY), card(0) {}
+        bool     contains(uint16_t x) const;
+        // the first set bit >= x, or HYBRID_CHUNK if there is none
+        uint32_t nextOne(uint32_t x) const;
+        // set bits before x, and the position of set bit i (i < card)
+        uint32_t rank(uint32_t x) const;
+        uint16_t select(uint32_t i) const;
+        // expand into (and back from) HYBRID_WORDS words
+        void     toBitmap(vector<uint64_t>& words) const;
+        void     fromBitmap(vector<uint64_t>& words);
+        size_t   bytes() const;
+    };
+
+private:
+    vector<uint16_t>  keys;   // high 16 bits of each chunk, ascending
+    vector<Container> chunks;
+    vector<word_t>    before; // set bits before each chunk, for rank and select
+    word_t            size;   // bits in the uncompressed bitvector
+
+    // the bitmap of the chunk being appended to, see append()
+    vector<uint64_t>  pending;
+    int32_t           pendingKey;
+
+public:
+    HybridBitVector() : size(0), pendingKey(-1) {}
+    // convert a BitVector, compressed or not
+    HybridBitVector(BitVector& bv);
+
+    // set bits [from, from + n), which must be past all the set bits so
+    // far, and extend the size to cover them. call finish() when done
+    void append(word_t from, word_t n);
+    void setSize(word_t n) { if (n > size) size = n; }
+    void finish();
+
+    // back to a compressed BitVector
+    void toBitVector(BitVector& res) const;
+
+    bool   find(word_t x) const;
+    // the first set bit at or after x, or the size if there is none
+    word_t nextOne(word_t x) const;
+    word_t rank(word_t x) const;
+    word_t select(word_t i) const;
+
+    word_t cnt() const;
+    word_t getSize() const { return size; }
+    size_t bytes() const;
+    // how many chunks use each container type
+    void   containerCounts(size_t counts[3]) const;
+
+    // res = this op rhs. res must not be this or rhs
+    void andInto(const HybridBitVector& rhs, HybridBitVector& res) const;
+    void orInto(const HybridBitVector& rhs, HybridBitVector& res) const;
+    void xorInto(const HybridBitVector& rhs, HybridBitVector& res) const;
+    void andNotInto(const HybridBitVector& rhs, HybridBitVector& res) const;
+
+private:
+    void combine(const HybridBitVector& rhs, Op op, HybridBitVector& res) const;
+    static void combine(const Container& a, const Container& b, Op op, Container& res);
+    void flushPending();
+    void countBefore();
+};
+
+#endif // #ifndef SNAPDRAGON_HYBRID_H
@@ -0,0 +1,509 @@
+#include <string.h>
+#include "simd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SNAPDRAGON_X86
+#include <immintrin.h>
+#endif
+
+// the top bit marks a fill, the next one is its fill bit
+#define FILL32      0x80000000U
+#define ONEFILL32   0xC0000000U
+#define FILLBIT32   0x40000000U
+#define FILLMASK32  0x3FFFFFFFU
+#define LITERAL32   0x7FFFFFFFU
+#define FILL64      0x8000000000000000ULL
+#define ONEFILL64   0xC000000000000000ULL
+#define FILLBIT64   0x4000000000000000ULL
+#define FILLMASK64  0x3FFFFFFFFFFFFFFFULL
+#define LITERAL64   0x7FFFFFFFFFFFFFFFULL
+
+/*
+    portable
+*/
+static uint64_t wahCount32Portable(const uint32_t *words, size_t n) {
+    uint64_t ones = 0;
+    for (size_t i = 0; i < n; i++) {
+        uint32_t w = words[i];
+        if (!(w & FILL32))
+            ones += __builtin_popcount(w);
+        else if (w & FILLBIT32)
+            ones += (uint64_t)(w & FILLMASK32) * 31;
+    }
+    return ones;
+}
+
+static uint64_t wahCount64Portable(const uint64_t *words, size_t n) {
+    uint64_t ones = 0;
+    for (size_t i = 0; i < n; i++) {
+        uint64_t w = words[i];
+        if (!(w & FILL64))
+            ones += __builtin_popcountll(w);
+        else if (w & FILLBIT64)
+            ones += (w & FILLMASK64) * 63;
+    }
+    return ones;
+}
+
+static void wahFlip32Portable(uint32_t *words, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        words[i] ^= (words[i] & FILL32) ? FILLBIT32 : LITERAL32;
+}
+
+static void wahFlip64Portable(uint64_t *words, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        words[i] ^= (words[i] & FILL64) ? FILLBIT64 : LITERAL64;
+}
+
+template <class W> static void andPortable(const W *a, const W *b, W *res, size_t n) {
+    for (size_t i = 0; i < n; i++) res[i] = a[i] & b[i];
+}
+template <class W> static void orPortable(const W *a, const W *b, W *res, size_t n) {
+    for (size_t i = 0; i < n; i++) res[i] = a[i] | b[i];
+}
+template <class W> static void xorPortable(const W *a, const W *b, W *res, size_t n) {
+    for (size_t i = 0; i < n; i++) res[i] = a[i] ^ b[i];
+}
+template <class W> static void andNotPortable(const W *a, const W *b, W *res, size_t n) {
+    for (size_t i = 0; i < n; i++) res[i] = a[i] & ~b[i];
+}
+
+// one set bit at a time, from the first (highest) literal bit
+static size_t expand32Portable(const uint32_t *words, size_t n, uint32_t pos, uint32_t *res) {
+    size_t k = 0;
+    for (size_t i = 0; i < n; i++, pos += 31)
+        for (uint32_t w = words[i]; w; ) {
+            int lead = __builtin_clz(w);
+            res[k++] = pos + lead - 1;
+            w ^= 0x80000000U >> lead;
+        }
+    return k;
+}
+
+static size_t expand64Portable(const uint64_t *words, size_t n, uint64_t pos, uint64_t *res) {
+    size_t k = 0;
+    for (size_t i = 0; i < n; i++, pos += 63)
+        for (uint64_t w = words[i]; w; ) {
+            int lead = __builtin_clzll(w);
+            res[k++] = pos + lead - 1;
+            w ^= 0x8000000000000000ULL >> lead;
+        }
+    return k;
+}
+
+static const BitKernels portable = {
+    "portable",
+    wahCount32Portable, wahCount64Portable,
+    wahFlip32Portable, wahFlip64Portable,
+    andPortable<uint32_t>, orPortable<uint32_t>, xorPortable<uint32_t>, andNotPortable<uint32_t>,
+    andPortable<uint64_t>, orPortable<uint64_t>, xorPortable<uint64_t>, andNotPortable<uint64_t>,
+    expand32Portable, expand64Portable
+};
+
+#ifdef SNAPDRAGON_X86
+
+// the first literal bit (1 << 30) becomes bit 0
+static inline uint32_t literalOrder32(uint32_t w) {
+    w = ((w >> 1) & 0x55555555U) | ((w & 0x55555555U) << 1);
+    w = ((w >> 2) & 0x33333333U) | ((w & 0x33333333U) << 2);
+    w = ((w >> 4) & 0x0F0F0F0FU) | ((w & 0x0F0F0F0FU) << 4);
+    return __builtin_bswap32(w) >> 1;
+}
+
+/*
+    SSE4.2: hardware popcount and 128 bit words
+*/
+__attribute__((target("sse4.2,popcnt")))
+static uint64_t wahCount32Sse42(const uint32_t *words, size_t n) {
+    uint64_t ones = 0;
+    for (size_t i = 0; i < n; i++) {
+        uint32_t w = words[i];
+        if (!(w & FILL32))
+            ones += _mm_popcnt_u32(w);
+        else if (w & FILLBIT32)
+            ones += (uint64_t)(w & FILLMASK32) * 31;
+    }
+    return ones;
+}
+
+__attribute__((target("sse4.2,popcnt")))
+static uint64_t wahCount64Sse42(const uint64_t *words, size_t n) {
+    uint64_t ones = 0;
+    for (size_t i = 0; i < n; i++) {
+        uint64_t w = words[i];
+        if (!(w & FILL64))
+            ones += __builtin_popcountll(w);
+        else if (w & FILLBIT64)
+            ones += (w & FILLMASK64) * 63;
+    }
+    return ones;
+}
+
+__attribute__((target("sse4.2")))
+static void wahFlip32Sse42(uint32_t *words, size_t n) {
+    const __m128i literal = _mm_set1_epi32(LITERAL32);
+    const __m128i fill = _mm_set1_epi32(FILLBIT32);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i w = _mm_loadu_si128((const __m128i *)(words + i));
+        __m128i flip = _mm_blendv_epi8(literal, fill, _mm_srai_epi32(w, 31));
+        _mm_storeu_si128((__m128i *)(words + i), _mm_xor_si128(w, flip));
+    }
+    wahFlip32Portable(words + i, n - i);
+}
+
+__attribute__((target("sse4.2")))
+static void wahFlip64Sse42(uint64_t *words, size_t n) {
+    const __m128i literal = _mm_set1_epi64x(LITERAL64);
+    const __m128i fill = _mm_set1_epi64x(FILLBIT64);
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i w = _mm_loadu_si128((const __m128i *)(words + i));
+        __m128i flip = _mm_blendv_epi8(literal, fill, _mm_cmpgt_epi64(zero, w));
+        _mm_storeu_si128((__m128i *)(words + i), _mm_xor_si128(w, flip));
+    }
+    wahFlip64Portable(words + i, n - i);
+}
+
+// width words of type word per vector
+#define LITERAL_OP(name, word, isa, vec, load, store, op, width, scalar)       \
+    __attribute__((target(isa)))                                              \
+    static void name(const word *a, const word *b, word *res, size_t n) {     \
+        size_t i = 0;                                                         \
+        for (; i + width <= n; i += width) {                                  \
+            vec x = load((const vec *)(a + i));                               \
+            vec y = load((const vec *)(b + i));                               \
+            store((vec *)(res + i), op);                                      \
+        }                                                                     \
+        scalar(a + i, b + i, res + i, n - i);                                 \
+    }
+
+#define SSE42_OPS(suffix, word, width)                                         \
+    LITERAL_OP(and##suffix##Sse42, word, "sse4.2", __m128i, _mm_loadu_si128, _mm_storeu_si128, \
+               _mm_and_si128(x, y), width, andPortable<word>)                 \
+    LITERAL_OP(or##suffix##Sse42, word, "sse4.2", __m128i, _mm_loadu_si128, _mm_storeu_si128, \
+               _mm_or_si128(x, y), width, orPortable<word>)                   \
+    LITERAL_OP(xor##suffix##Sse42, word, "sse4.2", __m128i, _mm_loadu_si128, _mm_storeu_si128, \
+               _mm_xor_si128(x, y), width, xorPortable<word>)                 \
+    LITERAL_OP(andNot##suffix##Sse42, word, "sse4.2", __m128i, _mm_loadu_si128, _mm_storeu_si128, \
+               _mm_andnot_si128(y, x), width, andNotPortable<word>)
+SSE42_OPS(32, uint32_t, 4)
+SSE42_OPS(64, uint64_t, 2)
+
+static const BitKernels sse42 = {
+    "sse4.2",
+    wahCount32Sse42, wahCount64Sse42,
+    wahFlip32Sse42, wahFlip64Sse42,
+    and32Sse42, or32Sse42, xor32Sse42, andNot32Sse42,
+    and64Sse42, or64Sse42, xor64Sse42, andNot64Sse42,
+    expand32Portable, expand64Portable
+};
+
+/*
+    AVX2: 256 bit words, popcounts by nibble lookups, and set bits
+    expanded a byte at a time through a table of their offsets
+*/
+
+// the offsets of the set bits of each byte, in order
+static uint32_t byteOffsets[256][8];
+
+static struct ByteOffsets {
+    ByteOffsets() {
+        for (int b = 0; b < 256; b++) {
+            int k = 0;
+            for (int bit = 0; bit < 8; bit++)
+                if (b & (1 << bit))
+                    byteOffsets[b][k++] = bit;
+        }
+    }
+} fillByteOffsets;
+
+// the popcounts of the bytes of v, summed in each 64 bit lane
+__attribute__((target("avx2")))
+static inline __m256i popcount256(__m256i v) {
+    const __m256i table = _mm256_setr_epi8(0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,
+                                           0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4);
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    __m256i lo = _mm256_shuffle_epi8(table, _mm256_and_si256(v, nibble));
+    __m256i hi = _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+    return _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256());
+}
+
+__attribute__((target("avx2")))
+static inline uint64_t sum256(__m256i v) {
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, v);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+__attribute__((target("avx2,popcnt")))
+static uint64_t wahCount32Avx2(const uint32_t *words, size_t n) {
+    const __m256i onefill = _mm256_set1_epi32(ONEFILL32);
+    const __m256i fillmask = _mm256_set1_epi32(FILLMASK32);
+    const __m256i low = _mm256_set1_epi64x(0xFFFFFFFFULL);
+    __m256i ones = _mm256_setzero_si256();
+    __m256i fills = _mm256_setzero_si256(); // 1-fill lengths
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i w = _mm256_loadu_si256((const __m256i *)(words + i));
+        ones = _mm256_add_epi64(ones, popcount256(_mm256_andnot_si256(_mm256_srai_epi32(w, 31), w)));
+        __m256i is_one = _mm256_cmpeq_epi32(_mm256_and_si256(w, onefill), onefill);
+        __m256i len = _mm256_and_si256(is_one, _mm256_and_si256(w, fillmask));
+        fills = _mm256_add_epi64(fills, _mm256_and_si256(len, low));
+        fills = _mm256_add_epi64(fills, _mm256_srli_epi64(len, 32));
+    }
+    return sum256(ones) + 31 * sum256(fills) + wahCount32Sse42(words + i, n - i);
+}
+
+__attribute__((target("avx2,popcnt")))
+static uint64_t wahCount64Avx2(const uint64_t *words, size_t n) {
+    const __m256i onefill = _mm256_set1_epi64x(ONEFILL64);
+    const __m256i fillmask = _mm256_set1_epi64x(FILLMASK64);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i ones = zero;
+    __m256i fills = zero;
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i w = _mm256_loadu_si256((const __m256i *)(words + i));
+        ones = _mm256_add_epi64(ones, popcount256(_mm256_andnot_si256(_mm256_cmpgt_epi64(zero, w), w)));
+        __m256i is_one = _mm256_cmpeq_epi64(_mm256_and_si256(w, onefill), onefill);
+        fills = _mm256_add_epi64(fills, _mm256_and_si256(is_one, _mm256_and_si256(w, fillmask)));
+    }
+    return sum256(ones) + 63 * sum256(fills) + wahCount64Sse42(words + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void wahFlip32Avx2(uint32_t *words, size_t n) {
+    const __m256i literal = _mm256_set1_epi32(LITERAL32);
+    const __m256i fill = _mm256_set1_epi32(FILLBIT32);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i w = _mm256_loadu_si256((const __m256i *)(words + i));
+        __m256i flip = _mm256_blendv_epi8(literal, fill, _mm256_srai_epi32(w, 31));
+        _mm256_storeu_si256((__m256i *)(words + i), _mm256_xor_si256(w, flip));
+    }
+    wahFlip32Portable(words + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void wahFlip64Avx2(uint64_t *words, size_t n) {
+    const __m256i literal = _mm256_set1_epi64x(LITERAL64);
+    const __m256i fill = _mm256_set1_epi64x(FILLBIT64);
+    const __m256i zero = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i w = _mm256_loadu_si256((const __m256i *)(words + i));
+        __m256i flip = _mm256_blendv_epi8(literal, fill, _mm256_cmpgt_epi64(zero, w));
+        _mm256_storeu_si256((__m256i *)(words + i), _mm256_xor_si256(w, flip));
+    }
+    wahFlip64Portable(words + i, n - i);
+}
+
+#define AVX2_OPS(suffix, word, width)                                          \
+    LITERAL_OP(and##suffix##Avx2, word, "avx2", __m256i, _mm256_loadu_si256, _mm256_storeu_si256, \
+               _mm256_and_si256(x, y), width, andPortable<word>)              \
+    LITERAL_OP(or##suffix##Avx2, word, "avx2", __m256i, _mm256_loadu_si256, _mm256_storeu_si256, \
+               _mm256_or_si256(x, y), width, orPortable<word>)                \
+    LITERAL_OP(xor##suffix##Avx2, word, "avx2", __m256i, _mm256_loadu_si256, _mm256_storeu_si256, \
+               _mm256_xor_si256(x, y), width, xorPortable<word>)              \
+    LITERAL_OP(andNot##suffix##Avx2, word, "avx2", __m256i, _mm256_loadu_si256, _mm256_storeu_si256, \
+               _mm256_andnot_si256(y, x), width, andNotPortable<word>)
+AVX2_OPS(32, uint32_t, 8)
+AVX2_OPS(64, uint64_t, 4)
+
+// 8 offsets are stored for every byte, so res may be written up to 8
+// positions past the last set bit
+__attribute__((target("avx2,popcnt")))
+static size_t expand32Avx2(const uint32_t *words, size_t n, uint32_t pos, uint32_t *res) {
+    size_t k = 0;
+    for (size_t i = 0; i < n; i++, pos += 31) {
+        if (words[i] == 0) continue;
+        uint32_t bits = literalOrder32(words[i]);
+        for (int byte = 0; byte < 4; byte++, bits >>= 8) {
+            uint32_t b = bits & 0xFF;
+            __m256i offsets = _mm256_loadu_si256((const __m256i *)byteOffsets[b]);
+            offsets = _mm256_add_epi32(offsets, _mm256_set1_epi32(pos + 8 * byte));
+            _mm256_storeu_si256((__m256i *)(res + k), offsets);
+            k += _mm_popcnt_u32(b);
+        }
+    }
+    return k;
+}
+
+static const BitKernels avx2 = {
+    "avx2",
+    wahCount32Avx2, wahCount64Avx2,
+    wahFlip32Avx2, wahFlip64Avx2,
+    and32Avx2, or32Avx2, xor32Avx2, andNot32Avx2,
+    and64Avx2, or64Avx2, xor64Avx2, andNot64Avx2,
+    expand32Avx2, expand64Portable
+};
+
+/*
+    AVX-512: 512 bit words, mask registers, and set bits expanded by
+    compressing a vector of positions
+*/
+#define AVX512 "avx512f,avx512bw,popcnt"
+// GCC's intrinsics (_mm512_reduce_add_epi64, _mm512_srli_epi64,
+// _mm512_broadcast_i32x4, ...) start from _mm512_undefined_epi32(), which
+// draws -Wuninitialized once they are inlined here
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+__attribute__((target(AVX512)))
+static inline __m512i popcount512(__m512i v) {
+    // the popcounts of 0..15 in each 128 bit lane
+    const __m512i table = _mm512_broadcast_i32x4(_mm_setr_epi8(0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4));
+    const __m512i nibble = _mm512_set1_epi8(0x0F);
+    __m512i lo = _mm512_shuffle_epi8(table, _mm512_and_si512(v, nibble));
+    __m512i hi = _mm512_shuffle_epi8(table, _mm512_and_si512(_mm512_srli_epi16(v, 4), nibble));
+    return _mm512_sad_epu8(_mm512_add_epi8(lo, hi), _mm512_setzero_si512());
+}
+
+__attribute__((target(AVX512)))
+static uint64_t wahCount32Avx512(const uint32_t *words, size_t n) {
+    const __m512i onefill = _mm512_set1_epi32(ONEFILL32);
+    const __m512i fillmask = _mm512_set1_epi32(FILLMASK32);
+    const __m512i low = _mm512_set1_epi64(0xFFFFFFFFULL);
+    const __m512i zero = _mm512_setzero_si512();
+    __m512i ones = zero;
+    __m512i fills = zero;
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512i w = _mm512_loadu_si512((const void *)(words + i));
+        __mmask16 fill = _mm512_cmplt_epi32_mask(w, zero);
+        ones = _mm512_add_epi64(ones, popcount512(_mm512_maskz_mov_epi32(~fill, w)));
+        __mmask16 is_one = _mm512_cmpeq_epi32_mask(_mm512_and_si512(w, onefill), onefill);
+        __m512i len = _mm512_maskz_and_epi32(is_one, w, fillmask);
+        fills = _mm512_add_epi64(fills, _mm512_and_si512(len, low));
+        fills = _mm512_add_epi64(fills, _mm512_srli_epi64(len, 32));
+    }
+    return _mm512_reduce_add_epi64(ones) + 31 * _mm512_reduce_add_epi64(fills)
+        + wahCount32Sse42(words + i, n - i);
+}
+
+__attribute__((target(AVX512)))
+static uint64_t wahCount64Avx512(const uint64_t *words, size_t n) {
+    const __m512i onefill = _mm512_set1_epi64(ONEFILL64);
+    const __m512i fillmask = _mm512_set1_epi64(FILLMASK64);
+    const __m512i zero = _mm512_setzero_si512();
+    __m512i ones = zero;
+    __m512i fills = zero;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m512i w = _mm512_loadu_si512((const void *)(words + i));
+        __mmask8 fill = _mm512_cmplt_epi64_mask(w, zero);
+        ones = _mm512_add_epi64(ones, popcount512(_mm512_maskz_mov_epi64(~fill, w)));
+        __mmask8 is_one = _mm512_cmpeq_epi64_mask(_mm512_and_si512(w, onefill), onefill);
+        fills = _mm512_add_epi64(fills, _mm512_maskz_and_epi64(is_one, w, fillmask));
+    }
+    return _mm512_reduce_add_epi64(ones) + 63 * _mm512_reduce_add_epi64(fills)
+        + wahCount64Sse42(words + i, n - i);
+}
+
+__attribute__((target(AVX512)))
+static void wahFlip32Avx512(uint32_t *words, size_t n) {
+    const __m512i literal = _mm512_set1_epi32(LITERAL32);
+    const __m512i fill = _mm512_set1_epi32(FILLBIT32);
+    const __m512i zero = _mm512_setzero_si512();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512i w = _mm512_loadu_si512((const void *)(words + i));
+        __m512i flip = _mm512_mask_blend_epi32(_mm512_cmplt_epi32_mask(w, zero), literal, fill);
+        _mm512_storeu_si512((void *)(words + i), _mm512_xor_si512(w, flip));
+    }
+    wahFlip32Portable(words + i, n - i);
+}
+
+__attribute__((target(AVX512)))
+static void wahFlip64Avx512(uint64_t *words, size_t n) {
+    const __m512i literal = _mm512_set1_epi64(LITERAL64);
+    const __m512i fill = _mm512_set1_epi64(FILLBIT64);
+    const __m512i zero = _mm512_setzero_si512();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m512i w = _mm512_loadu_si512((const void *)(words + i));
+        __m512i flip = _mm512_mask_blend_epi64(_mm512_cmplt_epi64_mask(w, zero), literal, fill);
+        _mm512_storeu_si512((void *)(words + i), _mm512_xor_si512(w, flip));
+    }
+    wahFlip64Portable(words + i, n - i);
+}
+
+#define LOAD512(p)     _mm512_loadu_si512((const void *)(p))
+#define STORE512(p, v) _mm512_storeu_si512((void *)(p), v)
+#define AVX512_OPS(suffix, word, width)                                        \
+    LITERAL_OP(and##suffix##Avx512, word, AVX512, __m512i, LOAD512, STORE512, \
+               _mm512_and_si512(x, y), width, andPortable<word>)              \
+    LITERAL_OP(or##suffix##Avx512, word, AVX512, __m512i, LOAD512, STORE512,  \
+               _mm512_or_si512(x, y), width, orPortable<word>)                \
+    LITERAL_OP(xor##suffix##Avx512, word, AVX512, __m512i, LOAD512, STORE512, \
+               _mm512_xor_si512(x, y), width, xorPortable<word>)              \
+    LITERAL_OP(andNot##suffix##Avx512, word, AVX512, __m512i, LOAD512, STORE512, \
+               _mm512_andnot_si512(y, x), \
+               width, andNotPortable<word>)
+AVX512_OPS(32, uint32_t, 16)
+AVX512_OPS(64, uint64_t, 8)
+
+__attribute__((target(AVX512)))
+static size_t expand32Avx512(const uint32_t *words, size_t n, uint32_t pos, uint32_t *res) {
+    const __m512i offsets = _mm512_setr_epi32(0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15);
+    size_t k = 0;
+    for (size_t i = 0; i < n; i++, pos += 31) {
+        if (words[i] == 0) continue;
+        uint32_t bits = literalOrder32(words[i]);
+        __m512i first = _mm512_add_epi32(offsets, _mm512_set1_epi32(pos));
+        __m512i second = _mm512_add_epi32(offsets, _mm512_set1_epi32(pos + 16));
+        _mm512_mask_compressstoreu_epi32(res + k, (__mmask16)bits, first);
+        k += _mm_popcnt_u32(bits & 0xFFFF);
+        _mm512_mask_compressstoreu_epi32(res + k, (__mmask16)(bits >> 16), second);
+        k += _mm_popcnt_u32(bits >> 16);
+    }
+    return k;
+}
+
+static const BitKernels avx512 = {
+    "avx512",
+    wahCount32Avx512, wahCount64Avx512,
+    wahFlip32Avx512, wahFlip64Avx512,
+    and32Avx512, or32Avx512, xor32Avx512, andNot32Avx512,
+    and64Avx512, or64Avx512, xor64Avx512, andNot64Avx512,
+    expand32Avx512, expand64Portable
+};
+#pragma GCC diagnostic pop
+
+#endif // SNAPDRAGON_X86
+
+const BitKernels* bitKernels(const char *name) {
+    if (strcmp(name, "portable") == 0)
+        return &portable;
+#ifdef SNAPDRAGON_X86
+    __builtin_cpu_init();
+    bool has_sse42 = __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt");
+    bool has_avx2 = has_sse42 && __builtin_cpu_supports("avx2");
+    bool has_avx512 = has_avx2 && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+    if (strcmp(name, "sse4.2") == 0 && has_sse42)
+        return &sse42;
+    if (strcmp(name, "avx2") == 0 && has_avx2)
+        return &avx2;
+    if (strcmp(name, "avx512") == 0 && has_avx512)
+        return &avx512;
+#endif
+    return NULL;
+}
+
+static const BitKernels* bestKernels() {
+    static const char *names[] = { "avx512", "avx2", "sse4.2" };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        const BitKernels *kernels = bitKernels(names[i]);
+        if (kernels != NULL)
+            return kernels;
+    }
+    return &portable;
+}
+
+const BitKernels& bitKernels() {
+    static const BitKernels *best = bestKernels();
+    return *best;
+}
@@ -0,0 +1,85 @@
+#ifndef SNAPDRAGON_SIMD_H
+#define SNAPDRAGON_SIMD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    Kernels for the inner loops of the WAH bitvectors, shared by BitVector
+    (31 bit literals in 32 bit words) and BitVector64 (63 bit literals in 64
+    bit words). Each has a portable version and SSE4.2, AVX2 and AVX-512
+    versions on x86. bitKernels() picks the best set the CPU supports the
+    first time it is called, and the named sets are there for tests and
+    benchmarks.
+
+    A literal word has its top bit clear. A fill word has the top bit set,
+    the next bit is the fill bit, and the rest is its length in words.
+*/
+struct BitKernels {
+    const char *name;
+
+    // set bits in n words: the popcounts of the literals plus the lengths
+    // of the 1-fills times the literal size
+    uint64_t (*wahCount32)(const uint32_t *words, size_t n);
+    uint64_t (*wahCount64)(const uint64_t *words, size_t n);
+
+    // complement n words in place. literals flip their bits and fills
+    // flip their fill bit
+    void (*wahFlip32)(uint32_t *words, size_t n);
+    void (*wahFlip64)(uint64_t *words, size_t n);
+
+    // res[i] = a[i] op b[i] over n literals. res may be a or b
+    void (*and32)(const uint32_t *a, const uint32_t *b, uint32_t *res, size_t n);
+    void (*or32)(const uint32_t *a, const uint32_t *b, uint32_t *res, size_t n);
+    void (*xor32)(const uint32_t *a, const uint32_t *b, uint32_t *res, size_t n);
+    void (*andNot32)(const uint32_t *a, const uint32_t *b, uint32_t *res, size_t n);
+    void (*and64)(const uint64_t *a, const uint64_t *b, uint64_t *res, size_t n);
+    void (*or64)(const uint64_t *a, const uint64_t *b, uint64_t *res, size_t n);
+    void (*xor64)(const uint64_t *a, const uint64_t *b, uint64_t *res, size_t n);
+    void (*andNot64)(const uint64_t *a, const uint64_t *b, uint64_t *res, size_t n);
+
+    // write the positions of the set bits of n literals to res, the first
+    // bit of the first literal being at pos, and return how many there
+    // were. res needs room for 8 positions more than that
+    size_t (*expand32)(const uint32_t *words, size_t n, uint32_t pos, uint32_t *res);
+    size_t (*expand64)(const uint64_t *words, size_t n, uint64_t pos, uint64_t *res);
+};
+
+// the fastest kernels this CPU can run
+const BitKernels& bitKernels();
+
+// "portable", "sse4.2", "avx2" or "avx512", or NULL if the CPU (or the
+// compiler) can't run them
+const BitKernels* bitKernels(const char *name);
+
+// the kernels and bit builtins for either word size, so that
+// BasicBitVector<Word> picks them by overloading
+inline uint64_t wahCount(const uint32_t *words, size_t n) { return bitKernels().wahCount32(words, n); }
+inline uint64_t wahCount(const uint64_t *words, size_t n) { return bitKernels().wahCount64(words, n); }
+inline void wahFlip(uint32_t *words, size_t n) { bitKernels().wahFlip32(words, n); }
+inline void wahFlip(uint64_t *words, size_t n) { bitKernels().wahFlip64(words, n); }
+inline size_t expand(const uint32_t *words, size_t n, uint32_t pos, uint32_t *res) {
+    return bitKernels().expand32(words, n, pos, res);
+}
+inline size_t expand(const uint64_t *words, size_t n, uint64_t pos, uint64_t *res) {
+    return bitKernels().expand64(words, n, pos, res);
+}
+
+// res[i] = a[i] op b[i], where op is 0 to 3 for and, or, xor and and not
+// (the order of BitVector::Op)
+inline void literalOp(int op, const uint32_t *a, const uint32_t *b, uint32_t *res, size_t n) {
+    const BitKernels& k = bitKernels();
+    (op == 0 ? k.and32 : op == 1 ? k.or32 : op == 2 ? k.xor32 : k.andNot32)(a, b, res, n);
+}
+inline void literalOp(int op, const uint64_t *a, const uint64_t *b, uint64_t *res, size_t n) {
+    const BitKernels& k = bitKernels();
+    (op == 0 ? k.and64 : op == 1 ? k.or64 : op == 2 ? k.xor64 : k.andNot64)(a, b, res, n);
+}
+
+inline int popCount(uint32_t w) { return __builtin_popcount(w); }
+inline int popCount(uint64_t w) { return __builtin_popcountll(w); }
+// w must not be 0
+inline int leadingZeros(uint32_t w) { return __builtin_clz(w); }
+inline int leadingZeros(uint64_t w) { return __builtin_clzll(w); }
+
+#endif // SNAPDRAGON_SIMD_H
@@ -0,0 +1,58 @@
+#include "kmerexport.h"
+#include <cstdio>
+#include <cstring>     // memcmp()
+#include <sys/mman.h>  // mmap()
+#include <sys/stat.h>  // fstat()
+#include <fcntl.h>     // open()
+#include <unistd.h>    // close()
+
+KmerExportReader::KmerExportReader(const char *fname) {
+    int fd = open(fname, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(fname);
+        exit(1);
+    }
+    length = st.st_size;
+    if (length < sizeof(KmerExportHeader)) {
+        fprintf(stderr, "%s: not a k-mer export\n", fname);
+        exit(1);
+    }
+    map = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror(fname);
+        exit(1);
+    }
+    header = (const KmerExportHeader *)map;
+    const size_t table = sizeof(KmerExportHeader);
+    const size_t kmerOffset = table + (header->nbins + 1) * sizeof(uint64_t);
+    const size_t countOffset = kmerOffset + header->n * header->nwords * sizeof(kword_t);
+    if (memcmp(header->magic, KMEREXPORT_MAGIC, sizeof(header->magic)) != 0
+        || length != countOffset + header->n * sizeof(uint32_t)) {
+        fprintf(stderr, "%s: not a k-mer export\n", fname);
+        exit(1);
+    }
+    bins        = (const uint64_t *)((const char *)map + table);
+    kmerColumn  = (const kword_t *)((const char *)map + kmerOffset);
+    countColumn = (const uint32_t *)((const char *)map + countOffset);
+}
+
+KmerExportReader::~KmerExportReader() {
+    munmap(map, length);
+}
+
+void KmerExportReader::unpack(const uint64_t i, char *seq) const {
+    static const char table[4] = {'A', 'C', 'G', 'T'};
+    const kword_t *kmer = this->kmer(i);
+    const size_t k = header->k;
+    const size_t last = header->nwords - 1;
+    for (size_t j = 0; j < k; j++) {
+        size_t w = j >> 5;
+        if (w == last) // the last word is right aligned
+            seq[j] = table[(kmer[w] >> (2*(k-j)-2)) & 3];
+        else
+            seq[j] = table[(kmer[w] >> (62 - 2*(j%32))) & 3];
+    }
+    seq[k] = '\0';
+}
@@ -0,0 +1,76 @@
+#ifndef SNAPDRAGON_KMEREXPORT_H
+#define SNAPDRAGON_KMEREXPORT_H
+
+#include <stdint.h>
+#include <cstdlib>
+#include "kmerrun.h" // kword_t
+
+/*
+    Binary columnar export of k-mers and their counts (see
+    Kmerizer::exportBinary()). All integers are native endian.
+
+    File layout:
+        header (32 bytes)
+            char     magic[8]   "SDKMER1\0"
+            uint32_t k
+            uint32_t nwords     kwords per kmer
+            uint32_t nbins
+            uint32_t reserved   0
+            uint64_t n          number of kmers
+        uint64_t bins[nbins+1]  index of the first kmer of each bin, and n
+        kword_t  kmers[n][nwords]
+        uint32_t counts[n]
+
+    Each kmer is 2 bits per base (A=0, C=1, G=2, T=3), in order. Every
+    word but the last holds 32 bases, the first in its most significant
+    bits. The last word holds the remaining k - 32*(nwords-1) bases (1 to
+    32) right aligned, its last base in the least significant bits, so
+    with nwords == 1 the whole kmer is right aligned in one word, and when
+    k % 32 == 0 the last word is full like the others. Kmers are sorted
+    within each bin; bins are hash partitions, so the file as a whole is
+    not sorted. Every section is 8 byte aligned, so a reader can map the
+    file and use the columns in place.
+*/
+
+#define KMEREXPORT_MAGIC "SDKMER1"
+
+struct KmerExportHeader {
+    char     magic[8];
+    uint32_t k;
+    uint32_t nwords;
+    uint32_t nbins;
+    uint32_t reserved;
+    uint64_t n;
+};
+
+// maps an exported file read only. the accessors point into the mapping
+class KmerExportReader {
+    void *                   map;
+    size_t                   length;
+    const KmerExportHeader * header;
+    const uint64_t *         bins;
+    const kword_t *          kmerColumn;
+    const uint32_t *         countColumn;
+
+public:
+    KmerExportReader(const char *fname);
+    ~KmerExportReader();
+
+    size_t   k()      const { return header->k; }
+    size_t   nwords() const { return header->nwords; }
+    size_t   nbins()  const { return header->nbins; }
+    uint64_t size()   const { return header->n; }
+
+    // kmers binStart(bin) .. binStart(bin+1)-1 belong to bin
+    uint64_t binStart(const size_t bin) const { return bins[bin]; }
+
+    const kword_t *  kmers()  const { return kmerColumn; }
+    const uint32_t * counts() const { return countColumn; }
+    const kword_t *  kmer(const uint64_t i)  const { return kmerColumn + i * header->nwords; }
+    uint32_t         count(const uint64_t i) const { return countColumn[i]; }
+
+    // write the bases of kmer i and a terminating '\0' to seq
+    void unpack(const uint64_t i, char *seq) const;
+};
+
+#endif // #ifndef SNAPDRAGON_KMEREXPORT_H
@@ -1,4 +1,5 @@
 #include "kmerizer.h"
+#include "../bvec/bvec32.h"
 #include <boost/thread.hpp>
 #include <boost/bind.hpp>
 #include <bitset>
@@ -8,6 +9,9 @@
 #include <cstring> // memcpy()
 #include <sys/stat.h> // mkdir()
 #include <sys/time.h> // gettimeofday()
+#include <sys/mman.h> // mmap()
+#include <fcntl.h>    // open()
+#include <unistd.h>   // ftruncate()
 
 Kmerizer::Kmerizer(const size_t k,
                    const size_t threads,
@@ -15,7 +19,7 @@ Kmerizer::Kmerizer(const size_t k,
                    const char   mode)
 {
     this->k       = k;
-    this->outdir  = new char[strlen(outdir)]; strcpy(this->outdir, outdir);
+    this->outdir  = new char[strlen(outdir)+1]; strcpy(this->outdir, outdir);
     this->mode    = mode;
     this->threads = threads;
 
@@ -34,6 +38,18 @@ Kmerizer::Kmerizer(const size_t k,
     this->threadBins = NBINS / this->threads;
     this->state      = READING;
     this->batches    = 0;
+    this->fanIn      = 16;
+    this->nextRun    = 1;
+    this->pendingMerges = 0;
+    this->cacheLimit = 0;
+    this->cacheBytes = 0;
+    for (size_t i = 0; i < NBINS; i++) {
+        resident[i] = false;
+        countsLoaded[i] = false;
+        slicesLoaded[i] = false;
+        joinedLoaded[i] = false;
+    }
+    readSampleNames();
     fprintf(stderr,"new() nwords: %zi, kmerSize: %zi\n",nwords,kmerSize);
 }
 
@@ -56,6 +72,14 @@ int Kmerizer::allocate(const size_t maximem) {
     return 0;
 }
 
+Kmerizer::~Kmerizer() {
+    joinMerges();
+}
+
+void Kmerizer::setFanIn(const size_t fanin) {
+    fanIn = (fanin < 2) ? 2 : fanin;
+}
+
 kword_t * Kmerizer::canonicalize(kword_t *packed, kword_t *rcpack) const {
     for (size_t i=0;i<nwords;i++) {
         rcpack[i] = packed[nwords-1-i];
@@ -149,23 +173,18 @@ void Kmerizer::addSequence(const char* seq, const int length) {
 }
 
 void Kmerizer::save() {
-    serialize();
-    
-    if (batches>1)
+    if (batches == 0) {
+        // everything fit in memory, index the kmers directly
+        if (state == READING)
+            uniqify();
+        writeIndex();
+    }
+    else {
+        // spill the last batch and merge all the runs into the index
+        serialize();
         mergeBatches();
-    else
-        for (size_t bin=0;bin<NBINS;bin++) {
-            char ofname[100];
-            char nfname[100];
-            sprintf(ofname,"%s/%zi-mers.%zi.1",outdir,k,bin);
-            sprintf(nfname,"%s/%zi-mers.%zi",outdir,k,bin);
-            if (rename(ofname,nfname) != 0)
-                perror("error renaming file");
-            sprintf(ofname,"%s/%zi-mers.%zi.1.idx",outdir,k,bin);
-            sprintf(nfname,"%s/%zi-mers.%zi.idx",outdir,k,bin);
-            if (rename(ofname,nfname) != 0)
-                perror("error renaming file");
-        }
+    }
+    state = QUERY;
 }
 
 void Kmerizer::load() {
@@ -186,100 +205,244 @@ void Kmerizer::load() {
 
 // given one kmer, pack it, canonicalize it, hash it, find it
 uint32_t Kmerizer::find(const char* seq) {
-    // pack it
-    kword_t packed[nwords];
+    uint32_t freq;
+    find(&seq, 1, &freq);
+    return freq;
+}
+
+// pack and canonicalize each query kmer, then resolve them bin by bin
+void Kmerizer::find(const char **queries, const size_t n, uint32_t *freqs) {
+    kword_t * packed = new kword_t[n*nwords];
+    pack(queries, n, packed);
+    lookup(packed, n, freqs, NULL);
+    delete [] packed;
+}
+
+void Kmerizer::pack(const char **queries, const size_t n, kword_t *packed) {
     kword_t rcpack[nwords];
-    memset(packed,0,kmerSize);
-    for (size_t i = 0; i < k; i++)
-        nextKmer(packed,seq[i]);
-    kword_t *kmer = packed;
+    for (size_t q=0;q<n;q++) {
+        kword_t *kmer = packed + q*nwords;
+        memset(kmer,0,kmerSize);
+        for (size_t i = 0; i < k; i++)
+            nextKmer(kmer,queries[q][i]);
+        if (mode == CANONICAL)
+            memcpy(kmer,canonicalize(kmer,rcpack),kmerSize);
+    }
+}
 
-    // canonicalize it
-    if (mode == CANONICAL) {
-        kmer = canonicalize(packed,rcpack);
+// look up each of the length-k+1 kmers of seq
+void Kmerizer::findAll(const char *seq, const int length, uint32_t *freqs) {
+    if (length < (int)k) return;
+    size_t n = length - k + 1;
+    kword_t * packed = new kword_t[n*nwords];
+    packAll(seq, length, packed);
+    lookup(packed, n, freqs, NULL);
+    delete [] packed;
+}
+
+// pack (and canonicalize) the length-k+1 kmers of seq into packed
+void Kmerizer::packAll(const char *seq, const int length, kword_t *packed) {
+    if (length < (int)k) return; // no kmers, and seq may be shorter than k-1
+    kword_t kmer[nwords];
+    kword_t rcpack[nwords];
+    memset(kmer,0,kmerSize);
+    for (size_t i = 0; i < k - 1; i++)
+        nextKmer(kmer,seq[i]);
+    for (size_t q=0;q + k <= (size_t)length;q++) {
+        nextKmer(kmer,seq[q + k - 1]);
+        if (mode == CANONICAL)
+            memcpy(packed + q*nwords,canonicalize(kmer,rcpack),kmerSize);
+        else
+            memcpy(packed + q*nwords,kmer,kmerSize);
     }
+}
 
-    // hash it
-    size_t bin = hashkmer(kmer,0);
+// look up all kmers of a batch of reads at once and summarize each read
+void Kmerizer::profile(
+    const char **   seqs,
+    const int *     lengths,
+    const size_t    n,
+    const uint32_t  solid,
+    ReadProfile *   profiles)
+{
+    if (n == 0) return;
+    // offset of each read's kmers in the batch
+    vector<size_t> offset(n + 1, 0);
+    for (size_t r=0;r<n;r++)
+        offset[r+1] = offset[r] + ((lengths[r] < (int)k) ? 0 : lengths[r] - k + 1);
+    kword_t * packed = new kword_t[offset[n]*nwords];
+    uint32_t * freqs = new uint32_t[offset[n]];
+    boost::thread_group tg;
+    size_t chunk = (n + threads - 1) / threads;
+    for (size_t i = 0; i < n; i += chunk) {
+        size_t j = (i + chunk > n) ? n : i + chunk;
+        tg.create_thread(boost::bind(&Kmerizer::doPack, this, i, j, seqs, lengths, offset.data(), packed));
+    }
+    tg.join_all();
+    lookup(packed, offset[n], freqs, NULL);
+    boost::thread_group tg2;
+    for (size_t i = 0; i < n; i += chunk) {
+        size_t j = (i + chunk > n) ? n : i + chunk;
+        tg2.create_thread(boost::bind(&Kmerizer::doProfile, this, i, j, offset.data(), freqs, solid, profiles));
+    }
+    tg2.join_all();
+    delete [] packed;
+    delete [] freqs;
+}
 
-    // check if we've loaded the bit slices for this bin
-    if (slices[bin].empty()) {
-        // load the kmer slices for this bin
-        char fname[100];
-        sprintf(fname,"%s/%zi-mers.%zi",outdir,k,bin);
-        vector<uint32_t> junk;
-        readBitmap(fname,junk,slices[bin]);
-    }
-
-    // search the index by iterative boolean operations
-    BitVector *res = new BitVector(true); // first create an empty bitvector
-    res->appendFill(true,slices[bin][0]->getSize()); // then make it all 1's
-    for (size_t w=0;w<nwords;w++) {
-        for (size_t b=0;b<64;b++) {
-            if (kmer[w] & (1ULL << (63-b)))
-                *res &= *(slices[bin][w*nwords + b]);
-            else
-                *res &= *(slices[bin][w*nwords + b]->copyflip());
-            if (res->cnt() == 0) return 0;
+void Kmerizer::doPack(
+    const size_t    from,
+    const size_t    to,
+    const char **   seqs,
+    const int *     lengths,
+    const size_t *  offset,
+    kword_t *       packed)
+{
+    for (size_t r=from;r<to;r++)
+        packAll(seqs[r], lengths[r], packed + offset[r]*nwords);
+}
+
+void Kmerizer::doProfile(
+    const size_t    from,
+    const size_t    to,
+    const size_t *  offset,
+    uint32_t *      freqs,
+    const uint32_t  solid,
+    ReadProfile *   profiles)
+{
+    for (size_t r=from;r<to;r++) {
+        uint32_t * first = freqs + offset[r];
+        uint32_t * last = freqs + offset[r+1];
+        ReadProfile & p = profiles[r];
+        p.kmers = last - first;
+        p.solid = 0;
+        if (p.kmers == 0) {
+            p.min = p.median = p.max = 0;
+            continue;
         }
+        for (uint32_t * f = first; f < last; f++)
+            if (*f >= solid) p.solid++;
+        // the read's counts are not needed in order any more
+        nth_element(first, first + p.kmers/2, last);
+        p.median = first[p.kmers/2];
+        p.min = *min_element(first, last);
+        p.max = *max_element(first, last);
     }
-    // if we've reached this point, there should be one set bit in res
-    if (res->cnt() != 1) {
-        fprintf(stderr,"expected only 1, but cnt() returned %u\n",res->cnt());
-        exit(1);
+}
+
+// group the packed kmers by bin and resolve each bin in one pass
+void Kmerizer::lookup(const kword_t *packed, const size_t n, uint32_t *freqs, uint32_t *counts) {
+    vector<uint32_t> queries[NBINS];
+    for (size_t q=0;q<n;q++)
+        queries[hashkmer(packed + q*nwords,0)].push_back(q);
+    if (n < NBINS) { // not worth starting threads
+        doLookup(0, NBINS, packed, queries, freqs, counts);
+        return;
+    }
+    boost::thread_group tg;
+    for (size_t i = 0; i < NBINS; i += threadBins) {
+        size_t j = (i + threadBins > NBINS) ? NBINS : i + threadBins;
+        tg.create_thread(boost::bind(&Kmerizer::doLookup, this, i, j, packed, queries, freqs, counts));
     }
-    // need to figure out which bit
-    // and lookup the associated count
-    res->decompress();
-    vector<uint32_t> hits = res->getWords();
-    return frequency(bin,hits[0]);
+    tg.join_all();
 }
 
-uint32_t Kmerizer::frequency(size_t bin, uint32_t pos) {
-    size_t key=1;
-    while (key<kmerFreq[bin].size())
-        if (counts[bin][key]->find(pos))
-            key++;
+// count bitmaps are probed at arbitrary positions, so they are saved with
+// a skip index
+static void buildSkips(vector<BitVector*> &index) {
+    for (size_t i=0; i < index.size(); i++)
+        index[i]->buildSkips();
+}
+
+// index[j] is a subset of index[j-1] and index[0] has pos, so the bitmaps
+// that contain pos form a prefix of index.
+// cursors[i] is the place of the caller in index[i]
+static uint32_t rangeValue(vector<uint32_t> &values, vector<BitVector*> &index, uint32_t pos,
+                           vector<BitVector::Cursor> &cursors) {
+    if (cursors.size() < index.size())
+        cursors.resize(index.size());
+    size_t lo=0, hi=values.size(); // index[lo] has pos
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (index[mid]->find(pos, cursors[mid]))
+            lo = mid;
         else
-            break;
-    return kmerFreq[bin][key-1];
+            hi = mid;
+    }
+    return values[lo];
+}
+
+// counts[bin][0] marks every kmer of the bin
+uint32_t Kmerizer::frequency(size_t bin, uint32_t pos) {
+    vector<BitVector::Cursor> cursors;
+    return rangeValue(kmerFreq[bin], counts[bin], pos, cursors);
+}
+
+void Kmerizer::frequencies(size_t bin, const uint32_t *pos, const size_t n, uint32_t *freqs) {
+    vector<BitVector::Cursor> cursors;
+    frequencies(bin, pos, n, freqs, cursors);
+}
+
+// the cursors keep their places in each bitmap, so probing ascending
+// positions never moves backwards in any of them
+void Kmerizer::frequencies(size_t bin, const uint32_t *pos, const size_t n, uint32_t *freqs,
+                           vector<BitVector::Cursor> &cursors) {
+    for (size_t i=0; i < n; i++)
+        freqs[i] = rangeValue(kmerFreq[bin], counts[bin], pos[i], cursors);
 }
 
 
 void Kmerizer::histogram() {
-    if (batches>1)
-        save();
+    spectrum().print(stdout);
+}
 
-    if (state == READING)
-        uniqify();
+Spectrum Kmerizer::spectrum() {
+    vector<Kmerizer*> indexes(1, this);
+    vector<Spectrum> result;
+    spectra(indexes, threads, result);
+    return result[0];
+}
 
-    // merge the NBINS counts bvecs
-    uint32_t todo = NBINS;
-    size_t offset[NBINS];
-    size_t done[NBINS];
-    memset(offset,0,sizeof(size_t)*NBINS);
-    memset(done,0,sizeof(size_t)*NBINS);
-    uint32_t key=1; // min kmer frequency
-    while (todo > 0) {
-        uint32_t val = 0;
-        for (size_t i=0;i<NBINS;i++) {
-            if (done[i]==0) {
-                if (kmerFreq[i][offset[i]] == key) {
-                    val += counts[i][offset[i]]->cnt();
-                    if (offset[i]<kmerFreq[i].size()-1) // undo the range encoding <=
-                        val -= counts[i][offset[i]+1]->cnt();
-                    offset[i]++;
-                    if (offset[i] == kmerFreq[i].size()) {
-                        done[i]=1;
-                        todo--;
-                    }
-                }
-            }
-        }
-        if (val > 0) {
-            printf("%u %u\n",key,val);
-        }
-        key++;
+// each thread takes a contiguous range of all the bins of all the indexes
+// and keeps its own spectrum per index, merged when every thread is done
+void Kmerizer::spectra(vector<Kmerizer*> &indexes,
+                       const size_t threads,
+                       vector<Spectrum> &spectra) {
+    const size_t items = indexes.size() * NBINS;
+    const size_t per_thread = (items + threads - 1) / threads;
+    vector< vector<Spectrum> > parts(threads, vector<Spectrum>(indexes.size()));
+    boost::thread_group tg;
+    for (size_t t = 0; t < threads && t * per_thread < items; t++) {
+        size_t from = t * per_thread;
+        size_t to = (from + per_thread > items) ? items : from + per_thread;
+        tg.create_thread(boost::bind(&Kmerizer::doSpectra, &indexes, from, to, &parts[t]));
+    }
+    tg.join_all();
+    spectra.assign(indexes.size(), Spectrum());
+    for (size_t t = 0; t < threads; t++)
+        for (size_t i = 0; i < indexes.size(); i++)
+            spectra[i].merge(parts[t][i]);
+}
+
+void Kmerizer::doSpectra(vector<Kmerizer*> *indexes,
+                         const size_t from,
+                         const size_t to,
+                         vector<Spectrum> *spectra) {
+    for (size_t item = from; item < to; item++)
+        (*indexes)[item / NBINS]->binSpectrum(item % NBINS, (*spectra)[item / NBINS]);
+}
+
+// undo the range encoding: the kmers that occur exactly kmerFreq[bin][j]
+// times are in counts[bin][j] but not in counts[bin][j+1]
+void Kmerizer::binSpectrum(const size_t bin, Spectrum &spectrum) {
+    boost::unique_lock<boost::shared_mutex> lock(binMutex[bin]);
+    loadBin(bin, false);
+    vector<uint32_t> & freq = kmerFreq[bin];
+    for (size_t j=0; j < freq.size(); j++) {
+        uint64_t n = counts[bin][j]->cnt();
+        if (j + 1 < freq.size())
+            n -= counts[bin][j + 1]->cnt();
+        spectrum.add(freq[j], n);
     }
 }
 
@@ -288,14 +451,21 @@ void Kmerizer::serialize() {
     // unique the batch
     uniqify();
     // write to disk
-    writeBatch();
+    size_t run;
+    {
+        boost::mutex::scoped_lock lock(runMutex);
+        run = nextRun++;
+    }
+    writeBatch(run);
+    {
+        boost::mutex::scoped_lock lock(runMutex);
+        queueRun(0, run);
+    }
 
     // zero the data
     memset(binTally,0,sizeof(uint32_t)*NBINS);
-    for (size_t i=0;i<NBINS;i++) {
-        for (size_t j=0; j<counts[i].size(); j++)
-            delete counts[i][j]; // BitVector destructor
-    }
+    for (size_t i=0;i<NBINS;i++)
+        tally[i].clear();
     state = READING;
 }
 
@@ -316,7 +486,7 @@ void Kmerizer::uniqify() {
     fprintf(stderr," took %f seconds\n",elapsedTime);
 }
 
-void Kmerizer::writeBatch() {
+void Kmerizer::writeBatch(const size_t run) {
     fprintf(stderr,"Kmerizer::writeBatch()");
     timeval t1, t2;
     double elapsedTime;
@@ -324,7 +494,23 @@ void Kmerizer::writeBatch() {
     boost::thread_group tg;
     for (size_t i = 0; i < NBINS; i += threadBins) {
         size_t j = (i + threadBins > NBINS) ? NBINS : i + threadBins;
-        tg.create_thread(boost::bind(&Kmerizer::doWriteBatch, this, i, j));
+        tg.create_thread(boost::bind(&Kmerizer::doWriteBatch, this, i, j, run));
+    }
+    tg.join_all();
+    gettimeofday(&t2, NULL);
+    elapsedTime = t2.tv_sec - t1.tv_sec + (t2.tv_usec - t1.tv_usec) / 1000000.0;   // us to ms
+    fprintf(stderr," took %f seconds\n",elapsedTime);
+}
+
+void Kmerizer::writeIndex() {
+    fprintf(stderr,"Kmerizer::writeIndex()");
+    timeval t1, t2;
+    double elapsedTime;
+    gettimeofday(&t1, NULL);
+    boost::thread_group tg;
+    for (size_t i = 0; i < NBINS; i += threadBins) {
+        size_t j = (i + threadBins > NBINS) ? NBINS : i + threadBins;
+        tg.create_thread(boost::bind(&Kmerizer::doWriteIndex, this, i, j));
     }
     tg.join_all();
     gettimeofday(&t2, NULL);
@@ -332,24 +518,130 @@ void Kmerizer::writeBatch() {
     fprintf(stderr," took %f seconds\n",elapsedTime);
 }
 
+void Kmerizer::queueRun(const size_t level, const size_t run) {
+    if (runLevels.size() <= level)
+        runLevels.resize(level + 1);
+    runLevels[level].push_back(run);
+    if (runLevels[level].size() < fanIn)
+        return;
+    // merge this level while ingestion continues
+    vector<size_t> runs;
+    runs.swap(runLevels[level]);
+    size_t out = nextRun++;
+    pendingMerges++;
+    mergeThreads.push_back(new boost::thread(
+        boost::bind(&Kmerizer::backgroundMerge, this, runs, out, level + 1)));
+}
+
+void Kmerizer::backgroundMerge(
+    const vector<size_t> runs,
+    const size_t out,
+    const size_t level)
+{
+    for (size_t bin = 0; bin < NBINS; bin++)
+        mergeRuns(bin, runs, out);
+    boost::mutex::scoped_lock lock(runMutex);
+    for (size_t i=0;i<runs.size();i++)
+        runSize.erase(runs[i]);
+    pendingMerges--;
+    queueRun(level, out);
+    runMerged.notify_all();
+}
+
+void Kmerizer::joinMerges() {
+    vector<boost::thread*> done;
+    {
+        boost::mutex::scoped_lock lock(runMutex);
+        while (pendingMerges > 0)
+            runMerged.wait(lock);
+        done.swap(mergeThreads);
+    }
+    for (size_t i=0;i<done.size();i++) {
+        done[i]->join();
+        delete done[i];
+    }
+}
+
+void Kmerizer::setRunSize(const size_t bin, const size_t run, const uint64_t n) {
+    boost::mutex::scoped_lock lock(runMutex);
+    vector<uint64_t> & sizes = runSize[run];
+    sizes.resize(NBINS);
+    sizes[bin] = n;
+}
+
 void Kmerizer::mergeBatches() {
     fprintf(stderr,"Kmerizer::mergeBatches()");
     timeval t1, t2;
     double elapsedTime;
     gettimeofday(&t1, NULL);
+    // wait for the background merges, then collect the runs, smallest first
+    vector<size_t> runs;
+    joinMerges();
+    {
+        boost::mutex::scoped_lock lock(runMutex);
+        for (size_t level = 0; level < runLevels.size(); level++) {
+            runs.insert(runs.end(), runLevels[level].begin(), runLevels[level].end());
+            runLevels[level].clear();
+        }
+    }
+    // merge the smallest runs until at most fanIn are left
+    while (runs.size() > fanIn) {
+        size_t n = runs.size() - fanIn + 1;
+        if (n > fanIn) n = fanIn;
+        vector<size_t> group(runs.begin(), runs.begin() + n);
+        size_t out;
+        {
+            boost::mutex::scoped_lock lock(runMutex);
+            out = nextRun++;
+        }
+        boost::thread_group tg;
+        for (size_t i=0;i<NBINS;i+=threadBins) {
+            size_t j=(i+threadBins>NBINS) ? NBINS : i+threadBins;
+            tg.create_thread(boost::bind(&Kmerizer::doMergeBatches, this, i, j, group, out, (vector<bool>*)NULL));
+        }
+        tg.join_all();
+        {
+            boost::mutex::scoped_lock lock(runMutex);
+            for (size_t i=0;i<n;i++)
+                runSize.erase(runs[i]);
+        }
+        runs.erase(runs.begin(), runs.begin() + n);
+        runs.push_back(out);
+    }
+    // a bin holding at least a thread's share of the kmers would still be
+    // merging after the other threads finish, so merge it in one key range
+    // per half share, on up to all of the threads
+    uint64_t binSize[NBINS];
+    uint64_t total = 0;
+    {
+        boost::mutex::scoped_lock lock(runMutex);
+        for (size_t bin=0;bin<NBINS;bin++) {
+            binSize[bin] = 0;
+            for (size_t i=0;i<runs.size();i++)
+                binSize[bin] += runSize[runs[i]][bin];
+            total += binSize[bin];
+        }
+        runSize.clear();
+    }
+    vector<bool> split(NBINS,false);
+    for (size_t bin=0;bin<NBINS;bin++) {
+        size_t nparts = (total == 0) ? 1 : 2 * threads * binSize[bin] / total;
+        if (nparts > threads) nparts = threads;
+        if (nparts < 2 || binSize[bin] < KMERRUN_SAMPLE) continue;
+        split[bin] = true;
+        splitMerge(bin, runs, nparts);
+    }
     boost::thread_group tg;
     for (size_t i=0;i<NBINS;i+=threadBins) {
         size_t j=(i+threadBins>NBINS) ? NBINS : i+threadBins;
-        tg.create_thread(boost::bind(&Kmerizer::doMergeBatches, this, i, j));
+        tg.create_thread(boost::bind(&Kmerizer::doMergeBatches, this, i, j, runs, 0, &split));
     }
     tg.join_all();
-    batches=1;
     gettimeofday(&t2, NULL);
     elapsedTime = t2.tv_sec - t1.tv_sec + (t2.tv_usec - t1.tv_usec) / 1000000.0;   // us to ms
     fprintf(stderr," took %f seconds\n",elapsedTime);
 }
 
-
 int compare_kmers1(const void *k1, const void *k2) {
     if (*(kword_t*)k1 > *(kword_t*)k2) return 1;
     if (*(kword_t*)k1 < *(kword_t*)k2) return -1;
@@ -412,14 +704,25 @@ int kmercmp(const void *k1, const void *k2, size_t nwords) {
     }
     return 0;
 }
+
+// orders the kmers in a flat array by index, for sorting sampled kmers
+struct KmerLess {
+    const kword_t * kmers;
+    size_t          nwords;
+    KmerLess(const kword_t * kmers, size_t nwords) : kmers(kmers), nwords(nwords) {}
+    bool operator()(size_t a, size_t b) const {
+        return kmercmp(kmers + a*nwords, kmers + b*nwords, nwords) < 0;
+    }
+};
+
 struct kmer1_t { kword_t first_word; };
-struct kmer2_t { kword_t first_word; };
-struct kmer3_t { kword_t first_word; };
-struct kmer4_t { kword_t first_word; };
-struct kmer5_t { kword_t first_word; };
-struct kmer6_t { kword_t first_word; };
-struct kmer7_t { kword_t first_word; };
-struct kmer8_t { kword_t first_word; };
+struct kmer2_t { kword_t first_word; kword_t other_words[1]; };
+struct kmer3_t { kword_t first_word; kword_t other_words[2]; };
+struct kmer4_t { kword_t first_word; kword_t other_words[3]; };
+struct kmer5_t { kword_t first_word; kword_t other_words[4]; };
+struct kmer6_t { kword_t first_word; kword_t other_words[5]; };
+struct kmer7_t { kword_t first_word; kword_t other_words[6]; };
+struct kmer8_t { kword_t first_word; kword_t other_words[7]; };
 bool operator<(const kmer1_t& a, const kmer1_t& b) {
     return a.first_word < b.first_word;
 }
@@ -479,21 +782,29 @@ void Kmerizer::doUnique(const size_t from, const size_t to) {
         // stl sort
             switch(nwords) {
                 case 1:
-                    sort((kmer1_t*)kmerBuf[bin], (kmer1_t*)(kmerBuf[bin]) + binTally[bin]);
+                    sort((kmer1_t*)kmerBuf[bin], (kmer1_t*)kmerBuf[bin] + binTally[bin]);
+                    break;
                 case 2:
-                    sort((kmer2_t*)kmerBuf[bin], (kmer2_t*)(kmerBuf[bin] + binTally[bin]));
+                    sort((kmer2_t*)kmerBuf[bin], (kmer2_t*)kmerBuf[bin] + binTally[bin]);
+                    break;
                 case 3:
-                    sort((kmer3_t*)kmerBuf[bin], (kmer3_t*)(kmerBuf[bin] + binTally[bin]));
+                    sort((kmer3_t*)kmerBuf[bin], (kmer3_t*)kmerBuf[bin] + binTally[bin]);
+                    break;
                 case 4:
-                    sort((kmer4_t*)kmerBuf[bin], (kmer4_t*)(kmerBuf[bin] + binTally[bin]));
+                    sort((kmer4_t*)kmerBuf[bin], (kmer4_t*)kmerBuf[bin] + binTally[bin]);
+                    break;
                 case 5:
-                    sort((kmer5_t*)kmerBuf[bin], (kmer5_t*)(kmerBuf[bin] + binTally[bin]));
+                    sort((kmer5_t*)kmerBuf[bin], (kmer5_t*)kmerBuf[bin] + binTally[bin]);
+                    break;
                 case 6:
-                    sort((kmer6_t*)kmerBuf[bin], (kmer6_t*)(kmerBuf[bin] + binTally[bin]));
+                    sort((kmer6_t*)kmerBuf[bin], (kmer6_t*)kmerBuf[bin] + binTally[bin]);
+                    break;
                 case 7:
-                    sort((kmer7_t*)kmerBuf[bin], (kmer7_t*)(kmerBuf[bin] + binTally[bin]));
+                    sort((kmer7_t*)kmerBuf[bin], (kmer7_t*)kmerBuf[bin] + binTally[bin]);
+                    break;
                 case 8:
-                    sort((kmer8_t*)kmerBuf[bin], (kmer8_t*)(kmerBuf[bin] + binTally[bin]));
+                    sort((kmer8_t*)kmerBuf[bin], (kmer8_t*)kmerBuf[bin] + binTally[bin]);
+                    break;
             }
         }
         if (0) {
@@ -518,23 +829,22 @@ void Kmerizer::doUnique(const size_t from, const size_t to) {
             }
         }
         // uniq
+        tally[bin].clear();
+        if (binTally[bin] == 0) continue;
         uint32_t distinct = 0;
-        vector<uint32_t> tally;
-        tally.push_back(1); // first kmer
+        tally[bin].push_back(1); // first kmer
         for (size_t i=1;i<binTally[bin];i++) {
             kword_t *ith = kmerBuf[bin] + i*nwords;
             if(kmercmp(kmerBuf[bin] + distinct*nwords, ith, nwords) == 0)
-                tally.back()++;
+                tally[bin].back()++;
             else {
                 distinct++;
-                tally.push_back(1);
+                tally[bin].push_back(1);
                 memcpy(kmerBuf[bin] + distinct*nwords, ith, kmerSize);
             }
         }
 //        fprintf(stderr,"uniqify[%zi] reduced from %u - %u = %u\n",bin,binTally[bin],distinct+1,binTally[bin] - distinct - 1);
         binTally[bin] = distinct+1;
-        // create a bitmap index for the tally vector
-        rangeIndex(tally, kmerFreq[bin], counts[bin]);
     }
 }
 
@@ -553,128 +863,192 @@ void
 Kmerizer::bitSlice(
     kword_t *    kmers,
     const size_t n,
-    BitVector **      kmer_slices,
+    BitVector ** kmer_slices,
     size_t       nbits)
 {
     // initialize WAH compressed bitvectors
     for (size_t i = 0; i < nbits; i++) {
         kmer_slices[i] = new BitVector(true);
     }
-    bitset<256> bbit; // for keeping track of the set bits
-    size_t boff[nbits]; // beginning of the current run of 1's or 0's
-    memset(boff,0,nbits*sizeof(size_t)); // initialize to 0
-    unsigned int bpw = 8*sizeof(kword_t); // bits per word
-
-    // mark the set bits in the first kmer
-    if (nwords>1) {
-        for (size_t w=0;w<nwords;w++) {
-            unsigned int count = popCount(kmers[w]);
-            for (unsigned int r=1; r<=count; r++)
-                bbit.set(selectBit(kmers[w],r) + w*bpw,1);
-        }
-        for (size_t i=1;i<n;i++) {
-            // when n is large the number of different bits between kmer i and kmer i-1 is small
-            // so use xor, popCount, and selectBit to identify the changed bit positions
-            kword_t * kmer = kmers + i * nwords;
-            kword_t * prev = kmer - nwords;
-            for (size_t w=0;w<nwords;w++) {
-                kword_t x = kmer[w] ^ prev[w];
-                unsigned int count = popCount(x);
-                for (unsigned int r = 1; r<=count; r++) {
-                    unsigned int b = selectBit(x,r) + w*bpw;
-                    kmer_slices[b]->appendFill(bbit.test(b),i-boff[b]);
-                    bbit.flip(b);
-                    boff[b] = i;
+    // encode LITERAL_SIZE kmers at a time
+    for (size_t i = 0; i < n; i += LITERAL_SIZE) {
+        size_t rows = (n - i < LITERAL_SIZE) ? n - i : LITERAL_SIZE;
+        sliceBlock(kmers + i * nwords, rows, kmer_slices);
+    }
+}
+
+// Transpose a block of up to LITERAL_SIZE sorted kmers into one literal word
+// per bit slice. Because the block is sorted, leading words where the first
+// and last kmer agree are constant across the block and just extend runs.
+void
+Kmerizer::sliceBlock(
+    const kword_t * kmers,
+    const size_t    n,
+    BitVector **    kmer_slices)
+{
+    const unsigned int bpw = 8 * sizeof(kword_t); // bits per word
+    const kword_t *last = kmers + (n - 1) * nwords;
+    size_t w = 0;
+    for (; w < nwords && kmers[w] == last[w]; w++)
+        for (size_t b = 0; b < bpw; b++)
+            kmer_slices[w * bpw + b]->appendFill((kmers[w] >> (bpw - b - 1)) & 1, n);
+
+    kword_t rows[bpw];
+    for (; w < nwords; w++) {
+        for (size_t i = 0; i < n; i++)
+            rows[i] = kmers[i * nwords + w];
+        memset(rows + n, 0, (bpw - n) * sizeof(kword_t));
+        transpose(rows);
+        // rows[b] now holds bit b of each kmer, first kmer in the msb
+        for (size_t b = 0; b < bpw; b++)
+            kmer_slices[w * bpw + b]->appendWord(rows[b] >> (bpw - LITERAL_SIZE), n);
+    }
+}
+
+// inverse of sliceBlock: decode the next LITERAL_SIZE kmers of the slices
+void
+Kmerizer::unsliceBlock(SliceCursor & cursor, kword_t * kmers) {
+    const unsigned int bpw = 8 * sizeof(kword_t); // bits per word
+    word_t literals[bpw * nwords];
+    cursor.next(literals);
+    kword_t rows[bpw];
+    for (size_t w = 0; w < nwords; w++) {
+        for (size_t b = 0; b < bpw; b++)
+            rows[b] = (kword_t)literals[w * bpw + b] << (bpw - LITERAL_SIZE);
+        transpose(rows);
+        for (size_t i = 0; i < LITERAL_SIZE; i++)
+            kmers[i * nwords + w] = rows[i];
+    }
+}
+
+SliceCursor::SliceCursor(const vector<BitVector*> & slices)
+    : slices(slices), word(slices.size(), 0), fills(slices.size(), 0), fill(slices.size(), 0)
+{
+}
+
+// advance every slice by n blocks without decoding them
+void SliceCursor::skip(size_t n) {
+    for (size_t b = 0; b < slices.size(); b++) {
+        const vector<word_t> & words = slices[b]->getWords();
+        size_t left = n;
+        while (left > 0) {
+            if (fills[b] > 0) {
+                word_t t = (left < fills[b]) ? left : fills[b];
+                fills[b] -= t;
+                left -= t;
+            }
+            else if (word[b] >= words.size())
+                break;
+            else {
+                word_t w = words[word[b]++];
+                if (w & BIT1) {
+                    fills[b] = w & FILLMASK;
+                    fill[b] = ((w & ONEFILL) == ONEFILL) ? ALL1S : 0;
                 }
+                else
+                    left--;
             }
         }
     }
-    else { // stripped down version for nwords=1
-        unsigned int count = popCount(kmers[0]);
-        for (unsigned int r=1; r<=count; r++)
-            bbit.set(selectBit(kmers[0],r),1);
-        for (size_t i=1;i<n;i++) {
-            // when n is large the number of different bits between kmer i and kmer i-1 is small
-            // so use xor, popCount, and selectBit to identify the changed bit positions
-            kword_t x = kmers[i] ^ kmers[i-1];
-            unsigned int count = popCount(x);
-            for (unsigned int r = 1; r<=count; r++) {
-                unsigned int b = selectBit(x,r);
-                kmer_slices[b]->appendFill(bbit.test(b),i-boff[b]);
-                bbit.flip(b);
-                boff[b] = i;
+}
+
+// save the position of every slice, two words each
+void SliceCursor::mark(uint32_t *marks) const {
+    for (size_t b = 0; b < slices.size(); b++) {
+        marks[2*b] = word[b];
+        marks[2*b + 1] = fills[b];
+    }
+}
+
+// return to a position saved by mark()
+void SliceCursor::seek(const uint32_t *marks) {
+    for (size_t b = 0; b < slices.size(); b++) {
+        word[b] = marks[2*b];
+        fills[b] = marks[2*b + 1];
+        if (fills[b] > 0) {
+            word_t w = slices[b]->getWords()[word[b] - 1];
+            fill[b] = ((w & ONEFILL) == ONEFILL) ? ALL1S : 0;
+        }
+    }
+}
+
+// one literal per slice for the next LITERAL_SIZE positions
+void SliceCursor::next(word_t *literals) {
+    for (size_t b = 0; b < slices.size(); b++) {
+        if (fills[b] == 0) {
+            vector<word_t> & words = slices[b]->getWords();
+            word_t w = (word[b] < words.size()) ? words[word[b]++] : 0;
+            if (w & BIT1) {
+                fills[b] = w & FILLMASK;
+                fill[b] = ((w & ONEFILL) == ONEFILL) ? ALL1S : 0;
+            }
+            else {
+                literals[b] = w;
+                continue;
             }
         }
+        fills[b]--;
+        literals[b] = fill[b];
     }
-    // append the last runs
-    for (size_t b=0; b<nbits; b++)
-        if(boff[b] < n-1)
-            kmer_slices[b]->appendFill(bbit.test(b),n-boff[b]);
 }
 
-void Kmerizer::doWriteBatch(const size_t from, const size_t to) {
+// spill the sorted distinct kmers and their counts as a run
+void Kmerizer::doWriteBatch(const size_t from, const size_t to, const size_t run) {
     for (size_t bin=from; bin<to; bin++) {
-        // convert kmerBuf[bin] into a bit-sliced bitmap index
- //       fprintf(stderr,"doWriteBatch() binTally[%zi]: %u\n",bin,binTally[bin]);
-        const size_t nbits = 8*kmerSize;
+        char run_file[100];
+        sprintf(run_file,"%s/%zi-mers.%zi.%zi",outdir,k,bin,run);
+        KmerRunWriter writer(run_file, nwords);
+        for (size_t i=0;i<binTally[bin];i++)
+            writer.append(kmerBuf[bin] + i*nwords, tally[bin][i]);
+        writer.close();
+        setRunSize(bin, run, binTally[bin]);
+    }
+}
+
+// build the final index straight from the uniqified kmerBuf
+void Kmerizer::doWriteIndex(const size_t from, const size_t to) {
+    const size_t nbits = 8*kmerSize;
+    for (size_t bin=from; bin<to; bin++) {
+        rangeIndex(tally[bin], kmerFreq[bin], counts[bin]);
         BitVector* kmer_slices[nbits];
         bitSlice(kmerBuf[bin],binTally[bin],kmer_slices,nbits);
-        
-        FILE *fp;
-        if (0) {
-            // open output file for kmerBuf
-            char kmer_file[100];
-            sprintf(kmer_file,"%s/%zi-mers.%zi.%zi",outdir,k,bin,batches);
-            fp = fopen(kmer_file, "wb");
-            fwrite(kmerBuf[bin],kmerSize,binTally[bin],fp);
-            fclose(fp);
-        }
-        if (1) {
-            // write the kmer_slices to a file
-            char kmer_file[100];
-            sprintf(kmer_file,"%s/%zi-mers.%zi.%zi",outdir,k,bin,batches);
-            fp = fopen(kmer_file, "wb");
-            size_t n_slices = 8*sizeof(kword_t);
-            fwrite(&n_slices,sizeof(size_t),1,fp);
-            for (size_t b=0;b<n_slices;b++) {
-                uint32_t c = kmer_slices[b]->cnt();
-                fwrite(&c,sizeof(uint32_t),1,fp);
-            }
-            // fprintf(stderr,"binTally[%zi]: %u\n",bin,binTally[bin]);
-            for (size_t b=0;b<n_slices;b++) {
-                uint32_t *buf;
-                size_t bytes = kmer_slices[b]->dump(&buf);
-                // fprintf(stderr,"%zi: %zi,",b,bytes);
-                fwrite(&bytes,sizeof(size_t),1,fp);
-                fwrite(buf,1,bytes,fp);
-                free(buf);
-                delete kmer_slices[b];
-            }
-//          fprintf(stderr,"\n");
-//            fprintf(stderr,"Filepointer is now at %d.\n", ftell(fp));
-            fclose(fp);
-        }
-        // open output file for counts
-        char counts_file[100];
-        sprintf(counts_file,"%s/%zi-mers.%zi.%zi.idx",outdir,k,bin,batches);
-        fp = fopen(counts_file, "wb");
-        // first write the number of distinct values
-        // then write the distinct values
-        // for each distinct value, write out the BitVector (size,count,rle,words.size(),words)
-        size_t n_distinct = kmerFreq[bin].size();
-        fwrite(&n_distinct,sizeof(size_t),1,fp);
-        fwrite(kmerFreq[bin].data(),sizeof(uint32_t),n_distinct,fp);
-        for (size_t i=0;i<n_distinct;i++) {
-            uint32_t *buf;
-            size_t bytes = counts[bin][i]->dump(&buf);
-            // how many bytes are we writing
-            fwrite(&bytes,sizeof(size_t),1,fp);
-            // write them
-            fwrite(buf,1,bytes,fp);
-            free(buf);
-        }
-        fclose(fp);
+        writeBin(bin, kmer_slices);
+    }
+}
+
+void Kmerizer::writeBin(const size_t bin, BitVector **kmer_slices) {
+    const size_t nbits = 8*kmerSize;
+    char fname[100];
+    // the value associated with each slice is its number of set bits
+    vector<BitVector*> index(kmer_slices, kmer_slices + nbits);
+    vector<uint32_t> slice_cnts(nbits);
+    for (size_t b=0;b<nbits;b++) {
+        if (!kmer_slices[b]->compressed())
+            kmer_slices[b]->compress();
+        slice_cnts[b] = kmer_slices[b]->cnt();
+    }
+    sprintf(fname,"%s/%zi-mers.%zi",outdir,k,bin);
+    writeBitmap(fname, slice_cnts, index);
+
+    // sampled kmers for binary searching the bin
+    vector<kword_t> kmers;
+    sampleSlices(index, kmers);
+    sprintf(fname,"%s/%zi-mers.%zi.smp",outdir,k,bin);
+    FILE *fp = fopen(fname, "wb");
+    if (fp == NULL) {
+        perror(fname);
+        exit(1);
     }
+    size_t nsamples = kmers.size() / nwords;
+    fwrite(&nsamples,sizeof(size_t),1,fp);
+    fwrite(kmers.data(),sizeof(kword_t),kmers.size(),fp);
+    fclose(fp);
+    for (size_t b=0;b<nbits;b++)
+        delete kmer_slices[b];
+
+    sprintf(fname,"%s/%zi-mers.%zi.idx",outdir,k,bin);
+    buildSkips(counts[bin]);
+    writeBitmap(fname, kmerFreq[bin], counts[bin]);
 }
 
 // when reading counts, values is the array of kmerFrequencies
@@ -683,216 +1057,521 @@ void Kmerizer::readBitmap(const char* idxfile, vector<uint32_t> &values, vector<
     // open idxfile
     FILE *fp;
     fp = fopen(idxfile,"rb");
+    if (fp == NULL) {
+        perror(idxfile);
+        exit(1);
+    }
+    readBitmap(fp, values, index);
+    fclose(fp);
+}
+
+void Kmerizer::readBitmap(FILE *fp, vector<uint32_t> &values, vector<BitVector*> &index) {
     // fread to repopulate values and bvecs
     size_t n_distinct;
-    fread(&n_distinct,sizeof(size_t),1,fp);
-    values.resize(n_distinct);
-    fread(values.data(),sizeof(uint32_t),n_distinct,fp); // assumes 32-bit words in bvec
-    index.resize(n_distinct);
-    for (size_t i=0;i<n_distinct;i++) {
+    bool ok = fread(&n_distinct,sizeof(size_t),1,fp) == 1;
+    if (ok) {
+        values.resize(n_distinct);
+        ok = fread(values.data(),sizeof(uint32_t),n_distinct,fp) == n_distinct; // assumes 32-bit words in bvec
+    }
+    index.resize(ok ? n_distinct : 0);
+    vector<uint32_t> buf;
+    for (size_t i=0;ok && i<n_distinct;i++) {
         size_t bytes;
-        fread(&bytes,sizeof(size_t),1,fp);
-        size_t words = bytes/sizeof(uint32_t);
-        uint32_t buf[words];
-        fread(buf,1,bytes,fp);
-        index[i] = new BitVector(buf);
+        ok = fread(&bytes,sizeof(size_t),1,fp) == 1;
+        if (!ok) break;
+        buf.resize(bytes/sizeof(uint32_t));
+        ok = fread(buf.data(),1,bytes,fp) == bytes;
+        if (ok) index[i] = new BitVector(buf.data());
+    }
+    if (!ok) {
+        fprintf(stderr,"Kmerizer::readBitmap(): truncated bitmap file\n");
+        exit(1);
+    }
+}
+
+// first write the number of distinct values
+// then write the distinct values
+// for each distinct value, write out the BitVector (size,count,rle,words.size(),words)
+void Kmerizer::writeBitmap(const char* idxfile, vector<uint32_t> &values, vector<BitVector*> &index) {
+    FILE *fp;
+    fp = fopen(idxfile, "wb");
+    if (fp == NULL) {
+        perror(idxfile);
+        exit(1);
     }
+    writeBitmap(fp, values, index);
     fclose(fp);
 }
 
+void Kmerizer::writeBitmap(FILE *fp, vector<uint32_t> &values, vector<BitVector*> &index) {
+    size_t n_distinct = values.size();
+    fwrite(&n_distinct,sizeof(size_t),1,fp);
+    fwrite(values.data(),sizeof(uint32_t),n_distinct,fp);
+    for (size_t i=0;i<n_distinct;i++) {
+        uint32_t *buf;
+        size_t bytes = index[i]->dump(&buf);
+        // how many bytes are we writing
+        fwrite(&bytes,sizeof(size_t),1,fp);
+        // write them
+        fwrite(buf,1,bytes,fp);
+        free(buf);
+    }
+}
+
+// sort the queries of each bin and resolve them in order. Each query binary
+// searches the sampled kmers, and only the blocks after that sample are
+// decoded from the slices, by a cursor that jumps to the sample's marks.
+// Lookups only read the bin, so they share its lock.
+void Kmerizer::doLookup(
+    const size_t       from,
+    const size_t       to,
+    const kword_t *    packed,
+    vector<uint32_t> * queries,
+    uint32_t *         freqs,
+    uint32_t *         counts)
+{
+    const size_t nbits = 8*kmerSize;
+    kword_t block[LITERAL_SIZE * nwords];
+    for (size_t bin=from; bin<to; bin++) {
+        if (queries[bin].empty()) continue;
+        vector<uint32_t> & order = queries[bin];
+        sort(order.begin(), order.end(), KmerLess(packed, nwords));
+        shareBin(bin, true, counts != NULL);
+        boost::shared_lock<boost::shared_mutex> lock(binMutex[bin], boost::adopt_lock);
+        const size_t nsamples = samples[bin].size() / nwords;
+        if (nsamples == 0) {
+            for (size_t q=0; q < order.size(); q++)
+                freqs[order[q]] = 0;
+            continue;
+        }
+        SliceCursor cursor(slices[bin]);
+        const uint32_t size = slices[bin][0]->getSize();
+        const size_t nblocks = (size + LITERAL_SIZE - 1) / LITERAL_SIZE;
+        size_t cur = nblocks; // the block decoded into block, if any
+        vector<uint32_t> found; // positions of the kmers that are present
+        vector<uint32_t> hits;  // and the queries that found them
+        for (size_t q=0; q < order.size(); q++) {
+            const kword_t * query = packed + order[q]*nwords;
+            freqs[order[q]] = 0;
+            // find the last sample <= query
+            size_t lo = 0, hi = nsamples;
+            while (lo < hi) {
+                size_t mid = (lo + hi) / 2;
+                if (kmercmp(&samples[bin][mid*nwords], query, nwords) <= 0)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            if (lo == 0) continue; // before the first kmer
+            size_t first = (lo - 1) * SAMPLE_BLOCKS;
+            size_t last = (first + SAMPLE_BLOCKS < nblocks) ? first + SAMPLE_BLOCKS : nblocks;
+            if (cur == nblocks || cur < first) {
+                cursor.seek(&sampleMarks[bin][(lo - 1) * 2 * nbits]);
+                cur = first;
+                unsliceBlock(cursor, block);
+            }
+            // move on to the block that could hold the query
+            size_t rows = (size - cur*LITERAL_SIZE < LITERAL_SIZE) ? size - cur*LITERAL_SIZE : LITERAL_SIZE;
+            while (cur + 1 < last && kmercmp(block + (rows-1)*nwords, query, nwords) < 0) {
+                cur++;
+                unsliceBlock(cursor, block);
+                rows = (size - cur*LITERAL_SIZE < LITERAL_SIZE) ? size - cur*LITERAL_SIZE : LITERAL_SIZE;
+            }
+            for (size_t i=0; i < rows; i++) {
+                int cmp = kmercmp(block + i*nwords, query, nwords);
+                if (cmp > 0) break;
+                if (cmp == 0) {
+                    found.push_back(cur*LITERAL_SIZE + i);
+                    hits.push_back(order[q]);
+                    break;
+                }
+            }
+        }
+        // sorted queries find ascending positions
+        vector<uint32_t> tally(found.size());
+        frequencies(bin, found.data(), found.size(), tally.data());
+        for (size_t h=0; h < hits.size(); h++)
+            freqs[hits[h]] = tally[h];
+        if (counts == NULL || found.empty()) continue;
+        // and in each joined sample
+        const size_t joined = presence[bin].size();
+        for (size_t s=0; s < joined; s++) {
+            bool abundance = !sampleCounts[bin].empty();
+            BitVector::Cursor at;
+            vector<BitVector::Cursor> counted;
+            for (size_t h=0; h < found.size(); h++)
+                if (presence[bin][s]->find(found[h], at))
+                    counts[hits[h]*joined + s] = abundance
+                        ? rangeValue(sampleFreq[bin][s], sampleCounts[bin][s],
+                                     presence[bin][s]->rank(found[h]), counted)
+                        : 1;
+        }
+    }
+}
+
+// take the first kmer of every SAMPLE_BLOCKS blocks of the slices
+void Kmerizer::sampleSlices(vector<BitVector*> &kmer_slices, vector<kword_t> &kmers) {
+    kmers.clear();
+    if (kmer_slices.empty()) return;
+    kword_t block[LITERAL_SIZE * nwords];
+    SliceCursor cursor(kmer_slices);
+    const uint32_t size = kmer_slices[0]->getSize();
+    for (uint32_t base=0; base < size; base += SAMPLE_BLOCKS*LITERAL_SIZE) {
+        unsliceBlock(cursor, block);
+        kmers.insert(kmers.end(), block, block + nwords);
+        cursor.skip(SAMPLE_BLOCKS - 1);
+    }
+}
+
+// load the counts of a bin, and optionally its slices, unless they are
+// already in memory. binMutex[bin] must be held.
+void Kmerizer::loadBin(const size_t bin, const bool kmers) {
+    char fname[100];
+    if (!countsLoaded[bin])
+        doLoadIndex(bin, bin + 1);
+    if (kmers && !slicesLoaded[bin]) {
+        slicesLoaded[bin] = true;
+        sprintf(fname,"%s/%zi-mers.%zi",outdir,k,bin);
+        vector<uint32_t> slice_cnts;
+        readBitmap(fname,slice_cnts,slices[bin]);
+        // compressed once here, so cursors can share the slices
+        for (size_t b=0;b<slices[bin].size();b++)
+            if (!slices[bin][b]->compressed())
+                slices[bin][b]->compress();
+        // read the sampled kmers, or sample the slices of an older index
+        sprintf(fname,"%s/%zi-mers.%zi.smp",outdir,k,bin);
+        FILE *fp = fopen(fname,"rb");
+        size_t nsamples;
+        if (fp != NULL && fread(&nsamples,sizeof(size_t),1,fp) == 1) {
+            samples[bin].resize(nsamples*nwords);
+            if (fread(samples[bin].data(),sizeof(kword_t),nsamples*nwords,fp) != nsamples*nwords) {
+                perror(fname);
+                exit(1);
+            }
+        }
+        else
+            sampleSlices(slices[bin], samples[bin]);
+        if (fp != NULL) fclose(fp);
+        // record where each slice's cursor is at every sample
+        const size_t nbits = slices[bin].size();
+        nsamples = samples[bin].size() / nwords;
+        sampleMarks[bin].resize(nsamples * 2 * nbits);
+        SliceCursor cursor(slices[bin]);
+        for (size_t i=0;i<nsamples;i++) {
+            cursor.mark(&sampleMarks[bin][i * 2 * nbits]);
+            cursor.skip(SAMPLE_BLOCKS);
+        }
+    }
+    touchBin(bin);
+}
+
+// loading swaps the lock for an exclusive one, and back without a gap in
+// which the bin could be evicted
+void Kmerizer::shareBin(const size_t bin, const bool kmers, const bool joined) {
+    binMutex[bin].lock_shared();
+    if (countsLoaded[bin] && (!kmers || slicesLoaded[bin])
+        && (!joined || joinedLoaded[bin])) {
+        touchBin(bin);
+        return;
+    }
+    binMutex[bin].unlock_shared();
+    binMutex[bin].lock();
+    loadBin(bin, kmers);
+    if (joined) loadJoined(bin);
+    binMutex[bin].unlock_and_lock_shared();
+}
+
+// limit the memory held by loaded bins. 0 means no limit
+void Kmerizer::setCacheLimit(const size_t bytes) {
+    boost::mutex::scoped_lock lock(cacheMutex);
+    cacheLimit = bytes;
+}
+
+size_t Kmerizer::cacheSize() {
+    boost::mutex::scoped_lock lock(cacheMutex);
+    return cacheBytes;
+}
+
+// move a bin to the front of the LRU list and evict the least recently
+// used bins that are not in use until the cache fits. binMutex[bin] must
+// be held, shared or not.
+void Kmerizer::touchBin(const size_t bin) {
+    boost::mutex::scoped_lock lock(cacheMutex);
+    if (resident[bin]) {
+        lru.erase(lruPos[bin]);
+        cacheBytes -= binBytes[bin];
+    }
+    binBytes[bin] = residentBytes(bin);
+    cacheBytes += binBytes[bin];
+    lru.push_front(bin);
+    lruPos[bin] = lru.begin();
+    resident[bin] = true;
+    if (cacheLimit == 0) return;
+    list<size_t>::iterator it = lru.end();
+    while (cacheBytes > cacheLimit && it != lru.begin()) {
+        --it;
+        size_t victim = *it;
+        if (victim == bin || !binMutex[victim].try_lock())
+            continue; // in use
+        cacheBytes -= binBytes[victim];
+        resident[victim] = false;
+        it = lru.erase(it);
+        unloadBin(victim);
+        binMutex[victim].unlock();
+    }
+}
+
+size_t Kmerizer::residentBytes(const size_t bin) {
+    size_t bytes = kmerFreq[bin].size() * sizeof(uint32_t)
+        + samples[bin].size() * sizeof(kword_t)
+        + sampleMarks[bin].size() * sizeof(uint32_t);
+    for (size_t i=0;i<counts[bin].size();i++)
+        bytes += counts[bin][i]->bytes();
+    for (size_t i=0;i<slices[bin].size();i++)
+        bytes += slices[bin][i]->bytes();
+    for (size_t s=0;s<presence[bin].size();s++)
+        bytes += presence[bin][s]->bytes();
+    for (size_t s=0;s<sampleCounts[bin].size();s++) {
+        bytes += sampleFreq[bin][s].size() * sizeof(uint32_t);
+        for (size_t i=0;i<sampleCounts[bin][s].size();i++)
+            bytes += sampleCounts[bin][s][i]->bytes();
+    }
+    return bytes;
+}
+
+void Kmerizer::unloadBin(const size_t bin) {
+    for (size_t i=0;i<counts[bin].size();i++)
+        delete counts[bin][i];
+    for (size_t i=0;i<slices[bin].size();i++)
+        delete slices[bin][i];
+    vector<BitVector*>().swap(counts[bin]);
+    vector<BitVector*>().swap(slices[bin]);
+    vector<uint32_t>().swap(kmerFreq[bin]);
+    vector<kword_t>().swap(samples[bin]);
+    vector<uint32_t>().swap(sampleMarks[bin]);
+    for (size_t s=0;s<presence[bin].size();s++)
+        delete presence[bin][s];
+    for (size_t s=0;s<sampleCounts[bin].size();s++)
+        for (size_t i=0;i<sampleCounts[bin][s].size();i++)
+            delete sampleCounts[bin][s][i];
+    vector<BitVector*>().swap(presence[bin]);
+    vector< vector<uint32_t> >().swap(sampleFreq[bin]);
+    vector< vector<BitVector*> >().swap(sampleCounts[bin]);
+    countsLoaded[bin] = false;
+    slicesLoaded[bin] = false;
+    joinedLoaded[bin] = false;
+}
+
 void Kmerizer::doLoadIndex(const size_t from, const size_t to) {
     for (size_t bin=from; bin<to;bin++) {
         char fname[100];
         sprintf(fname,"%s/%zi-mers.%zi.idx",outdir,k,bin);
         readBitmap(fname,kmerFreq[bin],counts[bin]);
+        countsLoaded[bin] = true;
     }
 }
 
-void Kmerizer::doMergeBatches(const size_t from, const size_t to) {
-    for (size_t bin=from; bin<to; bin++) {
-        // read the counts and kmers for each batch
-        vector<BitVector*> * batch_counts = new vector<BitVector*>[batches];
-        vector<uint32_t>   * batch_values = new vector<uint32_t>[batches];
-        vector<BitVector*> * batch_slices = new vector<BitVector*>[batches];
-        vector<uint32_t>   * batch_slice_cnts = new vector<uint32_t>[batches];
-        kword_t  kmers[batches*nwords]; // next kmer in each active batch
-        uint32_t btally[batches]; // frequency of next kmer in each batch
-        size_t   offset[batches]; // keep track of position in each batch
-
-        for (size_t i=0;i<batches;i++) {
-            char fname[100];
-            sprintf(fname,"%s/%zi-mers.%zi.%zi",outdir,k,bin,i+1);
-            readBitmap(fname,batch_slice_cnts[i],batch_slices[i]);
-            sprintf(fname,"%s/%zi-mers.%zi.%zi.idx",outdir,k,bin,i+1);
-            readBitmap(fname,batch_values[i],batch_counts[i]);
-        }
-
-        memset(offset, 0, sizeof(size_t)*batches);
-        uint32_t todo = batches; // number of batches to process
-        vector<uint32_t> tally;
+void Kmerizer::doMergeBatches(
+    const size_t         from,
+    const size_t         to,
+    const vector<size_t> runs,
+    const size_t         out,
+    const vector<bool> * split)
+{
+    for (size_t bin=from; bin<to; bin++)
+        if (split == NULL || !(*split)[bin])
+            mergeRuns(bin, runs, out);
+}
 
+// merge the runs of a bin into run out, or into the index when out is 0
+void Kmerizer::mergeRuns(
+    const size_t           bin,
+    const vector<size_t> & runs,
+    const size_t           out)
+{
+    char fname[100];
+    if (out > 0) {
+        sprintf(fname,"%s/%zi-mers.%zi.%zi",outdir,k,bin,out);
+        KmerRunWriter * writer = new KmerRunWriter(fname, nwords);
+        mergeRange(bin, runs, NULL, NULL, writer, NULL, NULL);
+        setRunSize(bin, out, writer->size());
+        delete writer;
+    }
+    else {
         const size_t nbits = 8 * kmerSize;
         BitVector* merged_slices[nbits];
-        bitset<256> bbit;
-        unsigned int boff[nbits];
-        unsigned int n=0;
-        memset(boff, 0, nbits * sizeof(size_t));
-        const unsigned int bpw = 8 * sizeof(kword_t); // bits per word
-
         for (size_t b=0;b<nbits;b++)
             merged_slices[b] = new BitVector(true);
+        vector<uint32_t> merged_tally;
+        mergeRange(bin, runs, NULL, NULL, NULL, merged_slices, &merged_tally);
+        rangeIndex(merged_tally,kmerFreq[bin],counts[bin]);
+        writeBin(bin, merged_slices);
+    }
+    removeRuns(bin, runs);
+}
 
-        // read the first kmer and counts from each batch
-        for (size_t i=0;i<batches;i++) {
-            size_t err =
-                pos2kmer(offset[i], kmers + i * nwords, batch_slices[i]);
-            if (err != 0) {
-                todo--;
-                btally[i]=0;
-            }
-            else {
-                btally[i] = pos2value(offset[i]++,batch_values[i],batch_counts[i]);
-            }
-        }
-        // choose min
-        size_t mindex = findMin(kmers,btally);
-        kword_t distinct[nwords];
-        memcpy(distinct,kmers + mindex*nwords, kmerSize);
-        tally.push_back(btally[mindex]);
-        // mark the set bits in the first distinct kmer
-        for (size_t w=0;w<nwords;w++) {
-            unsigned int count = popCount(distinct[w]);
-            for (unsigned int r=1; r<=count; r++)
-                bbit.set(selectBit(distinct[w],r)+w*bpw,1);
-        }
-        // replace min
-        // iterate until there's nothing left to do
-        
-        while(todo>0) {
-            size_t err = pos2kmer(offset[mindex],kmers + mindex*nwords, batch_slices[mindex]);
-            if (err != 0) {
-                todo--;
-                btally[mindex]=0;
-                if (todo==0) break;
-            }
-            else
-                btally[mindex] = pos2value(offset[mindex]++,batch_values[mindex],batch_counts[mindex]);
-            mindex = findMin(kmers,btally);
-            // compare to distinct
-            if (kmercmp(kmers + mindex*nwords, distinct, nwords) == 0) // same kmer
-                tally.back() += btally[mindex];
-            else { // find the changed bits
-                tally.push_back(btally[mindex]);
-                n++;
-                kword_t *minkmer = kmers + mindex*nwords;
-                for (size_t w=0;w<nwords;w++) {
-                    kword_t x = distinct[w] ^ minkmer[w];
-                    unsigned int count = popCount(x);
-                    for (unsigned int r = 1; r<=count; r++) {
-                        unsigned int b = selectBit(x,r) + w*bpw;
-                        merged_slices[b]->appendFill(bbit.test(b),n-boff[b]);
-                        bbit.flip(b);
-                        boff[b]=n;
-                    }
-                    distinct[w] = minkmer[w];
-                }
-            }
-        }
-        // finish the bitvectors
-        n++;
-        for (size_t b=0; b<nbits; b++)
-            if(boff[b]<n-1)
-                merged_slices[b]->appendFill(bbit.test(b),n-boff[b]);
-        
-        rangeIndex(tally,kmerFreq[bin],counts[bin]);
-
-        // clean up the bitvector pointers
-        for(size_t i=0;i<batches;i++)
-            for (size_t b=0;b<nbits;b++) {
-                delete batch_slices[i][b];
-                delete batch_counts[i][b];
-            }
+// merge one bin into the index in nparts key ranges concurrently. The
+// splitters are taken from the sampled kmers of every run, and the slices
+// of the ranges are concatenated in order.
+void Kmerizer::splitMerge(
+    const size_t           bin,
+    const vector<size_t> & runs,
+    const size_t           nparts)
+{
+    const size_t nbits = 8 * kmerSize;
+    char fname[100];
 
-        // open an output file for the merged distinct kmers
-        FILE *ofp;
-        char fname[100];
-        sprintf(fname,"%s/%zi-mers.%zi",outdir,k,bin);
-        ofp = fopen(fname,"wb");
+    // pool the samples of all runs and sort them
+    vector<kword_t> samples;
+    for (size_t i=0;i<runs.size();i++) {
+        sprintf(fname,"%s/%zi-mers.%zi.%zi",outdir,k,bin,runs[i]);
+        KmerRunReader reader(fname, nwords);
+        vector<kword_t> run_samples;
+        reader.samples(run_samples);
+        samples.insert(samples.end(), run_samples.begin(), run_samples.end());
+    }
+    size_t nsamples = samples.size() / nwords;
+    vector<size_t> order(nsamples);
+    for (size_t i=0;i<nsamples;i++)
+        order[i] = i;
+    sort(order.begin(), order.end(), KmerLess(samples.data(), nwords));
 
-        fwrite(&nbits,sizeof(size_t),1,ofp);
+    // pick evenly spaced distinct splitters
+    vector<kword_t> splitters;
+    for (size_t p=1;p<nparts;p++) {
+        const kword_t * s = samples.data() + order[p*nsamples/nparts]*nwords;
+        size_t nsplit = splitters.size() / nwords;
+        if (nsplit > 0 && kmercmp(splitters.data() + (nsplit-1)*nwords, s, nwords) >= 0)
+            continue;
+        splitters.insert(splitters.end(), s, s + nwords);
+    }
+    size_t nranges = splitters.size() / nwords + 1;
+
+    // merge each key range [splitter p-1, splitter p) on its own thread
+    BitVector ** part_slices = new BitVector*[nranges * nbits];
+    vector<uint32_t> * part_tally = new vector<uint32_t>[nranges];
+    for (size_t b=0;b<nranges*nbits;b++)
+        part_slices[b] = new BitVector(true);
+    boost::thread_group tg;
+    for (size_t p=0;p<nranges;p++) {
+        const kword_t * lo = (p == 0) ? NULL : splitters.data() + (p-1)*nwords;
+        const kword_t * hi = (p == nranges-1) ? NULL : splitters.data() + p*nwords;
+        tg.create_thread(boost::bind(&Kmerizer::mergeRange, this, bin, boost::cref(runs),
+            lo, hi, (KmerRunWriter*)NULL, part_slices + p*nbits, part_tally + p));
+    }
+    tg.join_all();
+
+    // concatenate the ranges
+    for (size_t p=1;p<nranges;p++) {
         for (size_t b=0;b<nbits;b++) {
-            uint32_t c = merged_slices[b]->cnt();
-            fwrite(&c,sizeof(uint32_t),1,ofp);
+            part_slices[b]->append(*part_slices[p*nbits + b]);
+            delete part_slices[p*nbits + b];
         }
-        for (size_t b=0;b<nbits;b++) {
-            uint32_t *buf;
-            size_t bytes = merged_slices[b]->dump(&buf);
-            // fprintf(stderr,"%zi: %zi,",b,bytes);
-            fwrite(&bytes,sizeof(size_t),1,ofp);
-            fwrite(buf,1,bytes,ofp);
-            free(buf);
-            delete merged_slices[b];
+        part_tally[0].insert(part_tally[0].end(), part_tally[p].begin(), part_tally[p].end());
+        vector<uint32_t>().swap(part_tally[p]);
+    }
+    rangeIndex(part_tally[0],kmerFreq[bin],counts[bin]);
+    writeBin(bin, part_slices);
+    delete [] part_slices;
+    delete [] part_tally;
+    removeRuns(bin, runs);
+}
+
+// k-way merge of the kmers in [lo,hi) of the sorted runs of a bin (NULL
+// means unbounded). Only one buffered block per run is held in memory. The
+// merged distinct kmers go to the writer, or are bit sliced into kmer_slices
+// with their counts pushed onto merged_tally.
+void Kmerizer::mergeRange(
+    const size_t           bin,
+    const vector<size_t> & runs,
+    const kword_t *        lo,
+    const kword_t *        hi,
+    KmerRunWriter *        writer,
+    BitVector **           kmer_slices,
+    vector<uint32_t> *     merged_tally)
+{
+    const size_t nruns = runs.size();
+    KmerRunReader * readers[nruns];
+    kword_t  kmers[nruns*nwords]; // next kmer in each active run
+    uint32_t btally[nruns]; // frequency of next kmer in each run
+    uint32_t todo = nruns; // number of runs to process
+    char fname[100];
+
+    // read the first kmer and count from each run
+    for (size_t i=0;i<nruns;i++) {
+        sprintf(fname,"%s/%zi-mers.%zi.%zi",outdir,k,bin,runs[i]);
+        readers[i] = new KmerRunReader(fname, nwords);
+        bool more = (lo == NULL) ? readers[i]->next() : readers[i]->seek(lo);
+        if (more && (hi == NULL || kmercmp(readers[i]->kmer(), hi, nwords) < 0)) {
+            memcpy(kmers + i*nwords, readers[i]->kmer(), kmerSize);
+            btally[i] = readers[i]->count();
         }
+        else {
+            btally[i] = 0;
+            todo--;
+        }
+    }
 
-        fclose(ofp);
-        
-        char counts_file[100];
-        sprintf(counts_file,"%s/%zi-mers.%zi.idx",outdir,k,bin);
-        ofp = fopen(counts_file, "wb");
-        // first write the number of distinct values
-        // then write the distinct values
-        // for each distinct value, write out the BitVector (size,count,rle,words.size(),words)
-        int n_distinct = kmerFreq[bin].size();
-        fwrite(&n_distinct,sizeof(int),1,ofp);
-        fwrite(kmerFreq[bin].data(),sizeof(uint32_t),n_distinct,ofp);
-        for (size_t i=0;i<n_distinct;i++) {
-            uint32_t *buf;
-            size_t bytes = counts[bin][i]->dump(&buf);
-            fwrite(&bytes,sizeof(size_t),1,ofp);
-            fwrite(counts[bin][i]->getWords().data(),1,counts[bin][i]->bytes(),ofp);
-            delete counts[bin][i];
+    kword_t block[LITERAL_SIZE * nwords]; // distinct kmers not yet sliced
+    size_t n = 0;
+    kword_t distinct[nwords];
+    uint32_t dcount = 0;
+    bool have = false;
+    for (;;) {
+        size_t mindex = (todo > 0) ? findMin(kmers,btally,nruns) : 0;
+        if (todo > 0 && have && kmercmp(kmers + mindex*nwords, distinct, nwords) == 0)
+            dcount += btally[mindex]; // same kmer
+        else {
+            // emit the finished distinct kmer
+            if (have) {
+                if (writer != NULL)
+                    writer->append(distinct, dcount);
+                else {
+                    merged_tally->push_back(dcount);
+                    memcpy(block + n*nwords, distinct, kmerSize);
+                    if (++n == LITERAL_SIZE) {
+                        sliceBlock(block, n, kmer_slices);
+                        n = 0;
+                    }
+                }
+            }
+            if (todo == 0) break;
+            memcpy(distinct, kmers + mindex*nwords, kmerSize);
+            dcount = btally[mindex];
+            have = true;
+        }
+        // replace min
+        if (readers[mindex]->next()
+            && (hi == NULL || kmercmp(readers[mindex]->kmer(), hi, nwords) < 0)) {
+            memcpy(kmers + mindex*nwords, readers[mindex]->kmer(), kmerSize);
+            btally[mindex] = readers[mindex]->count();
         }
-        fclose(ofp);
-        
-        // delete input files
-        for (size_t i=0;i<batches;i++) {
-            sprintf(fname,"%s/%zi-mers.%zi.%zi",outdir,k,bin,i+1);
-            if (remove(fname) != 0) perror("error deleting file");
-            sprintf(fname,"%s/%zi-mers.%zi.%zi.idx",outdir,k,bin,i+1);
-            if (remove(fname) != 0) perror("error deleting file");
+        else {
+            btally[mindex] = 0;
+            todo--;
         }
     }
-}
-size_t Kmerizer::pos2kmer(size_t pos, kword_t *kmer, vector<BitVector*> &index) {
-    if (pos >= index[0]->getSize()) return 1;
-    size_t bpw = 8*sizeof(kword_t);
-    // need to zero the kmer first
-    memset(kmer,0,kmerSize);
-    for(size_t b=0;b<8*kmerSize;b++)
-        if (index[b]->find(pos))
-            kmer[b/bpw] |= 1ULL << (bpw - b%bpw - 1);
-    return 0;
-}
+    // finish the bitvectors
+    if (n > 0)
+        sliceBlock(block, n, kmer_slices);
 
-uint32_t Kmerizer::pos2value(
-    size_t pos,
-    vector<uint32_t> &values,
-    vector<BitVector*> &index)
-{
-    // lookup the value in the pos bit
-    // find the first BitVector where this bit is set
-    for(size_t i=0;i<values.size();i++)
-        if (index[i]->find(pos))
-            return values[i];
-    return 0;
+    for (size_t i=0;i<nruns;i++)
+        delete readers[i];
 }
 
+void Kmerizer::removeRuns(const size_t bin, const vector<size_t> & runs) {
+    char fname[100];
+    for (size_t i=0;i<runs.size();i++) {
+        sprintf(fname,"%s/%zi-mers.%zi.%zi",outdir,k,bin,runs[i]);
+        if (remove(fname) != 0) perror("error deleting file");
+    }
+}
 
 inline size_t
-Kmerizer::findMin(const kword_t * kmers, const uint32_t * kcounts) {
+Kmerizer::findMin(const kword_t * kmers, const uint32_t * kcounts, const size_t n) {
     size_t mindex = 0;
     while (kcounts[mindex] == 0) mindex++;
-    for (size_t i=mindex+1;i<batches;i++)
+    for (size_t i=mindex+1;i<n;i++)
         if (kcounts[i] != 0)
             if (kmercmp(kmers + i*nwords,kmers + mindex*nwords,nwords) < 0)
                 mindex = i;
@@ -927,196 +1606,914 @@ void Kmerizer::rangeIndex(vector<uint32_t> &vec, vector<uint32_t> &values, vecto
         values.insert(values.end(),overflow.begin(),it);
     }
 //    fprintf(stderr,"rangeIndex() %zi distinct values\n",values.size());
-    // setup a vector for each range
-    vector<uint32_t> * vrange = new vector<uint32_t>[values.size()];
-    // iterate over the vec and push the offset onto each range
+    // build the bitvectors as runs of fills. Bitvector j holds position i when
+    // vec[i] >= values[j], so moving from one position to the next only flips
+    // the bitvectors between the two levels. start[j] is where the current run
+    // of bitvector j began.
+    const size_t nvalues = values.size();
+    index.resize(nvalues);
+    for (size_t j=0;j<nvalues;j++)
+        index[j] = new BitVector(true);
+    vector<size_t> start(nvalues,0);
+    size_t prev = 0; // number of bitvectors set at the previous position
     for (size_t i=0;i<vec.size();i++) {
         it = lower_bound(values.begin(),values.end(),vec[i]);
-        for (size_t j=0;j<=(it - values.begin());j++)
-            vrange[j].push_back(i);
+        size_t level = (it - values.begin()) + 1;
+        size_t lo = (level < prev) ? level : prev;
+        size_t hi = (level < prev) ? prev : level;
+        for (size_t j=lo;j<hi;j++) {
+            if (i > start[j])
+                index[j]->appendFill(j < prev, i - start[j]);
+            start[j] = i;
+        }
+        prev = level;
     }
-    // create a bitvector for each range
-    index.resize(values.size());
-    for (size_t i=0;i<values.size();i++)
-        index[i] = new BitVector(vrange[i]);
+    for (size_t j=0;j<nvalues;j++)
+        if (vec.size() > start[j])
+            index[j]->appendFill(j < prev, vec.size() - start[j]);
 }
 
-// need an iterator that works with a BitVector mask BitVector->next_one(); - returns position of set bit
-// or number of bits (invalid response)
-
-// We can do this in parallel if we figure out in advance the offset within the output file for each bin.
-// A frequency histogram can get us the number of 1 digit counts, 2 digit counts, 3 digit counts, etc.
-// So, if there are mask->cnt() set bits, we need n*(k+2) + n1 + 2n2 + 3n3 etc bytes. Each kmer takes k bytes, and you have a tab and a newline character on each line. n1 = 1 digit counts, n2 = 2 digit counts, etc...
+// write every kmer and its count, one "kmer\tcount" line each
 void Kmerizer::dump(char *fname) {
-    // create a bitvector of all 1's for each bin
-    // and call dump(FILE *fp, BitVector *mask)
     BitVector *mask[NBINS];
-    for (size_t i=0;i<NBINS;i++) {
-        mask[i] = new BitVector(true); // first create an empty bitvector
-        mask[i]->appendFill(true,counts[i][0]->getSize()); // then make it all 1's
-    }
-    sdump(fname,mask);
+    filter(1,0,mask); // all kmers
+    pdump(fname,mask);
+    for (size_t bin=0;bin<NBINS;bin++)
+        delete mask[bin];
 }
 
 // find kmers with frequencies in the given range[min,max]
 // when max < min, ignore max and find kmers with frequencies in the range[min,infinity]
 void Kmerizer::filter(uint32_t min, uint32_t max, BitVector **mask) {
-    // do range queries over each bin to build up an array of BitVector masks.
+    KmerFilter conditions;
+    filter(conditions.count(min, max), mask);
+}
+
+// every condition becomes a few operations on the compressed count and
+// kmer bitmaps of a bin, and the bins are filtered in parallel
+void Kmerizer::filter(const KmerFilter &conditions, BitVector **mask) {
+    for (size_t i=0; i < conditions.basePos.size(); i++) {
+        long pos = conditions.basePos[i];
+        if (pos >= (long)k || pos < -(long)k) {
+            fprintf(stderr,"KmerFilter: base %ld is outside a %zi-mer\n",pos,k);
+            exit(1);
+        }
+    }
+    Kmerizer *other = conditions.exclude;
+    if (other != NULL && (other->k != k || other->mode != mode)) {
+        fprintf(stderr,"KmerFilter: can only exclude kmers of an index with the same k and mode\n");
+        exit(1);
+    }
     boost::thread_group tg;
     for (size_t i = 0; i < NBINS; i += threadBins) {
         size_t j = (i + threadBins > NBINS) ? NBINS : i + threadBins;
-        tg.create_thread(boost::bind(&Kmerizer::doFilter, this, i, j, min, max, mask));
+        tg.create_thread(boost::bind(&Kmerizer::doFilter, this, i, j, &conditions, mask));
     }
     tg.join_all();
 }
 
+KmerFilter & KmerFilter::count(const uint32_t min, const uint32_t max) {
+    minCount = min;
+    maxCount = max;
+    return *this;
+}
+
+KmerFilter & KmerFilter::base(const long pos, const char nucl) {
+    if (strchr("ACGT", nucl) == NULL || nucl == '\0') {
+        fprintf(stderr,"KmerFilter: %c is not one of A, C, G or T\n",nucl);
+        exit(1);
+    }
+    basePos.push_back(pos);
+    baseNucl.push_back(nucl);
+    return *this;
+}
+
+KmerFilter & KmerFilter::prefix(const char *seq) {
+    for (long i=0; seq[i] != '\0'; i++)
+        base(i, seq[i]);
+    return *this;
+}
+
+KmerFilter & KmerFilter::suffix(const char *seq) {
+    long len = strlen(seq);
+    for (long i=0; i < len; i++)
+        base(i - len, seq[i]);
+    return *this;
+}
 
+KmerFilter & KmerFilter::gc(const size_t min, const size_t max) {
+    minGC = min;
+    maxGC = max;
+    return *this;
+}
+
+KmerFilter & KmerFilter::excluding(Kmerizer *index) {
+    exclude = index;
+    return *this;
+}
+
+
+// The output size of each bin is known in advance: every line takes k+2
+// bytes plus the digits of the count, and counts[bin] tells how many of the
+// masked kmers reach each power of ten. Each thread writes its bins
+// straight into the mmap'd output file at their offsets.
 void Kmerizer::pdump(char *fname, BitVector **mask) {
-    // determine the uncompressed bin sizes in advance so we can doDump in parallel
-    // binsize[bin] = mask[bin]->cnt() * (k+2) + d*number of d digit counts
-    uint32_t binsize[NBINS];
-    uint32_t total_size=0;
+    size_t binsize[NBINS];
+    boost::thread_group size_tg;
+    for (size_t i = 0; i < NBINS; i += threadBins) {
+        size_t j = (i + threadBins > NBINS) ? NBINS : i + threadBins;
+        size_tg.create_thread(boost::bind(&Kmerizer::doDumpSize, this, i, j, mask, binsize));
+    }
+    size_tg.join_all();
+    size_t offset[NBINS];
+    size_t total=0;
     for (size_t bin=0;bin<NBINS;bin++) {
-        binsize[bin] = mask[bin]->cnt() * (k+2); // k-mer\t\n
-        // d digit counts
-        uint32_t d=1;
-        vector<uint32_t>::iterator it = lower_bound(kmerFreq[bin].begin(),kmerFreq[bin].end(),10);
-        while(it != kmerFreq[bin].end()) {
-            if (it > kmerFreq[bin].begin()) {
-                it--;
-                BitVector *dmask = *counts[bin][*it] & *mask[bin];
-                binsize[bin] += d*dmask->cnt();
-            }
-            d++;
-            it = lower_bound(it,kmerFreq[bin].end(),10^d);
+        offset[bin] = total;
+        total += binsize[bin];
+    }
+
+    int fd = open(fname, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, total) != 0) {
+        perror(fname);
+        exit(1);
+    }
+    if (total > 0) {
+        char *buff = (char*)mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (buff == MAP_FAILED) {
+            perror(fname);
+            exit(1);
+        }
+        boost::thread_group tg;
+        for (size_t i = 0; i < NBINS; i += threadBins) {
+            size_t j = (i + threadBins > NBINS) ? NBINS : i + threadBins;
+            tg.create_thread(boost::bind(&Kmerizer::doPdump, this, i, j, buff, offset, mask));
+        }
+        tg.join_all();
+        munmap(buff, total);
+    }
+    close(fd);
+}
+
+// same output as pdump, one bin at a time through a buffer
+void Kmerizer::sdump(char *fname, BitVector **mask) {
+    FILE *fp = fopen(fname, "w");
+    if (fp == NULL) {
+        perror(fname);
+        exit(1);
+    }
+    vector<char> buff;
+    for (size_t bin=0;bin<NBINS;bin++) {
+        buff.resize(dumpSize(bin, mask[bin]));
+        if (buff.empty()) continue;
+        dumpBin(bin, mask[bin], buff.data());
+        if (fwrite(buff.data(), 1, buff.size(), fp) != buff.size()) {
+            perror(fname);
+            exit(1);
+        }
+    }
+    fclose(fp);
+}
+
+void Kmerizer::doDumpSize(const size_t from,
+                          const size_t to,
+                          BitVector ** mask,
+                          size_t *     binsize)
+{
+    for (size_t bin = from; bin < to; bin++)
+        binsize[bin] = dumpSize(bin, mask[bin]);
+}
+
+void Kmerizer::doPdump(const size_t   from,
+                       const size_t   to,
+                       char *         buff,
+                       const size_t * offset,
+                       BitVector **   mask)
+{
+    for (size_t bin = from; bin < to; bin++)
+        dumpBin(bin, mask[bin], buff + offset[bin]);
+}
+
+// a count has one digit, plus one more for each power of ten it reaches
+size_t Kmerizer::dumpSize(const size_t bin, BitVector *mask) {
+    boost::unique_lock<boost::shared_mutex> lock(binMutex[bin]);
+    loadBin(bin, false);
+    if (counts[bin].empty()) return 0;
+    vector<uint32_t> & freq = kmerFreq[bin];
+    size_t bytes = mask->cnt() * (k + 3); // kmer\t, a digit and \n
+    for (uint64_t p=10; p <= freq.back(); p *= 10) {
+        size_t j = lower_bound(freq.begin(),freq.end(),p) - freq.begin();
+        BitVector *digit = *counts[bin][j] & *mask;
+        bytes += digit->cnt();
+        delete digit;
+    }
+    return bytes;
+}
+
+// write the decimal digits of x, returning the number of digits
+static inline size_t formatCount(uint32_t x, char *out) {
+    char digits[10];
+    size_t n = 0;
+    do {
+        digits[n++] = '0' + x % 10;
+        x /= 10;
+    } while (x > 0);
+    for (size_t i=0;i<n;i++)
+        out[i] = digits[n-1-i];
+    return n;
+}
+
+// decode the next block of the slices that holds kmers set in mask, and
+// the counts of those kmers. kmers[i] and freqs[i] are the i-th masked
+// kmer of the block. returns how many there are, 0 when mask is done.
+// next1 and cur (the next block of the cursor) start at mask->nextOne(0)
+// and 0, and counted (the places in the count bitmaps) empty.
+size_t Kmerizer::nextMaskedBlock(const size_t bin,
+                                 BitVector *  mask,
+                                 SliceCursor &cursor,
+                                 uint32_t &   next1,
+                                 size_t &     cur,
+                                 kword_t *    kmers,
+                                 uint32_t *   freqs,
+                                 vector<BitVector::Cursor> &counted)
+{
+    const uint32_t size = mask->getSize();
+    if (next1 >= size) return 0;
+    kword_t block[LITERAL_SIZE * nwords];
+    uint32_t pos[LITERAL_SIZE];
+    size_t b = next1 / LITERAL_SIZE;
+    cursor.skip(b - cur);
+    unsliceBlock(cursor, block);
+    cur = b + 1;
+    size_t n = 0;
+    while (next1 < size && next1 < cur * LITERAL_SIZE) {
+        memcpy(kmers + n*nwords, block + (next1 - b*LITERAL_SIZE)*nwords, kmerSize);
+        pos[n++] = next1;
+        next1 = mask->nextOne(next1 + 1);
+    }
+    frequencies(bin, pos, n, freqs, counted);
+    return n;
+}
+
+char * Kmerizer::dumpBin(const size_t bin, BitVector *mask, char *out) {
+    boost::unique_lock<boost::shared_mutex> lock(binMutex[bin]);
+    loadBin(bin, true);
+    if (slices[bin].empty()) return out;
+    kword_t kmers[LITERAL_SIZE * nwords];
+    uint32_t freqs[LITERAL_SIZE];
+    SliceCursor cursor(slices[bin]);
+    size_t cur = 0;
+    uint32_t next1 = mask->nextOne(0);
+    vector<BitVector::Cursor> counted;
+    size_t n;
+    while ((n = nextMaskedBlock(bin, mask, cursor, next1, cur, kmers, freqs, counted)) > 0) {
+        for (size_t i=0;i<n;i++) {
+            unpack(kmers + i*nwords, out);
+            out += k;
+            *out++ = '\t';
+            out += formatCount(freqs[i], out);
+            *out++ = '\n';
         }
-        total_size += binsize[bin];
     }
-    // use memory mapped IO to do this
-    // maybe open the output file, resize it, and then mmap it to some buffer
-    // You can't do this with stdout. is that a problem?
-    char *buff;
-//  mmap(buff, total_size);
+    return out;
+}
+
+// same layout as KmerExportReader expects, see kmerexport.h
+void Kmerizer::exportBinary(char *fname, BitVector **mask) {
+    uint64_t binStart[NBINS + 1];
+    binStart[0] = 0;
+    for (size_t bin=0;bin<NBINS;bin++)
+        binStart[bin + 1] = binStart[bin] + mask[bin]->cnt();
+    const uint64_t n = binStart[NBINS];
+    const size_t table = sizeof(KmerExportHeader);
+    const size_t kmerColumn = table + (NBINS + 1) * sizeof(uint64_t);
+    const size_t countColumn = kmerColumn + n * kmerSize;
+    const size_t total = countColumn + n * sizeof(uint32_t);
+
+    int fd = open(fname, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, total) != 0) {
+        perror(fname);
+        exit(1);
+    }
+    char *buff = (char*)mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (buff == MAP_FAILED) {
+        perror(fname);
+        exit(1);
+    }
+    KmerExportHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, KMEREXPORT_MAGIC, sizeof(header.magic));
+    header.k = k;
+    header.nwords = nwords;
+    header.nbins = NBINS;
+    header.n = n;
+    memcpy(buff, &header, sizeof(header));
+    memcpy(buff + table, binStart, sizeof(binStart));
+
     boost::thread_group tg;
-    uint32_t offset=0;
     for (size_t i = 0; i < NBINS; i += threadBins) {
         size_t j = (i + threadBins > NBINS) ? NBINS : i + threadBins;
-        // pass a pointer to the right place in the mmap'd output file
-        tg.create_thread(boost::bind(&Kmerizer::doPdump, this, i, j, buff + offset, mask));
-        for (size_t bin=i;bin<j;bin++)
-            offset += binsize[bin];
+        tg.create_thread(boost::bind(&Kmerizer::doExport, this, i, j,
+            (kword_t*)(buff + kmerColumn), (uint32_t*)(buff + countColumn), binStart, mask));
     }
     tg.join_all();
-    // close the output file
+    munmap(buff, total);
+    close(fd);
 }
 
-void Kmerizer::sdump(char *fname, BitVector **mask) {
-    // open output file
-    FILE *fp;
-    fp = fopen(fname, "w");
-    size_t bpw = 8*sizeof(kword_t); // bits per word
-    char kstr[k+1]; // unpack each kmer into this char array.
-    for (size_t bin=0;bin<NBINS;bin++) {
-        // check if bit slices have been loaded
-        if (slices[bin].empty()) {
-            char bfname[100];
-            sprintf(bfname,"%s/%zi-mers.%zi",outdir,k,bin);
-            vector<uint32_t> tmp;
-            readBitmap(bfname,tmp,slices[bin]);
-        }
-        // iterate over the set bits in mask[bin]
-        uint32_t bv_len = mask[bin]->getSize();
+void Kmerizer::doExport(const size_t     from,
+                        const size_t     to,
+                        kword_t *        kmers,
+                        uint32_t *       freqs,
+                        const uint64_t * binStart,
+                        BitVector **     mask)
+{
+    for (size_t bin = from; bin < to; bin++) {
+        if (binStart[bin + 1] == binStart[bin]) continue;
+        boost::unique_lock<boost::shared_mutex> lock(binMutex[bin]);
+        loadBin(bin, true);
+        SliceCursor cursor(slices[bin]);
+        size_t cur = 0;
         uint32_t next1 = mask[bin]->nextOne(0);
-        while (next1 < bv_len) {
-            kword_t kmer[nwords];
-            for (size_t w=0;w<nwords;w++) {
-                kmer[w]=0;
-                for (size_t b=0;b<bpw;b++) {
-                    if(slices[bin][w*bpw + b]->find(next1)) {
-                        kmer[w] |= 1 << (bpw-b-1);
-                    }
-                }
-            }
-            // output the kmer and count
-            unpack(kmer, kstr);
-            fprintf(fp,"%s\t%u\n",kstr,frequency(bin,next1));
-            uint32_t next1 = mask[bin]->nextOne(next1+1);
-        }
+        vector<BitVector::Cursor> counted;
+        uint64_t i = binStart[bin];
+        size_t n;
+        while ((n = nextMaskedBlock(bin, mask[bin], cursor, next1, cur,
+                                    kmers + i*nwords, freqs + i, counted)) > 0)
+            i += n;
     }
-    fclose(fp);
 }
 
 void
-Kmerizer::doPdump(const size_t from,
-                 const size_t to,
-                 char *       buff,
-                 BitVector ** mask)
+Kmerizer::doFilter(const size_t       from,
+                   const size_t       to,
+                   const KmerFilter * conditions,
+                   BitVector **       mask)
 {
-    size_t bpw = 8 * sizeof(kword_t); // bits per word
-    char kstr[k+1]; // unpack each kmer into this char array.
+    Kmerizer *other = conditions->exclude;
+    const bool kmers = !conditions->basePos.empty() || other != NULL
+        || conditions->minGC > 0 || conditions->maxGC < k;
+    // reused by every bin of the range
+    vector<word_t> scratch;
+    vector<BitVector*> operands;
+    vector<BitVector*> negatives; // slices that must be 0
+    BitVector *combined = new BitVector();
     for (size_t bin = from; bin < to; bin++) {
-        // check if we've loaded the bit slices for this bin
-        if (slices[bin].empty()) {
-            // load the kmer slices for this bin
-            char fname[100];
-            sprintf(fname,"%s/%zi-mers.%zi",outdir,k,bin);
-            vector<uint32_t> junk;
-            readBitmap(fname,junk,slices[bin]);
+        // lock the bin of the excluded index too, in a deadlock free order
+        boost::shared_mutex unused;
+        boost::unique_lock<boost::shared_mutex> lock(binMutex[bin], boost::defer_lock);
+        boost::unique_lock<boost::shared_mutex> other_lock((other != NULL && other != this)
+            ? other->binMutex[bin] : unused, boost::defer_lock);
+        boost::lock(lock, other_lock);
+        loadBin(bin, kmers);
+        mask[bin] = countMask(bin, conditions->minCount, conditions->maxCount);
+        if (counts[bin].empty()) continue; // empty bin
+        const word_t size = counts[bin][0]->getSize();
+        // AND the count mask with all the base and GC conditions at once
+        operands.assign(1, mask[bin]);
+        negatives.clear();
+        // fixed bases. A=00, C=01, G=10, T=11 in the high and low slice
+        for (size_t i=0; i < conditions->basePos.size(); i++) {
+            long pos = conditions->basePos[i];
+            size_t hi = baseSlice(pos < 0 ? k + pos : pos);
+            size_t code = strchr("ACGT", conditions->baseNucl[i]) - "ACGT";
+            for (size_t b=0; b < 2; b++) {
+                BitVector *slice = slices[bin][hi + b];
+                if (code & (2 >> b))
+                    operands.push_back(slice);
+                else
+                    negatives.push_back(slice);
+            }
         }
-        // iterate over the set bits in mask[bin]
-        uint32_t bv_len = mask[bin]->getSize();
-        uint32_t next1 = mask[bin]->nextOne(0);
-        while (next1 < bv_len) {
-            kword_t kmer[nwords];
-            for (size_t w=0;w<nwords;w++) {
-                kmer[w]=0;
-                for (size_t b=0;b<bpw;b++) {
-                    if(slices[bin][w*bpw + b]->find(next1)) {
-                        kmer[w] |= 1 << (bpw-b-1);
-                    }
+        BitVector *gc = NULL;
+        if (conditions->minGC > 0 || conditions->maxGC < k) {
+            gc = gcMask(bin, conditions->minGC, conditions->maxGC);
+            operands.push_back(gc);
+        }
+        if (operands.size() > 1) {
+            BitVector::andAll(operands, *combined);
+            swap(mask[bin], combined); // the old mask's words get reused
+        }
+        delete gc;
+        // minus the kmers with a 1 in any of those
+        if (!negatives.empty()) {
+            BitVector::orAll(negatives, *combined);
+            mask[bin]->andNotWith(*combined, scratch);
+        }
+        if (other == this) {
+            delete mask[bin];
+            mask[bin] = new BitVector(true);
+            mask[bin]->appendFill(false, size);
+        }
+        else if (other != NULL && mask[bin]->cnt() > 0) {
+            BitVector *absent = absentMask(bin, other);
+            mask[bin]->andWith(*absent, scratch);
+            delete absent;
+        }
+    }
+    delete combined;
+}
+
+// range encoding: bitvector j marks kmers that occur >= kmerFreq[bin][j]
+// times, therefore counts[bin].front() marks all rows
+BitVector * Kmerizer::countMask(const size_t bin, uint32_t min, uint32_t max) {
+    vector<uint32_t> & freq = kmerFreq[bin];
+    BitVector *mask = new BitVector(true);
+    if (counts[bin].empty()) return mask; // empty bin
+    // kmers that occur at least min times
+    size_t lo = lower_bound(freq.begin(),freq.end(),min) - freq.begin();
+    if (lo == freq.size()) {
+        mask->appendFill(false,counts[bin][0]->getSize());
+        return mask;
+    }
+    // minus those that occur more than max times, in one pass
+    size_t hi = (max >= min)
+        ? upper_bound(freq.begin(),freq.end(),max) - freq.begin() : freq.size();
+    if (hi < freq.size())
+        counts[bin][lo]->andNotInto(*counts[bin][hi], *mask);
+    else
+        mask->copy(*counts[bin][lo]);
+    return mask;
+}
+
+// slice b of word w holds bit 63-b of the word. the last word is right
+// aligned, see unpack()
+size_t Kmerizer::baseSlice(const size_t pos) const {
+    const size_t bpw = 8*sizeof(kword_t);
+    size_t w = pos >> 5;
+    if (w == nwords - 1)
+        return w*bpw + bpw - 2*(k - pos);
+    return w*bpw + 2*(pos % 32);
+}
+
+// rows whose bit sliced value (sum[0] is the least significant slice) is
+// at least c: equal in the slices so far and 1 where c has a 0 is greater
+static BitVector * atLeast(vector<BitVector*> &sum, const size_t c, const word_t size) {
+    BitVector *res = new BitVector(true);
+    res->appendFill(false, size);
+    if (c >> sum.size()) return res;
+    BitVector eq(true), greater;
+    vector<word_t> scratch;
+    eq.appendFill(true, size);
+    for (size_t j = sum.size(); j-- > 0;) {
+        if ((c >> j) & 1)
+            eq.andWith(*sum[j], scratch);
+        else {
+            eq.andInto(*sum[j], greater);
+            res->orWith(greater, scratch);
+            eq.andNotWith(*sum[j], scratch);
+        }
+    }
+    res->orWith(eq, scratch);
+    return res;
+}
+
+// a base is G (10) or C (01) when its two slices differ. add these up
+// over the kmer into a bit sliced count and compare it with min and max
+BitVector * Kmerizer::gcMask(const size_t bin, const size_t min, const size_t max) {
+    const word_t size = counts[bin][0]->getSize();
+    size_t m = 1;
+    while (((size_t)1 << m) <= k) m++;
+    vector<BitVector*> sum(m);
+    for (size_t j=0; j < m; j++) {
+        sum[j] = new BitVector(true);
+        sum[j]->appendFill(false, size);
+    }
+    // one set of temporaries for all k bases
+    BitVector carry;
+    BitVector *digit = new BitVector();
+    vector<word_t> scratch;
+    for (size_t pos=0; pos < k; pos++) {
+        size_t hi = baseSlice(pos);
+        slices[bin][hi]->xorInto(*slices[bin][hi + 1], carry);
+        for (size_t j=0; j < m && carry.cnt() > 0; j++) {
+            sum[j]->xorInto(carry, *digit);
+            carry.andWith(*sum[j], scratch);
+            swap(sum[j], digit);
+        }
+    }
+    delete digit;
+    BitVector *mask = atLeast(sum, min, size);
+    // sum <= max is ~sum >= ~max in m bits
+    const size_t ones = ((size_t)1 << m) - 1;
+    if (max < ones) {
+        for (size_t j=0; j < m; j++)
+            sum[j]->flip();
+        BitVector *below = atLeast(sum, ones - max, size);
+        mask->andWith(*below, scratch);
+        delete below;
+    }
+    for (size_t j=0; j < m; j++)
+        delete sum[j];
+    return mask;
+}
+
+BinReader::BinReader(Kmerizer &index, const size_t bin)
+    : index(index), bin(bin), nwords(index.nwords), cursor(index.slices[bin]),
+      size(index.slices[bin].empty() ? 0 : index.slices[bin][0]->getSize()),
+      pos(0), row(0), block(LITERAL_SIZE * index.nwords), freqs(LITERAL_SIZE)
+{
+}
+
+bool BinReader::next() {
+    if (pos == size) return false;
+    row = pos % LITERAL_SIZE;
+    if (row == 0) {
+        // decode the next block and all of its counts
+        index.unsliceBlock(cursor, block.data());
+        word_t rows = (size - pos < LITERAL_SIZE) ? size - pos : LITERAL_SIZE;
+        uint32_t positions[LITERAL_SIZE];
+        for (word_t i=0; i < rows; i++)
+            positions[i] = pos + i;
+        index.frequencies(bin, positions, rows, freqs.data(), counted);
+    }
+    pos++;
+    return true;
+}
+
+void Kmerizer::combine(Kmerizer *left, Kmerizer *right, const char op, const char how) {
+    if (left->k != k || right->k != k || left->mode != mode || right->mode != mode) {
+        fprintf(stderr,"Kmerizer::combine() needs indexes with the same k and mode\n");
+        exit(1);
+    }
+    if (left == this || right == this) {
+        fprintf(stderr,"Kmerizer::combine() can not write over one of its inputs\n");
+        exit(1);
+    }
+    boost::thread_group tg;
+    for (size_t i = 0; i < NBINS; i += threadBins) {
+        size_t j = (i + threadBins > NBINS) ? NBINS : i + threadBins;
+        tg.create_thread(boost::bind(&Kmerizer::doCombine, this, i, j, left, right, op, how));
+    }
+    tg.join_all();
+    state = QUERY;
+}
+
+// both indexes hash a kmer into the same bin, so each bin is a merge of two
+// sorted streams, sliced and range encoded as it goes like a merge of runs
+void Kmerizer::doCombine(const size_t from,
+                         const size_t to,
+                         Kmerizer *   left,
+                         Kmerizer *   right,
+                         const char   op,
+                         const char   how)
+{
+    const size_t nbits = 8 * kmerSize;
+    kword_t block[LITERAL_SIZE * nwords]; // distinct kmers not yet sliced
+    for (size_t bin = from; bin < to; bin++) {
+        boost::shared_mutex unused;
+        boost::unique_lock<boost::shared_mutex> left_lock(left->binMutex[bin], boost::defer_lock);
+        boost::unique_lock<boost::shared_mutex> right_lock((right != left)
+            ? right->binMutex[bin] : unused, boost::defer_lock);
+        boost::lock(left_lock, right_lock);
+        left->loadBin(bin, true);
+        right->loadBin(bin, true);
+        BinReader a(*left, bin);
+        BinReader b(*right, bin);
+        bool more_a = a.next();
+        bool more_b = b.next();
+
+        BitVector* kmer_slices[nbits];
+        for (size_t s=0;s<nbits;s++)
+            kmer_slices[s] = new BitVector(true);
+        vector<uint32_t> merged_tally;
+        size_t n = 0;
+        while (more_a || more_b) {
+            if (!more_a && op != UNION) break;
+            if (!more_b && op == INTERSECTION) break;
+            int cmp = !more_a ? 1 : !more_b ? -1 : kmercmp(a.kmer(), b.kmer(), nwords);
+            const kword_t *kmer = (cmp <= 0) ? a.kmer() : b.kmer();
+            uint32_t count = (cmp <= 0) ? a.count() : b.count();
+            bool keep = (cmp < 0) ? op != INTERSECTION
+                      : (cmp > 0) ? op == UNION
+                      : op != DIFFERENCE;
+            if (cmp == 0) {
+                if (how == SUM_COUNTS) count = a.count() + b.count();
+                else if (how == MIN_COUNTS) count = min(a.count(), b.count());
+                else if (how == RIGHT_COUNTS) count = b.count();
+            }
+            if (keep) {
+                merged_tally.push_back(count);
+                memcpy(block + n*nwords, kmer, kmerSize);
+                if (++n == LITERAL_SIZE) {
+                    sliceBlock(block, n, kmer_slices);
+                    n = 0;
                 }
             }
-            // output the kmer and count
-            unpack(kmer, kstr);
-            // instead of fprintf, use memcpy() to write kstr and frequency to the mmap'd output file
-//          fprintf(fp,"%s\t%u\n",kstr,frequency(bin,next1));
-            uint32_t next1 = mask[bin]->nextOne(next1+1);
+            if (cmp <= 0) more_a = a.next();
+            if (cmp >= 0) more_b = b.next();
         }
+        if (n > 0)
+            sliceBlock(block, n, kmer_slices);
+        rangeIndex(merged_tally,kmerFreq[bin],counts[bin]);
+        writeBin(bin, kmer_slices);
     }
 }
 
-// range encoding: bitvector x marks kmers that occur <= x times
-// therefore counts[bin].back() marks all rows
-void
-Kmerizer::doFilter(const size_t from,
-                   const size_t to,
-                   uint32_t min,
-                   uint32_t max,
-                   BitVector **mask)
+// orders the readers of a k-way merge by their current kmer, for a heap
+// with the least kmer on top
+struct ReaderAfter {
+    vector<BinReader*> * readers;
+    size_t               nwords;
+    ReaderAfter(vector<BinReader*> *readers, size_t nwords)
+        : readers(readers), nwords(nwords) {}
+    bool operator()(const size_t a, const size_t b) const {
+        return kmercmp((*readers)[a]->kmer(), (*readers)[b]->kmer(), nwords) > 0;
+    }
+};
+
+// by address, the order the bins of the samples are locked in
+static bool lockOrder(Kmerizer *a, Kmerizer *b) { return a < b; }
+
+void Kmerizer::joinSamples(vector<Kmerizer*> &samples,
+                           const vector<string> &names,
+                           const bool abundance) {
+    for (size_t i=0; i < samples.size(); i++) {
+        if (samples[i]->k != k || samples[i]->mode != mode || samples[i] == this) {
+            fprintf(stderr,"Kmerizer::joinSamples() needs other indexes with the same k and mode\n");
+            exit(1);
+        }
+    }
+    if (names.size() != samples.size()) {
+        fprintf(stderr,"Kmerizer::joinSamples() needs a name for each sample\n");
+        exit(1);
+    }
+    char fname[100];
+    sprintf(fname,"%s/samples.txt",outdir);
+    FILE *fp = fopen(fname,"w");
+    if (fp == NULL) {
+        perror(fname);
+        exit(1);
+    }
+    for (size_t i=0; i < names.size(); i++)
+        fprintf(fp,"%s\n",names[i].c_str());
+    fclose(fp);
+    sampleNames = names;
+
+    boost::thread_group tg;
+    for (size_t i = 0; i < NBINS; i += threadBins) {
+        size_t j = (i + threadBins > NBINS) ? NBINS : i + threadBins;
+        tg.create_thread(boost::bind(&Kmerizer::doJoin, this, i, j, &samples, abundance));
+    }
+    tg.join_all();
+    state = QUERY;
+}
+
+// a k-way merge of the bin of every sample. presence[s] gets a 1 at the
+// position of each kmer sample s has, and the total count is indexed as
+// usual. the counts of each sample are range encoded over its own kmers
+// only: the count of the kmer at position p is at rank(p) in presence[s].
+void Kmerizer::doJoin(const size_t from,
+                      const size_t to,
+                      vector<Kmerizer*> *samples,
+                      const bool abundance)
 {
+    const size_t nbits = 8 * kmerSize;
+    const size_t nsamples = samples->size();
+    vector<Kmerizer*> locking(*samples);
+    sort(locking.begin(), locking.end(), lockOrder);
+    locking.erase(unique(locking.begin(), locking.end()), locking.end());
+    kword_t block[LITERAL_SIZE * nwords]; // distinct kmers not yet sliced
+    kword_t kmer[nwords];
+    char fname[100];
     for (size_t bin = from; bin < to; bin++) {
-        if (max > 0) {
-            vector<uint32_t>::iterator it =
-                lower_bound(kmerFreq[bin].begin(),kmerFreq[bin].end(),max);
-            if (it == kmerFreq[bin].begin()) {
-                // create a null mask and set the length
-                mask[bin] = new BitVector(true);
-                mask[bin]->appendFill(false,counts[bin][0]->getSize());
+        for (size_t i=0; i < locking.size(); i++) {
+            locking[i]->binMutex[bin].lock();
+            locking[i]->loadBin(bin, true);
+        }
+        vector<BinReader*> readers(nsamples);
+        vector<size_t> heap;
+        ReaderAfter after(&readers, nwords);
+        for (size_t s=0; s < nsamples; s++) {
+            readers[s] = new BinReader(*(*samples)[s], bin);
+            if (readers[s]->next())
+                heap.push_back(s);
+        }
+        make_heap(heap.begin(), heap.end(), after);
+
+        vector<BitVector*> present(nsamples);
+        vector<word_t> filled(nsamples, 0); // bits appended to present[s]
+        for (size_t s=0; s < nsamples; s++)
+            present[s] = new BitVector(true);
+        BitVector* kmer_slices[nbits];
+        for (size_t b=0;b<nbits;b++)
+            kmer_slices[b] = new BitVector(true);
+        vector<uint32_t> merged_tally;
+        vector< vector<uint32_t> > tallies(abundance ? nsamples : 0);
+        word_t pos = 0;
+        size_t n = 0;
+        while (!heap.empty()) {
+            memcpy(kmer, readers[heap.front()]->kmer(), kmerSize);
+            uint32_t total = 0;
+            while (!heap.empty() && kmercmp(readers[heap.front()]->kmer(), kmer, nwords) == 0) {
+                size_t s = heap.front();
+                pop_heap(heap.begin(), heap.end(), after);
+                heap.pop_back();
+                total += readers[s]->count();
+                if (abundance)
+                    tallies[s].push_back(readers[s]->count());
+                present[s]->appendFill(false, pos - filled[s]);
+                present[s]->appendFill(true, 1);
+                filled[s] = pos + 1;
+                if (readers[s]->next()) {
+                    heap.push_back(s);
+                    push_heap(heap.begin(), heap.end(), after);
+                }
             }
-            else {
-                if (*it < max) it--;
-                mask[bin]->copy(counts[bin][it - kmerFreq[bin].begin()]);
+            merged_tally.push_back(total);
+            memcpy(block + n*nwords, kmer, kmerSize);
+            if (++n == LITERAL_SIZE) {
+                sliceBlock(block, n, kmer_slices);
+                n = 0;
+            }
+            pos++;
+        }
+        if (n > 0)
+            sliceBlock(block, n, kmer_slices);
+        for (size_t s=0; s < nsamples; s++) {
+            present[s]->appendFill(false, pos - filled[s]);
+            delete readers[s];
+        }
+        rangeIndex(merged_tally,kmerFreq[bin],counts[bin]);
+        writeBin(bin, kmer_slices);
+
+        vector<uint32_t> ids(nsamples);
+        for (size_t s=0; s < nsamples; s++)
+            ids[s] = s;
+        sprintf(fname,"%s/%zi-mers.%zi.samples",outdir,k,bin);
+        buildSkips(present);
+        writeBitmap(fname, ids, present);
+        if (abundance) {
+            sprintf(fname,"%s/%zi-mers.%zi.abund",outdir,k,bin);
+            FILE *fp = fopen(fname, "wb");
+            if (fp == NULL) {
+                perror(fname);
+                exit(1);
             }
+            for (size_t s=0; s < nsamples; s++) {
+                vector<uint32_t> values;
+                vector<BitVector*> index;
+                rangeIndex(tallies[s], values, index);
+                buildSkips(index);
+                writeBitmap(fp, values, index);
+                for (size_t i=0; i < index.size(); i++)
+                    delete index[i];
+            }
+            fclose(fp);
+        }
+        for (size_t s=0; s < nsamples; s++)
+            delete present[s];
+        for (size_t i=0; i < locking.size(); i++)
+            locking[i]->binMutex[bin].unlock();
+    }
+}
+
+const vector<string> & Kmerizer::samplesJoined() const {
+    return sampleNames;
+}
+
+// the sample names written by joinSamples(), if this is a joint index
+void Kmerizer::readSampleNames() {
+    char fname[100];
+    sprintf(fname,"%s/samples.txt",outdir);
+    FILE *fp = fopen(fname,"r");
+    if (fp == NULL) return;
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &cap, fp)) > 0) {
+        if (line[len - 1] == '\n') line[len - 1] = '\0';
+        sampleNames.push_back(line);
+    }
+    free(line);
+    fclose(fp);
+}
+
+void Kmerizer::loadJoined(const size_t bin) {
+    if (joinedLoaded[bin]) return;
+    joinedLoaded[bin] = true;
+    if (counts[bin].empty()) return;
+    char fname[100];
+    sprintf(fname,"%s/%zi-mers.%zi.samples",outdir,k,bin);
+    vector<uint32_t> ids;
+    FILE *fp = fopen(fname,"rb");
+    if (fp == NULL) {
+        perror(fname);
+        exit(1);
+    }
+    readBitmap(fp, ids, presence[bin]);
+    fclose(fp);
+    sprintf(fname,"%s/%zi-mers.%zi.abund",outdir,k,bin);
+    fp = fopen(fname,"rb");
+    if (fp != NULL) {
+        sampleFreq[bin].resize(ids.size());
+        sampleCounts[bin].resize(ids.size());
+        for (size_t s=0; s < ids.size(); s++)
+            readBitmap(fp, sampleFreq[bin][s], sampleCounts[bin][s]);
+        fclose(fp);
+    }
+    touchBin(bin);
+}
+
+void Kmerizer::findInSamples(const char **queries, const size_t n, uint32_t *counts) {
+    const size_t nsamples = samplesJoined().size();
+    if (nsamples == 0) return; // not a joint index
+    memset(counts, 0, n * nsamples * sizeof(uint32_t));
+    kword_t * packed = new kword_t[n*nwords];
+    pack(queries, n, packed);
+    vector<uint32_t> freqs(n);
+    lookup(packed, n, freqs.data(), counts);
+    delete [] packed;
+}
+
+void Kmerizer::sampleFilter(const vector<size_t> &all,
+                            const vector<size_t> &none,
+                            BitVector **mask) {
+    const size_t nsamples = samplesJoined().size();
+    for (size_t i=0; i < all.size() + none.size(); i++) {
+        size_t s = (i < all.size()) ? all[i] : none[i - all.size()];
+        if (s >= nsamples) {
+            fprintf(stderr,"Kmerizer::sampleFilter(): no sample %zi\n",s);
+            exit(1);
         }
+    }
+    boost::thread_group tg;
+    for (size_t i = 0; i < NBINS; i += threadBins) {
+        size_t j = (i + threadBins > NBINS) ? NBINS : i + threadBins;
+        tg.create_thread(boost::bind(&Kmerizer::doSampleFilter, this, i, j, &all, &none, mask));
+    }
+    tg.join_all();
+}
+
+void Kmerizer::doSampleFilter(const size_t from,
+                              const size_t to,
+                              const vector<size_t> *all,
+                              const vector<size_t> *none,
+                              BitVector **mask)
+{
+    vector<word_t> scratch;
+    vector<BitVector*> operands;
+    vector<BitVector*> others;
+    BitVector present; // in any of none
+    for (size_t bin = from; bin < to; bin++) {
+        boost::unique_lock<boost::shared_mutex> lock(binMutex[bin]);
+        loadBin(bin, false);
+        loadJoined(bin);
+        mask[bin] = new BitVector(true);
+        if (counts[bin].empty()) continue; // empty bin
+        // present in all of all, and not in any of none
+        operands.clear();
+        for (size_t i=0; i < all->size(); i++)
+            operands.push_back(presence[bin][(*all)[i]]);
+        if (operands.empty())
+            mask[bin]->appendFill(true, counts[bin][0]->getSize());
         else
-            mask[bin]->copy(counts[bin].back()); // this is how we deal with max <= 0 (no max)
-        if (mask[bin]->cnt() > 0 && min>1) { // nand
-            // need to find the first BitVector thats < min
-            vector<uint32_t>::iterator it = lower_bound(kmerFreq[bin].begin(),kmerFreq[bin].end(),min);
-            if (it > kmerFreq[bin].begin()) {
-                it--;
-                *mask[bin] &= *(counts[bin][it - kmerFreq[bin].begin()]->copyflip());
+            BitVector::andAll(operands, *mask[bin]);
+        if (!none->empty()) {
+            others.clear();
+            for (size_t i=0; i < none->size(); i++)
+                others.push_back(presence[bin][(*none)[i]]);
+            BitVector::orAll(others, present);
+            mask[bin]->andNotWith(present, scratch);
+        }
+    }
+}
+
+// walk the sorted kmers of the bin in both indexes together. both locks
+// must be held
+BitVector * Kmerizer::absentMask(const size_t bin, Kmerizer *other) {
+    other->loadBin(bin, true);
+    const word_t size = slices[bin][0]->getSize();
+    BitVector *absent = new BitVector(true);
+    if (other->slices[bin].empty()) {
+        absent->appendFill(true, size);
+        return absent;
+    }
+    kword_t mine[LITERAL_SIZE * nwords];
+    kword_t theirs[LITERAL_SIZE * nwords];
+    SliceCursor cursor(slices[bin]);
+    SliceCursor their_cursor(other->slices[bin]);
+    const word_t their_size = other->slices[bin][0]->getSize();
+    word_t j = 0;             // next kmer of other
+    word_t loaded = (word_t)-1; // block of other in theirs
+    for (word_t base=0; base < size; base += LITERAL_SIZE) {
+        unsliceBlock(cursor, mine);
+        word_t rows = (size - base < LITERAL_SIZE) ? size - base : LITERAL_SIZE;
+        word_t word = 0;
+        for (word_t i=0; i < rows; i++) {
+            int cmp = 1;
+            while (j < their_size) {
+                if (j / LITERAL_SIZE != loaded) {
+                    other->unsliceBlock(their_cursor, theirs);
+                    loaded = j / LITERAL_SIZE;
+                }
+                cmp = kmercmp(theirs + (j % LITERAL_SIZE)*nwords, mine + i*nwords, nwords);
+                if (cmp >= 0) break;
+                j++;
             }
+            if (cmp != 0)
+                word |= (word_t)1 << (LITERAL_SIZE - 1 - i);
         }
+        absent->appendWord(word, rows);
     }
+    return absent;
 }
@@ -7,14 +7,92 @@
 #define BOTH 'B'
 #define READING 1
 #define QUERY 2
+#define SAMPLE_BLOCKS 8 // blocks of LITERAL_SIZE kmers per sampled kmer
+
+// set operations of combine()
+#define UNION        'U'
+#define INTERSECTION 'I'
+#define DIFFERENCE   'D' // kmers of the left index that are not in the right
+// counts of kmers in both indexes
+#define SUM_COUNTS   'S'
+#define MIN_COUNTS   'M'
+#define LEFT_COUNTS  'L'
+#define RIGHT_COUNTS 'R'
 
 #include <vector>
+#include <list>
+#include <map>
+#include <string>
+#include <boost/thread.hpp>
 #include "../bvec/bvec.h"
+#include "kmerrun.h"
+#include "kmerexport.h"
+#include "spectrum.h"
 
 typedef uint64_t kword_t;
 using namespace std;
 
+class Kmerizer;
+
+// a conjunction of conditions on the kmers of an index, see
+// Kmerizer::filter(). base positions count from 0 at the first base of the
+// stored kmer (the canonical one in CANONICAL mode); negative positions
+// count back from the end, -1 being the last base.
+class KmerFilter {
+public:
+    uint32_t       minCount;
+    uint32_t       maxCount; // no upper bound when maxCount < minCount
+    vector<long>   basePos;
+    string         baseNucl; // the base at basePos[i] is baseNucl[i]
+    size_t         minGC;    // number of G or C bases
+    size_t         maxGC;
+    Kmerizer *     exclude;  // drop the kmers present in this index
+
+    KmerFilter()
+        : minCount(1), maxCount(0), minGC(0), maxGC((size_t)-1), exclude(NULL) {};
+
+    KmerFilter & count(const uint32_t min, const uint32_t max);
+    KmerFilter & base(const long pos, const char nucl);
+    KmerFilter & prefix(const char *seq);
+    KmerFilter & suffix(const char *seq);
+    KmerFilter & gc(const size_t min, const size_t max);
+    KmerFilter & excluding(Kmerizer *index);
+};
+
+// summary of the counts of the kmers of one read
+struct ReadProfile {
+    uint32_t kmers;  // number of kmers in the read
+    uint32_t solid;  // number of kmers with count >= the solid threshold
+    uint32_t min;
+    uint32_t median;
+    uint32_t max;
+};
+
+// walks the bit slices of a bin in step, LITERAL_SIZE positions at a time
+class SliceCursor {
+    const vector<BitVector*> & slices;
+    vector<size_t>       word;  // index of the next word in each slice
+    vector<word_t>       fills; // fill words left in the current fill
+    vector<word_t>       fill;  // literal value of the current fill
+
+public:
+    // the slices must be compressed. they are only read
+    SliceCursor(const vector<BitVector*> & slices);
+
+    // one literal word per slice for the next block of positions
+    void next(word_t *literals);
+
+    // move ahead n blocks
+    void skip(size_t n);
+
+    // save the current position (2 words per slice) and return to it
+    void mark(uint32_t *marks) const;
+    void seek(const uint32_t *marks);
+};
+
 class Kmerizer {
+    friend class BinReader;
+
     size_t  k;
     kword_t kmask;
     size_t  shiftlastby;
@@ -24,6 +102,9 @@ class Kmerizer {
     size_t  threads;
     size_t  threadBins;
     size_t  batches;
+    size_t  fanIn;
+    size_t  nextRun;
+    size_t  pendingMerges;
     size_t  maxKmersPerBin;
     char    mode;
     char    state;
@@ -34,6 +115,9 @@ class Kmerizer {
     
     // number of kmers in each bin (or number of distinct kmers)
     uint32_t              binTally[NBINS];
+
+    // frequency of each distinct kmer in kmerBuf (after uniqify)
+    vector<uint32_t>      tally[NBINS];
     
     // sorted distinct kmer frequencies
     vector<uint32_t>      kmerFreq[NBINS];
@@ -44,6 +128,44 @@ class Kmerizer {
     // bitmap self index of kmers
     vector<BitVector*>    slices[NBINS];
 
+    // every SAMPLE_BLOCKS*LITERAL_SIZE-th kmer and the slice cursor marks
+    // at each of them, for binary searching a bin
+    vector<kword_t>       samples[NBINS];
+    vector<uint32_t>      sampleMarks[NBINS];
+
+    // loaded bins, most recently used first. binMutex[bin] guards the data
+    // of a bin: lookups share it, and loading, unloading and everything
+    // else hold it alone. cacheMutex guards the LRU bookkeeping.
+    boost::shared_mutex       binMutex[NBINS];
+    boost::mutex              cacheMutex;
+    list<size_t>              lru;
+    list<size_t>::iterator    lruPos[NBINS];
+    bool                      resident[NBINS];
+    // what of each bin is loaded, even if it holds no kmers
+    bool                      countsLoaded[NBINS];
+    bool                      slicesLoaded[NBINS];
+    bool                      joinedLoaded[NBINS];
+    size_t                    binBytes[NBINS];
+    size_t                    cacheBytes;
+    size_t                    cacheLimit;
+
+    // joint index of several samples (see joinSamples()): the names of the
+    // samples, a presence bitmap per sample for each bin, and, if stored,
+    // the range encoded counts of each sample over its own kmers
+    vector<string>               sampleNames;
+    vector<BitVector*>           presence[NBINS];
+    vector< vector<uint32_t> >   sampleFreq[NBINS];
+    vector< vector<BitVector*> > sampleCounts[NBINS];
+
+    // ids of the spilled runs waiting to be merged, by merge level, and
+    // the number of kmers in each bin of each run, by run id. runMutex
+    // guards these, nextRun and pendingMerges
+    vector< vector<size_t> >  runLevels;
+    map<size_t, vector<uint64_t> > runSize;
+    vector<boost::thread*>    mergeThreads; // started by queueRun()
+    boost::mutex              runMutex;
+    boost::condition_variable runMerged;
+
 public:
     // constructor
     Kmerizer(const size_t k,
@@ -54,6 +176,14 @@ public:
     // allocate memory for each kmerBuf
     int allocate(const size_t maximem);
 
+    // maximum number of runs merged at once (and files open per bin)
+    void setFanIn(const size_t fanin);
+
+    // evict least recently used bins to keep loaded bins under bytes
+    void setCacheLimit(const size_t bytes);
+    // bytes held by the loaded bins
+    size_t cacheSize();
+
     // extract (canonicalized) kmers from the sequence
     void addSequence(const char* seq,const int length);
 
@@ -63,17 +193,98 @@ public:
     // read kmer indexes into memory
     void load();
 
-    // output the kmer count frequency distribution
+    // print the count spectrum of the saved index, "count n" per line
     void histogram();
+
+    // count spectrum of the saved index, bins in parallel
+    Spectrum spectrum();
+
+    // spectra of several saved indexes, computed together by threads
+    // threads. spectra[i] is the spectrum of indexes[i]
+    static void spectra(vector<Kmerizer*> &indexes,
+                        const size_t threads,
+                        vector<Spectrum> &spectra);
     uint32_t find(const char* query);
+
+    // look up many kmers in one pass over each bin. freqs[i] is the count
+    // of queries[i], or 0 if it is absent
+    void find(const char **queries, const size_t n, uint32_t *freqs);
+
+    // look up every kmer of seq. freqs needs room for length-k+1 counts
+    void findAll(const char *seq, const int length, uint32_t *freqs);
+
+    // look up the kmers of a batch of reads together and summarize the
+    // counts of each read in profiles[i]
+    void profile(const char **seqs,
+                 const int *lengths,
+                 const size_t n,
+                 const uint32_t solid,
+                 ReadProfile *profiles);
+    // write "kmer\tcount" lines for every kmer, or for the kmers set in
+    // mask[bin] of each bin, in bin order. pdump writes the bins in
+    // parallel into a mmap'd file, sdump one at a time.
     void dump(char *fname);
     void pdump(char *fname, BitVector **mask);
     void sdump(char *fname, BitVector **mask);
+    // write the kmers set in mask[bin] and their counts in the binary
+    // columnar format described in kmerexport.h, bins in parallel
+    void exportBinary(char *fname, BitVector **mask);
+    // allocates mask[bin] for every bin
     void filter(uint32_t min, uint32_t max, BitVector **mask);
+    void filter(const KmerFilter &conditions, BitVector **mask);
     
+    // count of the kmer at pos in bin, by binary search over counts[bin]
     uint32_t frequency(size_t bin, uint32_t pos);
 
-    ~Kmerizer() {};
+    // counts of the kmers at n ascending positions in bin. each count
+    // bitmap is scanned forward at most once for the whole batch, or for
+    // a series of batches that pass the same cursors (one per count bitmap,
+    // added as needed). the index is only read, so threads can look up
+    // the same bin at once
+    void frequencies(size_t bin, const uint32_t *pos, const size_t n, uint32_t *freqs);
+    void frequencies(size_t bin, const uint32_t *pos, const size_t n, uint32_t *freqs,
+                     vector<BitVector::Cursor> &cursors);
+
+    // build this (empty) index from the saved indexes left and right, bin
+    // by bin in parallel. op is UNION, INTERSECTION or DIFFERENCE, and how
+    // says how the counts of a kmer in both are combined: SUM_COUNTS,
+    // MIN_COUNTS, LEFT_COUNTS or RIGHT_COUNTS
+    void combine(Kmerizer *left, Kmerizer *right, const char op, const char how);
+
+    // build this (empty) index from the saved indexes of several samples:
+    // every kmer once, with its total count, plus for each bin a presence
+    // bitmap per sample over the bin's positions. with abundance, the
+    // counts of each sample are range encoded over its own kmers, in the
+    // order of the set bits of its presence bitmap
+    void joinSamples(vector<Kmerizer*> &samples,
+                     const vector<string> &names,
+                     const bool abundance);
+
+    // the samples of a joint index, read when it is opened. empty for any
+    // other index
+    const vector<string> & samplesJoined() const;
+
+    // counts[i*nsamples + s] is the count of queries[i] in sample s of a
+    // joint index, or 1 if it is present and counts were not stored.
+    // nothing is written for any other index
+    void findInSamples(const char **queries, const size_t n, uint32_t *counts);
+
+    // allocates mask[bin] for the kmers present in all of the samples in
+    // all and in none of the samples in none
+    void sampleFilter(const vector<size_t> &all,
+                      const vector<size_t> &none,
+                      BitVector **mask);
+
+    // read the values and bitmaps written by writeBitmap(), from idxfile
+    // or from the current position of an open file
+    static void readBitmap(const char* idxfile,
+                           vector<uint32_t> &values,
+                           vector<BitVector*> &index);
+    static void readBitmap(FILE *fp,
+                           vector<uint32_t> &values,
+                           vector<BitVector*> &index);
+
+    ~Kmerizer();
 
 private:
 
@@ -97,57 +308,219 @@ private:
     // returns the position of the rth set bit in v
     inline unsigned int selectBit(kword_t v, unsigned int r);
 
-    size_t pos2kmer(size_t pos, kword_t *kmer, vector<BitVector*> &index);
-
-    uint32_t pos2value(size_t pos, vector<uint32_t> &values,
-                       vector<BitVector*> &index);
+    // transpose a 64x64 bit matrix (row i is word i, msb first)
+    inline void transpose(kword_t *rows) const;
 
     kword_t* canonicalize(kword_t *packed, kword_t *rcpack) const;
-    uint32_t find(kword_t *kmer, size_t bin);
 
-    // kmerBuf is full. uniqify and write batch to disk
+    void packAll(const char *seq, const int length, kword_t *packed);
+    void doPack(const size_t from,
+                const size_t to,
+                const char **seqs,
+                const int *lengths,
+                const size_t *offset,
+                kword_t *packed);
+    void doProfile(const size_t from,
+                   const size_t to,
+                   const size_t *offset,
+                   uint32_t *freqs,
+                   const uint32_t solid,
+                   ReadProfile *profiles);
+
+    // pack (and canonicalize) n kmers
+    void pack(const char **queries, const size_t n, kword_t *packed);
+
+    // resolve packed, canonicalized kmers. with counts, also fill in their
+    // counts in each joined sample (see findInSamples())
+    void lookup(const kword_t *packed, const size_t n, uint32_t *freqs, uint32_t *counts);
+    void doLookup(const size_t from,
+                  const size_t to,
+                  const kword_t *packed,
+                  vector<uint32_t> *queries,
+                  uint32_t *freqs,
+                  uint32_t *counts);
+    void loadBin(const size_t bin, const bool kmers);
+    // take a shared lock on bin, once its counts, and optionally its
+    // slices and joined samples, are loaded
+    void shareBin(const size_t bin, const bool kmers, const bool joined);
+    void touchBin(const size_t bin);
+    size_t residentBytes(const size_t bin);
+    void unloadBin(const size_t bin);
+    void sampleSlices(vector<BitVector*> &kmer_slices, vector<kword_t> &kmers);
+
+    // add the kmers of one bin to spectrum
+    void binSpectrum(const size_t bin, Spectrum &spectrum);
+    // bins from..to-1 of the indexes laid end to end
+    static void doSpectra(vector<Kmerizer*> *indexes,
+                          const size_t from,
+                          const size_t to,
+                          vector<Spectrum> *spectra);
+
+    // kmerBuf is full. uniqify and spill batch to disk as sorted runs
     void serialize();
     
-    // qsort each kmerBuf, update binTally, and fill counts
+    // sort each kmerBuf, update binTally, and fill tally
     void uniqify();
     
     // for parallelization
     void doUnique(const size_t from, const size_t to);
-    void writeBatch();
+    void writeBatch(const size_t run);
     
     // for parallelization
-    void doWriteBatch(const size_t from, const size_t to);
+    void doWriteBatch(const size_t from, const size_t to, const size_t run);
+
+    // add a run to a merge level, merging the level in the background once
+    // it holds fanIn runs. runMutex must be held.
+    void queueRun(const size_t level, const size_t run);
+    void backgroundMerge(const vector<size_t> runs,
+                         const size_t out,
+                         const size_t level);
+    // wait for the background merges to finish and join their threads
+    void joinMerges();
+    // record that bin of run holds n kmers
+    void setRunSize(const size_t bin, const size_t run, const uint64_t n);
+
+    // merge the remaining runs, at most fanIn at a time, into the index
     void mergeBatches();
-    void doMergeBatches(const size_t from, const size_t to);
+    void doMergeBatches(const size_t from,
+                        const size_t to,
+                        const vector<size_t> runs,
+                        const size_t out,
+                        const vector<bool> *split);
+    // merge the runs of one bin into run out, or into the index if out is 0
+    void mergeRuns(const size_t bin,
+                   const vector<size_t> &runs,
+                   const size_t out);
+    // merge one large bin into the index in nparts concurrent key ranges
+    void splitMerge(const size_t bin,
+                    const vector<size_t> &runs,
+                    const size_t nparts);
+    void mergeRange(const size_t bin,
+                    const vector<size_t> &runs,
+                    const kword_t *lo,
+                    const kword_t *hi,
+                    KmerRunWriter *writer,
+                    BitVector **kmer_slices,
+                    vector<uint32_t> *merged_tally);
+    void removeRuns(const size_t bin, const vector<size_t> &runs);
+
+    // bit slice and range encode the in memory kmers (no batches spilled)
+    void writeIndex();
+    void doWriteIndex(const size_t from, const size_t to);
+
+    // write the kmer slices and the counts of a bin to its index files
+    void writeBin(const size_t bin, BitVector **kmer_slices);
     void doLoadIndex(const size_t from, const size_t to);
-    void doDump(const size_t from, const size_t to, FILE *fp, BitVector **mask);
     void doFilter(const size_t from,
                   const size_t to,
-                  uint32_t min,
-                  uint32_t max,
+                  const KmerFilter *conditions,
                   BitVector **mask);
+    // the kmers of bin that occur min..max times
+    BitVector * countMask(const size_t bin, uint32_t min, uint32_t max);
+    // bit slices of the high and low bit of base pos
+    size_t baseSlice(const size_t pos) const;
+    // the kmers of bin with min..max G or C bases
+    BitVector * gcMask(const size_t bin, const size_t min, const size_t max);
+    // the kmers of bin that are absent from the same bin of other
+    BitVector * absentMask(const size_t bin, Kmerizer *other);
+    void doJoin(const size_t from,
+                const size_t to,
+                vector<Kmerizer*> *samples,
+                const bool abundance);
+    void readSampleNames();
+    // load the presence bitmaps (and counts) of the samples of a joint
+    // index. binMutex[bin] must be held
+    void loadJoined(const size_t bin);
+    void doSampleFilter(const size_t from,
+                        const size_t to,
+                        const vector<size_t> *all,
+                        const vector<size_t> *none,
+                        BitVector **mask);
+    void doCombine(const size_t from,
+                   const size_t to,
+                   Kmerizer *left,
+                   Kmerizer *right,
+                   const char op,
+                   const char how);
+    void doDumpSize(const size_t from,
+                    const size_t to,
+                    BitVector **mask,
+                    size_t *binsize);
     void doPdump(const size_t from,
                  const size_t to,
                  char *buff,
+                 const size_t *offset,
                  BitVector **mask);
+    // bytes of output for the kmers of bin set in mask
+    size_t dumpSize(const size_t bin, BitVector *mask);
+    // write those kmers to out, returning the end of the output
+    char * dumpBin(const size_t bin, BitVector *mask, char *out);
+    size_t nextMaskedBlock(const size_t bin,
+                           BitVector *mask,
+                           SliceCursor &cursor,
+                           uint32_t &next1,
+                           size_t &cur,
+                           kword_t *kmers,
+                           uint32_t *freqs,
+                           vector<BitVector::Cursor> &counted);
+    void doExport(const size_t from,
+                  const size_t to,
+                  kword_t *kmers,
+                  uint32_t *freqs,
+                  const uint64_t *binStart,
+                  BitVector **mask);
     // is this too generic to go here?
     void rangeIndex(vector<uint32_t> &vec,
                     vector<uint32_t> &values,
                     vector<BitVector*> &index);
-    void readBitmap(const char* idxfile,
-                    vector<uint32_t> &values,
-                    vector<BitVector*> &index);
-    size_t findMin(const kword_t* kmers, const uint32_t* kcounts);
-    // uint32_t pos2value(size_t pos, vector<uint32_t> &values, vector<BitVector*> &index);
-    // size_t pos2kmer(size_t pos, kword_t *kmer, vector<BitVector*> &index);
+    void writeBitmap(const char* idxfile,
+                     vector<uint32_t> &values,
+                     vector<BitVector*> &index);
+    // the same, at the current position of an open file
+    void writeBitmap(FILE *fp,
+                     vector<uint32_t> &values,
+                     vector<BitVector*> &index);
+    size_t findMin(const kword_t* kmers,
+                   const uint32_t* kcounts,
+                   const size_t n);
     void printKmer(kword_t *kmer);
     void bitSlice(kword_t *kmers,
                   const size_t n,
                   BitVector **kmer_slices,
                   size_t nbits);
+    // append up to LITERAL_SIZE sorted kmers to the bit slices
+    void sliceBlock(const kword_t *kmers,
+                    const size_t n,
+                    BitVector **kmer_slices);
+    // decode the next LITERAL_SIZE kmers from the slices
+    void unsliceBlock(SliceCursor &cursor, kword_t *kmers);
 
 };
 
+// reads the kmers of a loaded bin in order, with their counts, like a
+// KmerRunReader. the bin must stay locked while it is read
+class BinReader {
+    Kmerizer &       index;
+    size_t           bin;
+    size_t           nwords;
+    SliceCursor      cursor;
+    word_t           size;
+    word_t           pos;    // of the next kmer
+    size_t           row;    // of the current kmer in block
+    vector<kword_t>  block;  // the current block of kmers
+    vector<uint32_t> freqs;  // and their counts
+    vector<BitVector::Cursor> counted; // places in the count bitmaps
+
+public:
+    BinReader(Kmerizer &index, const size_t bin);
+
+    // advance to the next kmer. returns false at the end of the bin
+    bool next();
+
+    const kword_t * kmer()  const { return &block[row * nwords]; }
+    uint32_t        count() const { return freqs[row]; }
+};
+
 inline kword_t Kmerizer::twoBit(const kword_t val) const {
     static const kword_t table[256] =
     {
@@ -173,26 +546,7 @@ inline kword_t Kmerizer::twoBit(const kword_t val) const {
 
 // quickly count the number of set bits in a k-mer
 inline unsigned int Kmerizer::popCount(kword_t v) const {
-    // number of 1 bits in a value between 0 and 255
-    static const unsigned char t[256] = {
-    0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
-    1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-    1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-    1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-    3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-    1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-    3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-    3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-    3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-    4, 5, 5, 6, 5, 6, 6, 7, 5, 6, 6, 7, 6, 7, 7, 8};
-    unsigned char * p = (unsigned char *) &v;
-    return t[p[0]]+t[p[1]]+t[p[2]]+t[p[3]]+t[p[4]]+t[p[5]]+t[p[6]]+t[p[7]];
+    return __builtin_popcountll(v);
 }
 
 // select the bit position given the rank
@@ -232,6 +586,19 @@ inline unsigned int Kmerizer::selectBit(kword_t v, unsigned int r) {
     return s-1;
 }
 
+// in place transpose, after which bit 63-j of rows[i] holds what was
+// bit 63-i of rows[j] (Hacker's Delight 7-3, widened to 64 bits)
+inline void Kmerizer::transpose(kword_t *rows) const {
+    kword_t m = 0x00000000FFFFFFFFULL;
+    for (size_t j = 32; j != 0; j >>= 1, m ^= (m << j)) {
+        for (size_t i = 0; i < 64; i = ((i | j) + 1) & ~j) {
+            kword_t t = (rows[i] ^ (rows[i | j] >> j)) & m;
+            rows[i] ^= t;
+            rows[i | j] ^= (t << j);
+        }
+    }
+}
+
 inline void Kmerizer::unpack(kword_t* kmer, char* seq) {
     static const char table[4] = {65, 67, 71, 84};
     for(size_t i=0;i<k;i++) {
@@ -0,0 +1,235 @@
+#include "kmerrun.h"
+#include <cstring> // memset()
+
+// compare two multiword kmers, most significant word first
+static int compareKmers(const kword_t *a, const kword_t *b, const size_t nwords) {
+    for (size_t w = 0; w < nwords; w++) {
+        if (a[w] < b[w]) return -1;
+        if (a[w] > b[w]) return 1;
+    }
+    return 0;
+}
+
+KmerRunWriter::KmerRunWriter(const char *fname, const size_t nwords) {
+    this->nwords = nwords;
+    this->n      = 0;
+    this->used   = 0;
+    this->offset = KMERRUN_HEADER;
+    prev  = new kword_t[nwords];
+    delta = new kword_t[nwords];
+    memset(prev, 0, nwords * sizeof(kword_t));
+    fp = fopen(fname, "wb");
+    if (fp == NULL) {
+        perror(fname);
+        exit(1);
+    }
+    // placeholder for the header
+    uint64_t header[2] = {0, 0};
+    fwrite(header, sizeof(uint64_t), 2, fp);
+}
+
+KmerRunWriter::~KmerRunWriter() {
+    close();
+    delete [] prev;
+    delete [] delta;
+}
+
+void KmerRunWriter::append(const kword_t *kmer, const uint32_t count) {
+    if (n % KMERRUN_SAMPLE == 0) {
+        // restart the delta encoding so a reader can start here
+        samples.push_back(offset);
+        samples.insert(samples.end(), kmer, kmer + nwords);
+        memset(prev, 0, nwords * sizeof(kword_t));
+    }
+    // delta = kmer - prev, least significant word last
+    kword_t borrow = 0;
+    for (size_t w = nwords; w-- > 0;) {
+        kword_t d = kmer[w] - prev[w];
+        kword_t b = kmer[w] < prev[w];
+        if (d < borrow) b = 1;
+        delta[w] = d - borrow;
+        borrow = b;
+        prev[w] = kmer[w];
+    }
+    // varint encode the delta, 7 bits at a time
+    if (nwords == 1) {
+        kword_t d = delta[0];
+        while (d >= 0x80) {
+            putByte((unsigned char)(d | 0x80));
+            d >>= 7;
+        }
+        putByte((unsigned char)d);
+    }
+    else {
+        size_t top = 0; // most significant non-zero word
+        while (top < nwords - 1 && delta[top] == 0) top++;
+        for (;;) {
+            unsigned char c = delta[nwords - 1] & 0x7F;
+            // shift the delta right by 7 bits
+            for (size_t w = nwords - 1; w > top; w--)
+                delta[w] = (delta[w] >> 7) | (delta[w - 1] << 57);
+            delta[top] >>= 7;
+            if (delta[top] == 0 && top < nwords - 1) top++;
+            if (top == nwords - 1 && delta[top] == 0) {
+                putByte(c);
+                break;
+            }
+            putByte(c | 0x80);
+        }
+    }
+    uint32_t c = count;
+    while (c >= 0x80) {
+        putByte((unsigned char)(c | 0x80));
+        c >>= 7;
+    }
+    putByte((unsigned char)c);
+    n++;
+}
+
+void KmerRunWriter::flush() {
+    if (used > 0 && fwrite(buf, 1, used, fp) != used) {
+        perror("KmerRunWriter::flush()");
+        exit(1);
+    }
+    used = 0;
+}
+
+void KmerRunWriter::close() {
+    if (fp == NULL) return;
+    flush();
+    uint64_t header[2] = {n, offset};
+    if (samples.size() > 0)
+        fwrite(samples.data(), sizeof(kword_t), samples.size(), fp);
+    fseek(fp, 0, SEEK_SET);
+    fwrite(header, sizeof(uint64_t), 2, fp);
+    fclose(fp);
+    fp = NULL;
+}
+
+KmerRunReader::KmerRunReader(const char *fname, const size_t nwords) {
+    this->nwords = nwords;
+    this->avail  = 0;
+    this->offset = 0;
+    this->tally  = 0;
+    current = new kword_t[nwords];
+    memset(current, 0, nwords * sizeof(kword_t));
+    fp = fopen(fname, "rb");
+    if (fp == NULL || fread(&n, sizeof(uint64_t), 1, fp) != 1
+        || fread(&table, sizeof(uint64_t), 1, fp) != 1) {
+        perror(fname);
+        exit(1);
+    }
+    remaining = n;
+}
+
+KmerRunReader::~KmerRunReader() {
+    if (fp != NULL) fclose(fp);
+    delete [] current;
+}
+
+void KmerRunReader::samples(std::vector<kword_t> & kmers) {
+    uint64_t nsamples = (n + KMERRUN_SAMPLE - 1) / KMERRUN_SAMPLE;
+    std::vector<kword_t> entries(nsamples * (1 + nwords));
+    long pos = ftell(fp);
+    fseek(fp, table, SEEK_SET);
+    if (fread(entries.data(), sizeof(kword_t), entries.size(), fp) != entries.size()) {
+        perror("KmerRunReader::samples()");
+        exit(1);
+    }
+    fseek(fp, pos, SEEK_SET);
+    kmers.clear();
+    for (uint64_t i = 0; i < nsamples; i++)
+        kmers.insert(kmers.end(), entries.begin() + i*(1 + nwords) + 1,
+            entries.begin() + (i + 1)*(1 + nwords));
+}
+
+// restart decoding at the given sample
+void KmerRunReader::jump(uint64_t sample, uint64_t pos) {
+    fseek(fp, pos, SEEK_SET);
+    this->avail  = 0;
+    this->offset = 0;
+    remaining = n - sample * KMERRUN_SAMPLE;
+}
+
+bool KmerRunReader::seek(const kword_t *kmer) {
+    if (n == 0) return false;
+    std::vector<kword_t> kmers;
+    samples(kmers);
+    // find the last sample <= kmer
+    uint64_t lo = 0, hi = kmers.size() / nwords;
+    while (hi - lo > 1) {
+        uint64_t mid = (lo + hi) / 2;
+        if (compareKmers(&kmers[mid*nwords], kmer, nwords) <= 0)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    // read the sample's file offset
+    uint64_t off;
+    fseek(fp, table + lo * (1 + nwords) * sizeof(kword_t), SEEK_SET);
+    if (fread(&off, sizeof(uint64_t), 1, fp) != 1) {
+        perror("KmerRunReader::seek()");
+        exit(1);
+    }
+    jump(lo, off);
+    while (next())
+        if (compareKmers(current, kmer, nwords) >= 0)
+            return true;
+    return false;
+}
+
+bool KmerRunReader::next() {
+    if (remaining == 0) return false;
+    if ((n - remaining) % KMERRUN_SAMPLE == 0)
+        memset(current, 0, nwords * sizeof(kword_t));
+    remaining--;
+    // decode the delta and add it to the current kmer
+    unsigned char c;
+    if (nwords == 1) {
+        kword_t d = 0;
+        unsigned int shift = 0;
+        do {
+            c = getByte();
+            d |= (kword_t)(c & 0x7F) << shift;
+            shift += 7;
+        } while (c & 0x80);
+        current[0] += d;
+    }
+    else {
+        unsigned int shift = 0; // bit offset from the least significant end
+        kword_t carry = 0;
+        long w = nwords - 1;
+        kword_t d = 0;
+        do {
+            c = getByte();
+            kword_t bits = c & 0x7F;
+            unsigned int s = shift % 64;
+            d |= bits << s;
+            if (s + 7 >= 64) {
+                // this word of the delta is complete, add it in
+                kword_t sum = current[w] + d + carry;
+                carry = (sum < current[w] || (carry && sum == current[w])) ? 1 : 0;
+                current[w] = sum;
+                w--;
+                d = (s + 7 > 64) ? bits >> (64 - s) : 0;
+            }
+            shift += 7;
+        } while (c & 0x80);
+        // add the last partial word and propagate the carry
+        for (; w >= 0 && (d || carry); w--) {
+            kword_t sum = current[w] + d + carry;
+            carry = (sum < current[w] || (carry && sum == current[w])) ? 1 : 0;
+            current[w] = sum;
+            d = 0;
+        }
+    }
+    kword_t count = 0;
+    unsigned int shift = 0;
+    do {
+        c = getByte();
+        count |= (kword_t)(c & 0x7F) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    tally = (uint32_t)count;
+    return true;
+}
@@ -0,0 +1,118 @@
+#ifndef SNAPDRAGON_KMERRUN_H
+#define SNAPDRAGON_KMERRUN_H
+
+#include <stdint.h>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+typedef uint64_t kword_t;
+
+/*
+    Sorted run of distinct k-mers and their counts, used for spilling batches
+    to disk before they are merged into the final bit-sliced index.
+
+    File layout:
+        uint64_t n          number of records (patched in by close())
+        uint64_t table      file offset of the sample table (ditto)
+        n records, each:
+            varint  delta   kmer minus the previous kmer (the first kmer is
+                            relative to 0), least significant 7 bits first
+            varint  count
+        sample table, one entry per KMERRUN_SAMPLE records:
+            uint64_t offset         file offset of the record
+            kword_t  kmer[nwords]   the record's kmer
+
+    Multi-word k-mers are treated as one big endian integer of nwords words,
+    so consecutive k-mers in a dense bin usually cost 2-4 bytes in total.
+    Every KMERRUN_SAMPLE-th record is encoded relative to 0 instead of the
+    previous kmer, so a reader can start decoding at any sample. The samples
+    double as splitters for merging one bin in several key ranges.
+*/
+
+#define KMERRUN_BUFSIZE 65536
+#define KMERRUN_SAMPLE  4096
+#define KMERRUN_HEADER  (2*sizeof(uint64_t))
+
+class KmerRunWriter {
+    FILE *        fp;
+    size_t        nwords;
+    uint64_t      n;
+    kword_t *     prev;
+    kword_t *     delta;
+    unsigned char buf[KMERRUN_BUFSIZE];
+    size_t        used;
+    uint64_t      offset;  // file offset of the next record
+    std::vector<kword_t> samples; // offset, then kmer, of each sample
+
+public:
+    KmerRunWriter(const char *fname, const size_t nwords);
+    ~KmerRunWriter();
+
+    // append the next kmer, which must be greater than the previous one
+    void append(const kword_t *kmer, const uint32_t count);
+
+    // flush the buffer, write the sample table and the header
+    void close();
+
+    uint64_t size() const { return n; }
+
+private:
+    inline void putByte(unsigned char c);
+    void flush();
+};
+
+class KmerRunReader {
+    FILE *        fp;
+    size_t        nwords;
+    uint64_t      n;
+    uint64_t      remaining;
+    kword_t *     current;
+    uint32_t      tally;
+    unsigned char buf[KMERRUN_BUFSIZE];
+    size_t        avail;
+    size_t        offset;
+    uint64_t      table;
+
+public:
+    KmerRunReader(const char *fname, const size_t nwords);
+    ~KmerRunReader();
+
+    // advance to the next record. returns false when the run is exhausted
+    bool next();
+
+    const kword_t * kmer()  const { return current; }
+    uint32_t        count() const { return tally; }
+    uint64_t        size()  const { return n; }
+
+    // read the sampled kmers, nwords per sample, into kmers
+    void samples(std::vector<kword_t> & kmers);
+
+    // position the reader on the first record >= kmer. returns false (like
+    // next()) when there is no such record
+    bool seek(const kword_t *kmer);
+
+private:
+    inline unsigned char getByte();
+    void jump(uint64_t sample, uint64_t pos);
+};
+
+inline void KmerRunWriter::putByte(unsigned char c) {
+    if (used == KMERRUN_BUFSIZE) flush();
+    buf[used++] = c;
+    offset++;
+}
+
+inline unsigned char KmerRunReader::getByte() {
+    if (offset == avail) {
+        avail = fread(buf, 1, KMERRUN_BUFSIZE, fp);
+        offset = 0;
+        if (avail == 0) {
+            fprintf(stderr, "KmerRunReader: unexpected end of run\n");
+            exit(1);
+        }
+    }
+    return buf[offset++];
+}
+
+#endif // #ifndef SNAPDRAGON_KMERRUN_H
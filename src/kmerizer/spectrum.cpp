@@ -0,0 +1,60 @@
+#include "spectrum.h"
+#include <set>
+
+void Spectrum::add(const uint32_t count, const uint64_t n) {
+    if (n > 0) kmers[count] += n;
+}
+
+void Spectrum::merge(const Spectrum &other) {
+    std::map<uint32_t, uint64_t>::const_iterator it;
+    for (it = other.kmers.begin(); it != other.kmers.end(); ++it)
+        kmers[it->first] += it->second;
+}
+
+uint64_t Spectrum::get(const uint32_t count) const {
+    std::map<uint32_t, uint64_t>::const_iterator it = kmers.find(count);
+    return (it == kmers.end()) ? 0 : it->second;
+}
+
+uint64_t Spectrum::distinct() const {
+    uint64_t n = 0;
+    std::map<uint32_t, uint64_t>::const_iterator it;
+    for (it = kmers.begin(); it != kmers.end(); ++it)
+        n += it->second;
+    return n;
+}
+
+uint64_t Spectrum::total() const {
+    uint64_t n = 0;
+    std::map<uint32_t, uint64_t>::const_iterator it;
+    for (it = kmers.begin(); it != kmers.end(); ++it)
+        n += it->first * it->second;
+    return n;
+}
+
+void Spectrum::print(FILE *fp) const {
+    std::map<uint32_t, uint64_t>::const_iterator it;
+    for (it = kmers.begin(); it != kmers.end(); ++it)
+        fprintf(fp, "%u %llu\n", it->first, (unsigned long long)it->second);
+}
+
+void Spectrum::printMatrix(FILE *fp,
+                           const std::vector<Spectrum> &spectra,
+                           const std::vector<std::string> &names) {
+    fprintf(fp, "count");
+    for (size_t i = 0; i < names.size(); i++)
+        fprintf(fp, "\t%s", names[i].c_str());
+    fprintf(fp, "\n");
+    std::set<uint32_t> rows;
+    for (size_t i = 0; i < spectra.size(); i++) {
+        std::map<uint32_t, uint64_t>::const_iterator it;
+        for (it = spectra[i].kmers.begin(); it != spectra[i].kmers.end(); ++it)
+            rows.insert(it->first);
+    }
+    for (std::set<uint32_t>::iterator row = rows.begin(); row != rows.end(); ++row) {
+        fprintf(fp, "%u", *row);
+        for (size_t i = 0; i < spectra.size(); i++)
+            fprintf(fp, "\t%llu", (unsigned long long)spectra[i].get(*row));
+        fprintf(fp, "\n");
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef SNAPDRAGON_SPECTRUM_H
+#define SNAPDRAGON_SPECTRUM_H
+
+#include <stdint.h>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+
+/*
+    K-mer count spectrum: the number of distinct kmers that occur exactly
+    count times, for each count that occurs.
+*/
+class Spectrum {
+    std::map<uint32_t, uint64_t> kmers; // count -> distinct kmers
+
+public:
+    // n more distinct kmers occur count times
+    void add(const uint32_t count, const uint64_t n);
+
+    // add the kmers of another spectrum (of another part of an index)
+    void merge(const Spectrum &other);
+
+    // distinct kmers that occur count times
+    uint64_t get(const uint32_t count) const;
+
+    uint64_t distinct() const; // distinct kmers
+    uint64_t total() const;    // kmers counted, sum of count * distinct
+
+    const std::map<uint32_t, uint64_t> & counts() const { return kmers; }
+
+    // "count n" lines, the format of histo
+    void print(FILE *fp) const;
+
+    // one tab separated row per count that occurs in any of the spectra,
+    // with a column per spectrum, headed by names
+    static void printMatrix(FILE *fp,
+                            const std::vector<Spectrum> &spectra,
+                            const std::vector<std::string> &names);
+};
+
+#endif // #ifndef SNAPDRAGON_SPECTRUM_H
@@ -0,0 +1,148 @@
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include "kmerizer.h"
+#include "hybrid.h"
+
+/*
+    Compares the WAH BitVector with the HybridBitVector on the bitmaps of
+    an index (the slices and the count bitmaps of each bin) and on random
+    intervals, and prints the bytes and seconds each one takes.
+*/
+
+double seconds(clock_t start)
+{
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+struct Workload {
+    vector<BitVector*>       wah;
+    vector<HybridBitVector*> hybrid;
+
+    void add(BitVector *bv) {
+        bv->buildSkips();
+        wah.push_back(bv);
+        hybrid.push_back(new HybridBitVector(*bv));
+    }
+    ~Workload() {
+        for (size_t i = 0; i < wah.size(); i++) {
+            delete wah[i];
+            delete hybrid[i];
+        }
+    }
+
+    void printSizes(const char *name) {
+        size_t wah_bytes = 0, hybrid_bytes = 0;
+        size_t types[3] = {0, 0, 0};
+        for (size_t i = 0; i < wah.size(); i++) {
+            wah_bytes += wah[i]->bytes();
+            hybrid_bytes += hybrid[i]->bytes();
+            size_t counts[3];
+            hybrid[i]->containerCounts(counts);
+            for (int t = 0; t < 3; t++)
+                types[t] += counts[t];
+        }
+        fprintf(stdout, "%s: %zi bitmaps, wah %zi bytes, hybrid %zi bytes (%zi array, %zi bitmap, %zi run chunks)\n",
+            name, wah.size(), wah_bytes, hybrid_bytes,
+            types[HybridBitVector::ARRAY], types[HybridBitVector::BITMAP], types[HybridBitVector::RUNS]);
+    }
+
+    // AND and XOR each bitmap with the next one
+    void pairs(const char *name, int rounds) {
+        BitVector res;
+        HybridBitVector hres;
+        word_t wah_ones = 0, hybrid_ones = 0;
+        clock_t start = clock();
+        for (int r = 0; r < rounds; r++)
+            for (size_t i = 0; i + 1 < wah.size(); i++) {
+                wah[i]->andInto(*wah[i + 1], res);
+                wah_ones += res.cnt();
+                wah[i]->xorInto(*wah[i + 1], res);
+                wah_ones += res.cnt();
+            }
+        double wah_secs = seconds(start);
+        start = clock();
+        for (int r = 0; r < rounds; r++)
+            for (size_t i = 0; i + 1 < hybrid.size(); i++) {
+                hybrid[i]->andInto(*hybrid[i + 1], hres);
+                hybrid_ones += hres.cnt();
+                hybrid[i]->xorInto(*hybrid[i + 1], hres);
+                hybrid_ones += hres.cnt();
+            }
+        double hybrid_secs = seconds(start);
+        fprintf(stdout, "%s and/xor: wah %.3fs, hybrid %.3fs%s\n", name,
+            wah_secs, hybrid_secs, wah_ones == hybrid_ones ? "" : " MISMATCH");
+    }
+
+    // find and rank at random positions
+    void probes(const char *name, size_t n) {
+        vector<word_t> xs(n);
+        vector<size_t> which(n);
+        for (size_t i = 0; i < n; i++) {
+            which[i] = rand() % wah.size();
+            xs[i] = rand() % (wah[which[i]]->getSize() + 1);
+        }
+        word_t wah_sum = 0, hybrid_sum = 0;
+        clock_t start = clock();
+        for (size_t i = 0; i < n; i++)
+            wah_sum += wah[which[i]]->find(xs[i]) + wah[which[i]]->rank(xs[i]);
+        double wah_secs = seconds(start);
+        start = clock();
+        for (size_t i = 0; i < n; i++)
+            hybrid_sum += hybrid[which[i]]->find(xs[i]) + hybrid[which[i]]->rank(xs[i]);
+        double hybrid_secs = seconds(start);
+        fprintf(stdout, "%s find/rank x%zi: wah %.3fs, hybrid %.3fs%s\n", name, n,
+            wah_secs, hybrid_secs, wah_sum == hybrid_sum ? "" : " MISMATCH");
+    }
+};
+
+int main(int argc, char *argv[])
+{
+    // parse args
+    if (argc != 3 && argc != 4) {
+        fprintf(stdout, "Usage: %s <k> <input dir> [probes]\n", argv[0]);
+        fprintf(stdout, "Compares WAH and hybrid bitvectors on the slices and counts of an index and on random intervals.\n");
+        return 1;
+    }
+    size_t k = atoi(argv[1]);
+    char *inprefix = argv[2];
+    size_t nprobes = (argc == 4) ? atol(argv[3]) : 1000000;
+    srand(46);
+
+    Workload slices, counts;
+    char fname[200];
+    for (size_t bin = 0; bin < NBINS; bin++) {
+        vector<uint32_t> values;
+        vector<BitVector*> index;
+        sprintf(fname, "%s/%zi-mers.%zi", inprefix, k, bin);
+        Kmerizer::readBitmap(fname, values, index);
+        for (size_t i = 0; i < index.size(); i++)
+            slices.add(index[i]);
+        sprintf(fname, "%s/%zi-mers.%zi.idx", inprefix, k, bin);
+        Kmerizer::readBitmap(fname, values, index);
+        for (size_t i = 0; i < index.size(); i++)
+            counts.add(index[i]);
+    }
+    slices.printSizes("slices");
+    slices.pairs("slices", 1);
+    slices.probes("slices", nprobes);
+    counts.printSizes("counts");
+    counts.pairs("counts", 1);
+    counts.probes("counts", nprobes);
+
+    // runs of 10..10k set bits with gaps of 100..1M, as in a genome track
+    Workload intervals;
+    for (int v = 0; v < 8; v++) {
+        BitVector *bv = new BitVector(true);
+        for (int i = 0; i < 2000; i++) {
+            bv->appendFill(false, rand() % 1000000 + 100);
+            bv->appendFill(true, rand() % 10000 + 10);
+        }
+        bv->appendFill(false, 2100000000 - bv->getSize()); // all the same size
+        intervals.add(bv);
+    }
+    intervals.printSizes("intervals");
+    intervals.pairs("intervals", 20);
+    intervals.probes("intervals", nprobes);
+    return 0;
+}
@@ -4,18 +4,25 @@
 int main(int argc, char *argv[])
 {
     // parse args
-    if (argc != 4) {
-        fprintf(stdout, "Usage: %s <k> <threads> <input dir>\n", argv[0]);
+    if (argc < 4) {
+        fprintf(stdout, "Usage: %s <k> <threads> <input dir> [<input dir> ...]\n", argv[0]);
+        fprintf(stdout, "Prints count and distinct kmers per line, or a matrix with a column per input dir.\n");
         return 1;
     }
     size_t k = atoi(argv[1]);
     size_t threads = atoi(argv[2]);
-    char* inprefix = argv[3];
 
-    Kmerizer *counter = new Kmerizer(k, threads, inprefix, CANONICAL);
-
-    cout << "Load" << endl;
-    counter->load();
-    counter->histogram();
+    vector<Kmerizer*> indexes;
+    vector<string> names;
+    for (int i = 3; i < argc; i++) {
+        indexes.push_back(new Kmerizer(k, threads, argv[i], CANONICAL));
+        names.push_back(argv[i]);
+    }
+    vector<Spectrum> spectra;
+    Kmerizer::spectra(indexes, threads, spectra);
+    if (spectra.size() == 1)
+        spectra[0].print(stdout);
+    else
+        Spectrum::printMatrix(stdout, spectra, names);
     return 0;
-}
\ No newline at end of file
+}
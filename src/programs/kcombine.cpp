@@ -0,0 +1,38 @@
+#include <sys/stat.h> // mkdir()
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "kmerizer.h"
+
+int main(int argc, char *argv[])
+{
+    // parse args
+    const char *ops[3] = { "union", "intersection", "difference" };
+    const char op_codes[3] = { UNION, INTERSECTION, DIFFERENCE };
+    const char *hows[4] = { "sum", "min", "left", "right" };
+    const char how_codes[4] = { SUM_COUNTS, MIN_COUNTS, LEFT_COUNTS, RIGHT_COUNTS };
+    char op = 0, how = 0;
+    if (argc == 8) {
+        for (size_t i = 0; i < 3; i++)
+            if (strcmp(argv[5], ops[i]) == 0) op = op_codes[i];
+        for (size_t i = 0; i < 4; i++)
+            if (strcmp(argv[6], hows[i]) == 0) how = how_codes[i];
+    }
+    if (op == 0 || how == 0) {
+        fprintf(stdout, "Usage: %s <k> <threads> <left dir> <right dir> <union|intersection|difference> <sum|min|left|right> <output dir>\n", argv[0]);
+        fprintf(stdout, "Writes a new index. difference keeps the kmers of left that are not in right.\n");
+        fprintf(stdout, "The counts of kmers in both are summed, the lesser one, or taken from left or right.\n");
+        return 1;
+    }
+    size_t k = atoi(argv[1]);
+    size_t threads = atoi(argv[2]);
+    char *outprefix = argv[7];
+    // create output directory if it doesn't exist
+    mkdir(outprefix,0755);
+
+    Kmerizer *left = new Kmerizer(k, threads, argv[3], CANONICAL);
+    Kmerizer *right = new Kmerizer(k, threads, argv[4], CANONICAL);
+    Kmerizer *out = new Kmerizer(k, threads, outprefix, CANONICAL);
+    out->combine(left, right, op, how);
+    return 0;
+}
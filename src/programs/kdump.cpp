@@ -0,0 +1,60 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "kmerizer.h"
+
+void usage(const char *name)
+{
+    fprintf(stdout, "Usage: %s <k> <threads> <input dir> <min count> <max count> <output file> [text|binary] [condition ...]\n", name);
+    fprintf(stdout, "Writes a kmer<tab>count line for each kmer that occurs min..max times (no max if max < min).\n");
+    fprintf(stdout, "binary writes packed kmers and counts instead (see kmerexport.h).\n");
+    fprintf(stdout, "Conditions: prefix=<bases> suffix=<bases> base=<pos>:<base> gc=<min>-<max> exclude=<input dir>\n");
+}
+
+int main(int argc, char *argv[])
+{
+    // parse args
+    if (argc < 7) {
+        usage(argv[0]);
+        return 1;
+    }
+    size_t k = atoi(argv[1]);
+    size_t threads = atoi(argv[2]);
+    char* inprefix = argv[3];
+    KmerFilter conditions;
+    conditions.count(atoi(argv[4]), atoi(argv[5]));
+    bool binary = false;
+    for (int i = 7; i < argc; i++) {
+        char *value = strchr(argv[i], '=');
+        long pos;
+        char base;
+        size_t min, max;
+        if (i == 7 && (strcmp(argv[i], "text") == 0 || strcmp(argv[i], "binary") == 0))
+            binary = argv[i][0] == 'b';
+        else if (strncmp(argv[i], "prefix=", 7) == 0)
+            conditions.prefix(value + 1);
+        else if (strncmp(argv[i], "suffix=", 7) == 0)
+            conditions.suffix(value + 1);
+        else if (strncmp(argv[i], "base=", 5) == 0 && sscanf(value + 1, "%ld:%c", &pos, &base) == 2)
+            conditions.base(pos, base);
+        else if (strncmp(argv[i], "gc=", 3) == 0 && sscanf(value + 1, "%zu-%zu", &min, &max) == 2)
+            conditions.gc(min, max);
+        else if (strncmp(argv[i], "exclude=", 8) == 0)
+            conditions.excluding(new Kmerizer(k, threads, value + 1, CANONICAL));
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    Kmerizer *index = new Kmerizer(k, threads, inprefix, CANONICAL);
+    BitVector *mask[NBINS];
+    index->filter(conditions, mask);
+    if (binary)
+        index->exportBinary(argv[6], mask);
+    else
+        index->pdump(argv[6], mask);
+    for (size_t bin = 0; bin < NBINS; bin++)
+        delete mask[bin];
+    return 0;
+}
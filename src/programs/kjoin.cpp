@@ -0,0 +1,34 @@
+#include <sys/stat.h> // mkdir()
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "kmerizer.h"
+
+int main(int argc, char *argv[])
+{
+    // parse args
+    bool valid = argc >= 6
+        && (strcmp(argv[4], "counts") == 0 || strcmp(argv[4], "presence") == 0);
+    if (!valid) {
+        fprintf(stdout, "Usage: %s <k> <threads> <output dir> <counts|presence> <sample dir> [<sample dir> ...]\n", argv[0]);
+        fprintf(stdout, "Writes a joint index of the samples, which records the samples each kmer occurs in,\n");
+        fprintf(stdout, "and with counts, its count in each sample.\n");
+        return 1;
+    }
+    size_t k = atoi(argv[1]);
+    size_t threads = atoi(argv[2]);
+    char *outprefix = argv[3];
+    bool abundance = strcmp(argv[4], "counts") == 0;
+    // create output directory if it doesn't exist
+    mkdir(outprefix,0755);
+
+    vector<Kmerizer*> samples;
+    vector<string> names;
+    for (int i = 5; i < argc; i++) {
+        samples.push_back(new Kmerizer(k, threads, argv[i], CANONICAL));
+        names.push_back(argv[i]);
+    }
+    Kmerizer *out = new Kmerizer(k, threads, outprefix, CANONICAL);
+    out->joinSamples(samples, names, abundance);
+    return 0;
+}
@@ -0,0 +1,84 @@
+#include <zlib.h>
+#include <string>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include "kseq.h"
+#include "kmerizer.h"
+
+#define BATCH_READS 20000
+
+KSEQ_INIT(gzFile, gzread)
+
+// one batch of reads, kept until its profiles are written
+struct ReadBatch {
+    vector<string>      names;
+    vector<string>      seqs;
+    vector<ReadProfile> profiles;
+};
+
+// read up to BATCH_READS reads. returns false at the end of the input
+bool readBatch(kseq_t *seq, ReadBatch &batch)
+{
+    batch.names.clear();
+    batch.seqs.clear();
+    while (batch.seqs.size() < BATCH_READS && kseq_read(seq) >= 0) {
+        batch.names.push_back(seq->name.s);
+        batch.seqs.push_back(seq->seq.s);
+    }
+    return !batch.seqs.empty();
+}
+
+// look up the batch and print a line per read
+void profileBatch(Kmerizer *index, uint32_t solid, ReadBatch *batch)
+{
+    size_t n = batch->seqs.size();
+    vector<const char*> seqs(n);
+    vector<int> lengths(n);
+    for (size_t i = 0; i < n; i++) {
+        seqs[i] = batch->seqs[i].c_str();
+        lengths[i] = batch->seqs[i].size();
+    }
+    batch->profiles.resize(n);
+    index->profile(seqs.data(), lengths.data(), n, solid, batch->profiles.data());
+    for (size_t i = 0; i < n; i++) {
+        ReadProfile &p = batch->profiles[i];
+        fprintf(stdout, "%s\t%u\t%u\t%u\t%u\t%.4f\n", batch->names[i].c_str(),
+            p.kmers, p.min, p.median, p.max, p.kmers ? (double)p.solid / p.kmers : 0.0);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    // parse args
+    if (argc != 6) {
+        fprintf(stdout, "Usage: %s <k> <threads> <input dir> <solid count> <reads file>\n", argv[0]);
+        fprintf(stdout, "Prints read, kmers, min, median, max and the fraction of kmers with count >= solid count.\n");
+        return 1;
+    }
+    size_t k = atoi(argv[1]);
+    size_t threads = atoi(argv[2]);
+    char* inprefix = argv[3];
+    uint32_t solid = atoi(argv[4]);
+    gzFile fp = gzopen(argv[5], "r");
+    if (fp == NULL) {
+        perror(argv[5]);
+        return 1;
+    }
+
+    Kmerizer *index = new Kmerizer(k, threads, inprefix, CANONICAL);
+
+    // profile one batch while the next one is read
+    kseq_t *seq = kseq_init(fp);
+    ReadBatch batches[2];
+    size_t current = 0;
+    bool more = readBatch(seq, batches[current]);
+    while (more) {
+        boost::thread worker(boost::bind(profileBatch, index, solid, &batches[current]));
+        more = readBatch(seq, batches[1 - current]);
+        worker.join();
+        current = 1 - current;
+    }
+    kseq_destroy(seq);
+    gzclose(fp);
+    return 0;
+}
@@ -0,0 +1,146 @@
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include "kmerizer.h"
+
+/*
+    Answers queries against a k-mer index until the input ends. One request
+    per line, and one line in response:
+
+        count <kmer> [<kmer> ...]   count of each kmer (0 if absent)
+        has <kmer> [<kmer> ...]     1 for each kmer that is present, else 0
+        samples <kmer> [<kmer> ...] for each kmer, its counts in the samples
+                                    of a joint index, separated by commas
+        filter <min> [<max>]        number of distinct kmers that occur
+                                    min..max times (no max if omitted)
+        quit
+
+    Malformed requests, and samples requests to an index that is not a
+    joint index, get a line starting with "error".
+*/
+void serve(Kmerizer *index, const size_t k, FILE *in, FILE *out)
+{
+    char *line = NULL;
+    size_t cap = 0;
+    while (getline(&line, &cap, in) > 0) {
+        vector<char*> words;
+        char *save;
+        for (char *tok = strtok_r(line, " \t\r\n", &save); tok != NULL;
+             tok = strtok_r(NULL, " \t\r\n", &save))
+            words.push_back(tok);
+        if (words.empty()) continue;
+
+        if (strcmp(words[0], "quit") == 0)
+            break;
+        if (strcmp(words[0], "count") == 0 || strcmp(words[0], "has") == 0
+            || strcmp(words[0], "samples") == 0) {
+            size_t n = words.size() - 1;
+            bool valid = n > 0;
+            for (size_t i = 1; i < words.size(); i++)
+                if (strlen(words[i]) != k) valid = false;
+            if (!valid) {
+                fprintf(out, "error expected one or more %zi-mers\n", k);
+            }
+            else if (words[0][0] == 's' && index->samplesJoined().empty()) {
+                fprintf(out, "error not a joint index\n");
+            }
+            else if (words[0][0] == 's') {
+                size_t nsamples = index->samplesJoined().size();
+                vector<uint32_t> counts(n * nsamples);
+                index->findInSamples((const char **)&words[1], n, counts.data());
+                for (size_t i = 0; i < n; i++) {
+                    fprintf(out, i ? " " : "");
+                    for (size_t s = 0; s < nsamples; s++)
+                        fprintf(out, s ? ",%u" : "%u", counts[i*nsamples + s]);
+                }
+                fprintf(out, "\n");
+            }
+            else {
+                vector<uint32_t> freqs(n);
+                index->find((const char **)&words[1], n, freqs.data());
+                bool presence = words[0][0] == 'h';
+                for (size_t i = 0; i < n; i++)
+                    fprintf(out, i ? " %u" : "%u", presence ? (freqs[i] > 0) : freqs[i]);
+                fprintf(out, "\n");
+            }
+        }
+        else if (strcmp(words[0], "filter") == 0 && (words.size() == 2 || words.size() == 3)) {
+            uint32_t min = atoi(words[1]);
+            uint32_t max = (words.size() == 3) ? atoi(words[2]) : 0;
+            BitVector *mask[NBINS];
+            index->filter(min, max, mask);
+            size_t total = 0;
+            for (size_t bin = 0; bin < NBINS; bin++) {
+                total += mask[bin]->cnt();
+                delete mask[bin];
+            }
+            fprintf(out, "%zi\n", total);
+        }
+        else {
+            fprintf(out, "error unknown request %s\n", words[0]);
+        }
+        fflush(out);
+    }
+    free(line);
+}
+
+void serveClient(Kmerizer *index, const size_t k, int fd)
+{
+    FILE *in = fdopen(fd, "r");
+    FILE *out = fdopen(dup(fd), "w");
+    serve(index, k, in, out);
+    fclose(in);
+    fclose(out);
+}
+
+int main(int argc, char *argv[])
+{
+    // parse args
+    if (argc != 5 && argc != 6) {
+        fprintf(stdout, "Usage: %s <k> <threads> <input dir> <cache bytes> [socket]\n", argv[0]);
+        fprintf(stdout, "Reads requests from stdin unless a unix socket path is given.\n");
+        return 1;
+    }
+    size_t k = atoi(argv[1]);
+    size_t threads = atoi(argv[2]);
+    char* inprefix = argv[3];
+
+    Kmerizer *index = new Kmerizer(k, threads, inprefix, CANONICAL);
+    index->setCacheLimit(atol(argv[4]));
+
+    if (argc == 5) {
+        serve(index, k, stdin, stdout);
+        return 0;
+    }
+
+    // one thread per client
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(argv[5]) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "socket path too long: %s\n", argv[5]);
+        return 1;
+    }
+    strcpy(addr.sun_path, argv[5]);
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(argv[5]);
+    if (sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0
+        || listen(sock, 16) != 0) {
+        perror(argv[5]);
+        return 1;
+    }
+    for (;;) {
+        int fd = accept(sock, NULL, NULL);
+        if (fd < 0) {
+            perror("accept");
+            continue;
+        }
+        boost::thread(boost::bind(serveClient, index, k, fd)).detach();
+    }
+    return 0;
+}
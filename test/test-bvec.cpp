@@ -1,7 +1,13 @@
 #include "test.h"
 #include "bvec/bvec.h"
+#include "bvec/builder.h"
+#include "bvec/hybrid.h"
+#include "bvec/simd.h"
 #include <algorithm>
+#include <iterator>
 #include <stdlib.h>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
 
 #define TEST_VEC_LENGTH 4
 const uint32_t TEST_CASES[][TEST_VEC_LENGTH] = {
@@ -72,6 +78,691 @@ TEST(BitVectorTest, CanDeserializeSerializedObject) {
     EXPECT_TRUE(original->equals(*deserialized));
 }
 
+TEST(BitVectorTest, AppendWordMatchesAppendFill) {
+    // pseudo-random rows with long runs and short literal stretches
+    srand(1);
+    vector<bool> bits;
+    while (bits.size() < 5000) {
+        bool bit = rand() % 2;
+        size_t run = (rand() % 4 == 0) ? rand() % 200 : rand() % 5;
+        bits.insert(bits.end(), run, bit);
+    }
+    BitVector *filled = new BitVector(true);
+    for (size_t i = 0; i < bits.size(); i++)
+        filled->appendFill(bits[i], 1);
+    // append the same rows as literal words of varying width
+    BitVector *worded = new BitVector(true);
+    size_t i = 0;
+    while (i < bits.size()) {
+        word_t nbits = 1 + rand() % 31;
+        if (i + nbits > bits.size()) nbits = bits.size() - i;
+        word_t word = 0;
+        for (word_t b = 0; b < nbits; b++)
+            if (bits[i + b]) word |= (word_t)1 << (30 - b);
+        worded->appendWord(word, nbits);
+        i += nbits;
+    }
+    EXPECT_EQ(filled->getSize(), bits.size());
+    EXPECT_EQ(worded->getSize(), bits.size());
+    EXPECT_EQ(filled->cnt(), worded->cnt());
+    for (word_t x = 0; x < bits.size(); x++) {
+        ASSERT_EQ(bits[x], filled->find(x)) << "appendFill bit " << x;
+        ASSERT_EQ(bits[x], worded->find(x)) << "appendWord bit " << x;
+    }
+}
+
+TEST(BitVectorTest, NextOneFindsSetBitsInOrder) {
+    vector<uint32_t> v;
+    for (uint32_t x = 3; x < 4000; x += 37)
+        v.push_back(x);
+    for (uint32_t x = 5000; x < 5100; x++)
+        v.push_back(x);
+    BitVector *bv = new BitVector(v);
+    bv->compress();
+    vector<uint32_t> found;
+    for (word_t x = bv->nextOne(0); x < bv->getSize(); x = bv->nextOne(x + 1))
+        found.push_back(x);
+    EXPECT_EQ(v, found);
+}
+
+TEST(BitVectorTest, AppendConcatenatesUnalignedVectors) {
+    vector<bool> bits;
+    BitVector *whole = new BitVector(true);
+    srand(3);
+    // parts of odd lengths with runs and noise
+    for (int part = 0; part < 6; part++) {
+        BitVector *piece = new BitVector(true);
+        word_t len = 17 + rand() % 200;
+        for (word_t i = 0; i < len; i++) {
+            bool bit = (part % 2) ? (rand() % 3 == 0) : (i > len / 3);
+            piece->appendFill(bit, 1);
+            bits.push_back(bit);
+        }
+        whole->append(*piece);
+        delete piece;
+    }
+    EXPECT_EQ(bits.size(), whole->getSize());
+    for (word_t x = 0; x < bits.size(); x++)
+        ASSERT_EQ(bits[x], whole->find(x)) << "bit " << x;
+}
+
+TEST(BitVectorTest, FlipKeepsLiteralsAndClearsTheTail) {
+    vector<bool> bits;
+    BitVector *bv = new BitVector(true);
+    srand(5);
+    // noise, a run of ones, and a partial literal at the end
+    for (word_t i = 0; i < 5 * 31 + 7; i++) {
+        bool bit = (i >= 40 && i < 140) || rand() % 4 == 0;
+        bv->appendFill(bit, 1);
+        bits.push_back(bit);
+    }
+    word_t ones = bv->cnt();
+    bv->flip();
+    EXPECT_EQ(bv->getSize() - ones, bv->cnt());
+    for (word_t x = 0; x < bits.size(); x++)
+        ASSERT_EQ(!bits[x], bv->find(x)) << "bit " << x;
+    bv->flip();
+    EXPECT_EQ(ones, bv->cnt());
+    for (word_t x = 0; x < bits.size(); x++)
+        ASSERT_EQ(bits[x], bv->find(x)) << "bit " << x;
+    delete bv;
+}
+
+TEST(BitVectorTest, OrsVectorsOfDifferentUnalignedSizes) {
+    BitVector *a = new BitVector(true);
+    BitVector *b = new BitVector(true);
+    a->appendFill(false, 3);
+    a->appendFill(true, 1);
+    a->appendFill(false, 6);
+    // longer than one fill word can span, ending in a partial literal
+    b->appendFill(false, 2000);
+    b->appendFill(true, 1);
+    b->appendFill(false, 70 * 31 + 4 - 2001);
+    b->appendFill(true, 1);
+    BitVector *c = *a | *b;
+    BitVector *d = *b | *a;
+    EXPECT_EQ(b->getSize(), c->getSize());
+    EXPECT_EQ(3u, c->cnt());
+    EXPECT_EQ(3u, d->cnt());
+    for (word_t x = 0; x < b->getSize(); x++) {
+        bool bit = x == 3 || x == 2000 || x == b->getSize() - 1;
+        ASSERT_EQ(bit, c->find(x)) << "bit " << x;
+        ASSERT_EQ(bit, d->find(x)) << "bit " << x;
+    }
+    delete c;
+    delete d;
+}
+
+TEST(BitVectorTest, AndsFlippedUnalignedVectors) {
+    // a 1-fill that ends with a literal of the other vector, and a partial
+    // literal at the end
+    BitVector *a = new BitVector(true);
+    BitVector *b = new BitVector(true);
+    a->appendFill(true, 3 * 31 + 10);
+    b->appendFill(false, 2 * 31 + 4);
+    b->appendFill(true, 1);
+    b->appendFill(false, 31 + 5);
+    BitVector *notb = b->copyflip();
+    EXPECT_EQ(a->getSize() - 1, notb->cnt());
+    *a &= *notb;
+    EXPECT_EQ(a->getSize() - 1, a->cnt());
+    for (word_t x = 0; x < a->getSize(); x++)
+        ASSERT_EQ(x != 2 * 31 + 4, a->find(x)) << "bit " << x;
+    delete notb;
+}
+
+// random runs of 0s and 1s, some long enough to make fills
+static BitVector * random_runs(vector<bool> &bits, size_t n, bool compressed) {
+    BitVector *bv = new BitVector(true);
+    bits.clear();
+    while (bits.size() < n) {
+        bool bit = rand() % 3 == 0;
+        size_t len = (rand() % 4 == 0) ? rand() % 200 : rand() % 5 + 1;
+        if (bits.size() + len > n) len = n - bits.size();
+        bv->appendFill(bit, len);
+        bits.insert(bits.end(), len, bit);
+    }
+    if (!compressed)
+        bv->decompress();
+    return bv;
+}
+
+TEST(BitVectorTest, CombinesIntoReusedVectors) {
+    srand(41);
+    BitVector res;
+    vector<word_t> scratch;
+    for (int round = 0; round < 400; round++) {
+        size_t n = 1 + rand() % 1000;
+        vector<bool> a_bits, b_bits;
+        // all four combinations of compressed and sorted list vectors
+        BitVector *a = random_runs(a_bits, n, (round / 4) % 2 == 0);
+        BitVector *b = random_runs(b_bits, n, (round / 8) % 2 == 0);
+        int op = round % 4; // &, |, ^, & ~
+        if (op == 0)
+            a->andInto(*b, res);
+        else if (op == 1)
+            a->orInto(*b, res);
+        else if (op == 2)
+            a->xorInto(*b, res);
+        else
+            a->andNotInto(*b, res);
+        word_t ones = 0;
+        for (word_t x = 0; x < n; x++) {
+            bool bit = (op == 0) ? a_bits[x] && b_bits[x]
+                     : (op == 1) ? a_bits[x] || b_bits[x]
+                     : (op == 2) ? a_bits[x] != b_bits[x]
+                     : a_bits[x] && !b_bits[x];
+            ASSERT_EQ(bit, res.find(x)) << "round " << round << " bit " << x;
+            ones += bit;
+        }
+        ASSERT_EQ(ones, res.cnt()) << "round " << round;
+        // and in place, through the same scratch words every time
+        if (op == 0)
+            a->andWith(*b, scratch);
+        else if (op == 1)
+            a->orWith(*b, scratch);
+        else if (op == 2)
+            a->xorWith(*b, scratch);
+        else
+            a->andNotWith(*b, scratch);
+        ASSERT_EQ(ones, a->cnt()) << "round " << round;
+        for (word_t x = 0; x < n; x++)
+            ASSERT_EQ(res.find(x), a->find(x)) << "round " << round << " bit " << x;
+        delete a;
+        delete b;
+    }
+}
+
+TEST(BitVectorTest, CombinesManyVectorsAtOnce) {
+    srand(42);
+    BitVector res;
+    for (int round = 0; round < 100; round++) {
+        size_t n = 1 + rand() % 12;
+        vector<BitVector*> inputs(n);
+        vector< vector<bool> > bits(n);
+        size_t size = 0;
+        for (size_t i = 0; i < n; i++) {
+            // sizes differ a little, and some inputs are mostly 1s
+            inputs[i] = random_runs(bits[i], 500 + rand() % 100, true);
+            if (rand() % 2) {
+                inputs[i]->flip();
+                bits[i].flip();
+            }
+            size = max(size, bits[i].size());
+        }
+        bool isAnd = round % 2 == 0;
+        if (isAnd)
+            BitVector::andAll(inputs, res);
+        else
+            BitVector::orAll(inputs, res);
+        ASSERT_EQ(size, res.getSize()) << "round " << round;
+        word_t ones = 0;
+        for (word_t x = 0; x < size; x++) {
+            bool bit = isAnd;
+            for (size_t i = 0; i < n; i++) {
+                bool b = x < bits[i].size() && bits[i][x];
+                bit = isAnd ? bit && b : bit || b;
+            }
+            ASSERT_EQ(bit, res.find(x)) << "round " << round << " bit " << x;
+            ones += bit;
+        }
+        ASSERT_EQ(ones, res.cnt()) << "round " << round;
+        for (size_t i = 0; i < n; i++)
+            delete inputs[i];
+    }
+}
+
+TEST(BitVectorTest, RanksAndSelectsThroughTheSkipIndex) {
+    srand(44);
+    vector<bool> bits;
+    BitVector *bv = random_runs(bits, 200000, true);
+    vector<word_t> ranks(bits.size() + 1, 0); // set bits before each position
+    vector<word_t> ones;
+    for (word_t x = 0; x < bits.size(); x++) {
+        ranks[x + 1] = ranks[x] + bits[x];
+        if (bits[x]) ones.push_back(x);
+    }
+    // random order, so find() keeps going back
+    for (int i = 0; i < 5000; i++) {
+        word_t x = rand() % bits.size();
+        ASSERT_EQ(bits[x], bv->find(x)) << "bit " << x;
+        ASSERT_EQ(ranks[x], bv->rank(x)) << "bit " << x;
+        word_t j = rand() % (ones.size() + 1);
+        ASSERT_EQ(j < ones.size() ? ones[j] : bv->getSize(), bv->select(j)) << "one " << j;
+    }
+    word_t *buf;
+    bv->dump(&buf);
+    BitVector *restored = new BitVector(buf);
+    free(buf);
+    EXPECT_EQ(bv->bytes(), restored->bytes()); // the skip index came along
+    EXPECT_LT(4 * bv->getWords().size(), restored->bytes());
+    for (int i = 0; i < 1000; i++) {
+        word_t x = rand() % bits.size();
+        ASSERT_EQ(bits[x], restored->find(x)) << "bit " << x;
+        ASSERT_EQ(ranks[x], restored->rank(x)) << "bit " << x;
+    }
+    delete bv;
+    delete restored;
+}
+
+TEST(BitVectorTest, RanksAndSelectsBothRepresentations) {
+    srand(45);
+    for (int round = 0; round < 40; round++) {
+        vector<bool> bits;
+        BitVector *bv = random_runs(bits, 1 + rand() % 5000, round % 2 == 0);
+        word_t ones = 0;
+        for (word_t x = 0; x < bits.size(); x++) {
+            ASSERT_EQ(ones, bv->rank(x)) << "round " << round << " bit " << x;
+            if (bits[x]) {
+                // select() undoes rank() on a set bit
+                ASSERT_EQ(x, bv->select(ones)) << "round " << round << " bit " << x;
+                ones++;
+            }
+        }
+        ASSERT_EQ(ones, bv->cnt()) << "round " << round;
+        delete bv;
+    }
+}
+
+// ascending runs of queries from random starting points, through one
+// cursor, counting the answers that don't match bits
+static void read_concurrently(const BitVector *bv, const vector<bool> *bits,
+                              unsigned int seed, int *errors) {
+    BitVector::Cursor cur;
+    vector<word_t> next(bits->size() + 1, bits->size()); // next set bit
+    vector<word_t> ranks(bits->size() + 1, 0); // set bits before
+    for (size_t x = 0; x < bits->size(); x++)
+        ranks[x + 1] = ranks[x] + (*bits)[x];
+    for (size_t x = bits->size(); x-- > 0;)
+        next[x] = (*bits)[x] ? x : next[x + 1];
+    for (int run = 0; run < 200; run++) {
+        word_t x = rand_r(&seed) % bits->size();
+        for (int i = 0; i < 100 && x < bits->size(); i++) {
+            if (bv->find(x, cur) != (*bits)[x]) (*errors)++;
+            if (bv->nextOne(x, cur) != next[x]) (*errors)++;
+            if (bv->rank(x) != ranks[x]) (*errors)++;
+            if ((*bits)[x] && bv->select(ranks[x]) != x) (*errors)++;
+            x += 1 + rand_r(&seed) % 300;
+        }
+    }
+}
+
+TEST(BitVectorTest, ConstQueriesShareOneVectorBetweenThreads) {
+    srand(49);
+    vector<bool> bits;
+    BitVector *bv = random_runs(bits, 300000, true);
+    bv->buildSkips();
+    const int nthreads = 8;
+    vector<int> errors(nthreads, 0);
+    boost::thread_group tg;
+    for (int t = 0; t < nthreads; t++)
+        tg.create_thread(boost::bind(read_concurrently, bv, &bits, t + 1, &errors[t]));
+    tg.join_all();
+    for (int t = 0; t < nthreads; t++)
+        EXPECT_EQ(0, errors[t]) << "thread " << t;
+    delete bv;
+}
+
+// runs of 0s and 1s at the start of each 2^32 bits, so the positions of
+// all but the first window overflow 32 bits. ones gets the set bits
+static BitVector64 * far_runs(vector<uint64_t> &ones, int windows) {
+    BitVector64 *bv = new BitVector64(true);
+    ones.clear();
+    uint64_t size = 0;
+    for (int w = 0; w < windows; w++) {
+        bv->appendFill(false, ((uint64_t)w << 32) - size);
+        size = (uint64_t)w << 32;
+        for (int r = 0; r < 100; r++) {
+            bool bit = rand() % 2;
+            uint64_t len = (rand() % 4 == 0) ? rand() % 500 : rand() % 5 + 1;
+            bv->appendFill(bit, len);
+            for (uint64_t i = 0; bit && i < len; i++)
+                ones.push_back(size + i);
+            size += len;
+        }
+    }
+    bv->appendFill(false, ((uint64_t)windows << 32) - size);
+    return bv;
+}
+
+TEST(BitVectorTest, BitVector64HoldsPositionsPast32Bits) {
+    srand(48);
+    vector<uint64_t> a_ones, b_ones;
+    BitVector64 *a = far_runs(a_ones, 5);
+    BitVector64 *b = far_runs(b_ones, 5);
+    ASSERT_EQ((uint64_t)5 << 32, a->getSize());
+    ASSERT_EQ(a_ones.size(), a->cnt());
+    // every set bit, the bits around it and a few between the windows
+    vector<uint64_t> probes;
+    for (size_t i = 0; i < a_ones.size(); i++) {
+        probes.push_back(a_ones[i]);
+        probes.push_back(a_ones[i] + 1);
+        probes.push_back(a_ones[i] + 63);
+    }
+    for (int i = 0; i < 1000; i++)
+        probes.push_back(((uint64_t)rand() << 32 | rand()) % a->getSize());
+    sort(probes.begin(), probes.end());
+    for (int pass = 0; pass < 2; pass++) {
+        for (size_t i = 0; i < probes.size(); i++) {
+            uint64_t x = probes[i];
+            vector<uint64_t>::iterator lb = lower_bound(a_ones.begin(), a_ones.end(), x);
+            uint64_t rank = lb - a_ones.begin();
+            ASSERT_EQ(lb != a_ones.end() && *lb == x, a->find(x)) << "bit " << x;
+            ASSERT_EQ(lb == a_ones.end() ? a->getSize() : *lb, a->nextOne(x)) << "bit " << x;
+            ASSERT_EQ(rank, a->rank(x)) << "bit " << x;
+            if (rank < a_ones.size()) {
+                ASSERT_EQ(a_ones[rank], a->select(rank)) << "one " << rank;
+            }
+        }
+        // again, from a restored copy with the skip index built above
+        uint64_t *buf;
+        a->dump(&buf);
+        BitVector64 *restored = new BitVector64(buf);
+        free(buf);
+        delete a;
+        a = restored;
+    }
+    // the sorted positions compress to the same words
+    BitVector64 fromOnes(a_ones);
+    fromOnes.compress();
+    fromOnes.appendFill(false, a->getSize() - fromOnes.getSize());
+    EXPECT_EQ(a->getWords(), fromOnes.getWords());
+
+    BitVector64 res;
+    for (int op = 0; op < 4; op++) { // &, |, ^, & ~
+        vector<uint64_t> expected;
+        if (op == 0) {
+            a->andInto(*b, res);
+            set_intersection(a_ones.begin(), a_ones.end(), b_ones.begin(), b_ones.end(), back_inserter(expected));
+        }
+        else if (op == 1) {
+            a->orInto(*b, res);
+            set_union(a_ones.begin(), a_ones.end(), b_ones.begin(), b_ones.end(), back_inserter(expected));
+        }
+        else if (op == 2) {
+            a->xorInto(*b, res);
+            set_symmetric_difference(a_ones.begin(), a_ones.end(), b_ones.begin(), b_ones.end(), back_inserter(expected));
+        }
+        else {
+            a->andNotInto(*b, res);
+            set_difference(a_ones.begin(), a_ones.end(), b_ones.begin(), b_ones.end(), back_inserter(expected));
+        }
+        ASSERT_EQ(expected.size(), res.cnt()) << "op " << op;
+        for (size_t i = 0; i < expected.size(); i++)
+            ASSERT_EQ(expected[i], res.select(i)) << "op " << op << " one " << i;
+        res.decompress();
+        EXPECT_EQ(expected, res.getWords()) << "op " << op;
+    }
+    delete a;
+    delete b;
+}
+
+TEST(BitVectorTest, BuildsFromUnsortedPositionsAndRuns) {
+    srand(50);
+    for (int round = 0; round < 24; round++) {
+        // small chunks, so there are many of them, on 1 to 4 threads
+        BitVectorBuilder builder(1 + rand() % 2000, 1 + round % 4);
+        word_t n = 1 + rand() % 100000;
+        vector<bool> bits(n, false);
+        for (int i = 0; i < 20000; i++) {
+            word_t x = (round % 3 == 0) ? rand() % 500 : rand() % n; // many repeats
+            builder.add(x);
+            bits[x] = true;
+        }
+        vector<word_t> some;
+        for (int i = 0; i < 1000; i++)
+            some.push_back(rand() % n);
+        builder.add(some.data(), some.size());
+        for (size_t i = 0; i < some.size(); i++)
+            bits[some[i]] = true;
+        for (int i = 0; i < round; i++) { // overlapping runs
+            word_t from = rand() % n;
+            word_t len = rand() % (n - from) % 5000;
+            builder.addRun(from, len);
+            fill(bits.begin() + from, bits.begin() + from + len, true);
+        }
+        builder.setSize(n);
+        BitVector res;
+        builder.build(res);
+        ASSERT_TRUE(res.compressed());
+        ASSERT_LE(n, res.getSize()) << "round " << round;
+        vector<word_t> expected;
+        for (word_t x = 0; x < n; x++)
+            if (bits[x]) expected.push_back(x);
+        ASSERT_EQ(expected.size(), res.cnt()) << "round " << round;
+        res.decompress();
+        ASSERT_EQ(expected, res.getWords()) << "round " << round;
+        // the builder starts over
+        builder.build(res);
+        EXPECT_EQ(0, res.cnt());
+    }
+    // and 64 bit positions, sorted the same way
+    vector<uint64_t> keys, tmp(100000);
+    for (int i = 0; i < 100000; i++)
+        keys.push_back((uint64_t)rand() << 33 ^ rand());
+    vector<uint64_t> expected(keys);
+    sort(expected.begin(), expected.end());
+    BitVector64Builder::radixSort(keys.data(), keys.size(), tmp.data());
+    EXPECT_EQ(expected, keys);
+}
+
+// chunks of sparse bits, long runs and dense noise, so the hybrid vector
+// uses all three containers
+static BitVector * mixed_chunks(vector<bool> &bits, size_t n) {
+    BitVector *bv = new BitVector(true);
+    bits.clear();
+    while (bits.size() < n) {
+        int kind = rand() % 3;
+        size_t end = min(n, bits.size() + 30000 + rand() % 70000);
+        while (bits.size() < end) {
+            bool bit;
+            size_t len;
+            if (kind == 0) {
+                bit = rand() % 100 == 0;
+                len = 1;
+            }
+            else if (kind == 1) {
+                bit = rand() % 2;
+                len = 1 + rand() % 3000;
+            }
+            else {
+                bit = rand() % 2;
+                len = 1 + rand() % 3;
+            }
+            len = min(len, end - bits.size());
+            bv->appendFill(bit, len);
+            bits.insert(bits.end(), len, bit);
+        }
+    }
+    return bv;
+}
+
+TEST(BitVectorTest, HybridRoundTripsSparsePositions) {
+    // too sparse to run length encode, so kept as sorted positions
+    vector<word_t> v;
+    for (word_t x = 7; x < 5000000; x += 9973)
+        v.push_back(x);
+    v.push_back(v.back() + 1);
+    BitVector *bv = new BitVector(v);
+    ASSERT_FALSE(bv->compressed());
+    HybridBitVector hv(*bv);
+    EXPECT_EQ(v.size(), hv.cnt());
+    EXPECT_LE(bv->getSize(), hv.getSize());
+    BitVector back;
+    hv.toBitVector(back);
+    EXPECT_EQ(hv.getSize(), back.getSize());
+    EXPECT_EQ(v.size(), back.cnt());
+    vector<word_t> found;
+    for (word_t x = back.nextOne(0); x < back.getSize(); x = back.nextOne(x + 1))
+        found.push_back(x);
+    EXPECT_EQ(v, found);
+    delete bv;
+}
+
+TEST(BitVectorTest, HybridMatchesBitVector) {
+    srand(46);
+    size_t types[3] = {0, 0, 0};
+    for (int round = 0; round < 16; round++) {
+        vector<bool> a_bits, b_bits;
+        size_t n = 300000 + rand() % 100000;
+        BitVector *a = mixed_chunks(a_bits, n);
+        BitVector *b = mixed_chunks(b_bits, n);
+        if (round % 4 == 3)
+            b->decompress(); // converts from sorted positions too
+        HybridBitVector ha(*a), hb(*b), res;
+        ASSERT_EQ(a->getSize(), ha.getSize());
+        ASSERT_EQ(a->cnt(), ha.cnt());
+        size_t counts[3];
+        ha.containerCounts(counts);
+        for (int t = 0; t < 3; t++)
+            types[t] += counts[t];
+
+        vector<word_t> ranks(a_bits.size() + 1, 0); // set bits before each position
+        vector<word_t> set;
+        for (word_t x = 0; x < a_bits.size(); x++) {
+            ranks[x + 1] = ranks[x] + a_bits[x];
+            if (a_bits[x]) set.push_back(x);
+        }
+        for (int i = 0; i < 2000; i++) {
+            word_t x = rand() % a_bits.size();
+            ASSERT_EQ((bool)a_bits[x], ha.find(x)) << "round " << round << " bit " << x;
+            ASSERT_EQ(ranks[x], ha.rank(x)) << "round " << round << " bit " << x;
+            ASSERT_EQ(a->nextOne(x), ha.nextOne(x)) << "round " << round << " bit " << x;
+            word_t j = rand() % (set.size() + 1);
+            ASSERT_EQ(j < set.size() ? set[j] : ha.getSize(), ha.select(j)) << "round " << round << " one " << j;
+        }
+
+        int op = round % 4; // &, |, ^, & ~
+        BitVector expected, back;
+        if (op == 0) {
+            a->andInto(*b, expected);
+            ha.andInto(hb, res);
+        }
+        else if (op == 1) {
+            a->orInto(*b, expected);
+            ha.orInto(hb, res);
+        }
+        else if (op == 2) {
+            a->xorInto(*b, expected);
+            ha.xorInto(hb, res);
+        }
+        else {
+            a->andNotInto(*b, expected);
+            ha.andNotInto(hb, res);
+        }
+        ASSERT_EQ(expected.cnt(), res.cnt()) << "round " << round;
+        res.toBitVector(back);
+        ASSERT_EQ(expected.getSize(), back.getSize()) << "round " << round;
+        for (word_t x = 0; x < expected.getSize(); x++)
+            ASSERT_EQ(expected.find(x), back.find(x)) << "round " << round << " bit " << x;
+        delete a;
+        delete b;
+    }
+    for (int t = 0; t < 3; t++)
+        EXPECT_LT(0, types[t]) << "container type " << t;
+}
+
+// random literals and fills of both kinds
+template <class T>
+static vector<T> random_wah_words(size_t n, int literal_bits) {
+    vector<T> words(n);
+    for (size_t i = 0; i < n; i++) {
+        T w = 0;
+        for (int b = 0; b < literal_bits; b += 15)
+            w = (w << 15) ^ rand();
+        w &= ((T)1 << literal_bits) - 1;
+        if (rand() % 4 == 0) // a fill, with a small or a large length
+            w = ((T)1 << literal_bits) | ((T)(rand() % 2) << (literal_bits - 1))
+                | ((rand() % 2) ? rand() % 10 + 1 : w & (((T)1 << (literal_bits - 1)) - 1));
+        else if (rand() % 8 == 0)
+            w = 0;
+        words[i] = w;
+    }
+    return words;
+}
+
+TEST(BitVectorTest, KernelsAgreeOnEveryCpu) {
+    srand(47);
+    const BitKernels *portable = bitKernels("portable");
+    const char *names[] = { "sse4.2", "avx2", "avx512" };
+    for (int t = 0; t < 3; t++) {
+        const BitKernels *kernels = bitKernels(names[t]);
+        if (kernels == NULL) continue;
+        for (int round = 0; round < 50; round++) {
+            size_t n = rand() % 100;
+            vector<uint32_t> w32 = random_wah_words<uint32_t>(n, 31);
+            vector<uint64_t> w64 = random_wah_words<uint64_t>(n, 63);
+            ASSERT_EQ(portable->wahCount32(w32.data(), n), kernels->wahCount32(w32.data(), n)) << names[t];
+            ASSERT_EQ(portable->wahCount64(w64.data(), n), kernels->wahCount64(w64.data(), n)) << names[t];
+
+            vector<uint32_t> f32 = w32, g32 = w32;
+            portable->wahFlip32(f32.data(), n);
+            kernels->wahFlip32(g32.data(), n);
+            ASSERT_TRUE(f32 == g32) << names[t];
+            vector<uint64_t> f64 = w64, g64 = w64;
+            portable->wahFlip64(f64.data(), n);
+            kernels->wahFlip64(g64.data(), n);
+            ASSERT_TRUE(f64 == g64) << names[t];
+
+            // literals only from here on
+            for (size_t i = 0; i < n; i++) {
+                w32[i] &= 0x7FFFFFFFU;
+                w64[i] &= 0x7FFFFFFFFFFFFFFFULL;
+            }
+            vector<uint32_t> other = random_wah_words<uint32_t>(n, 31);
+            for (size_t i = 0; i < n; i++)
+                other[i] &= 0x7FFFFFFFU;
+            void (*ops[4][2])(const uint32_t*, const uint32_t*, uint32_t*, size_t) = {
+                { portable->and32, kernels->and32 }, { portable->or32, kernels->or32 },
+                { portable->xor32, kernels->xor32 }, { portable->andNot32, kernels->andNot32 } };
+            for (int op = 0; op < 4; op++) {
+                vector<uint32_t> expected(n), res(n);
+                ops[op][0](w32.data(), other.data(), expected.data(), n);
+                ops[op][1](w32.data(), other.data(), res.data(), n);
+                ASSERT_TRUE(expected == res) << names[t] << " op " << op;
+            }
+            vector<uint64_t> other64 = random_wah_words<uint64_t>(n, 63);
+            for (size_t i = 0; i < n; i++)
+                other64[i] &= 0x7FFFFFFFFFFFFFFFULL;
+            void (*ops64[4][2])(const uint64_t*, const uint64_t*, uint64_t*, size_t) = {
+                { portable->and64, kernels->and64 }, { portable->or64, kernels->or64 },
+                { portable->xor64, kernels->xor64 }, { portable->andNot64, kernels->andNot64 } };
+            for (int op = 0; op < 4; op++) {
+                vector<uint64_t> expected(n), res(n);
+                ops64[op][0](w64.data(), other64.data(), expected.data(), n);
+                ops64[op][1](w64.data(), other64.data(), res.data(), n);
+                ASSERT_TRUE(expected == res) << names[t] << " op64 " << op;
+            }
+
+            vector<uint32_t> p32(31 * n + 8), q32(31 * n + 8);
+            size_t k = portable->expand32(w32.data(), n, 1000, p32.data());
+            ASSERT_EQ(k, kernels->expand32(w32.data(), n, 1000, q32.data())) << names[t];
+            p32.resize(k);
+            q32.resize(k);
+            ASSERT_TRUE(p32 == q32) << names[t];
+            vector<uint64_t> p64(63 * n + 8), q64(63 * n + 8);
+            k = portable->expand64(w64.data(), n, 1000, p64.data());
+            ASSERT_EQ(k, kernels->expand64(w64.data(), n, 1000, q64.data())) << names[t];
+            p64.resize(k);
+            q64.resize(k);
+            ASSERT_TRUE(p64 == q64) << names[t];
+        }
+    }
+    // decompress() lists the set bits in order, whichever kernels it uses
+    vector<bool> bits;
+    BitVector *runs = random_runs(bits, 5000, true);
+    runs->decompress();
+    vector<word_t>& positions = runs->getWords();
+    size_t k = 0;
+    for (word_t x = 0; x < bits.size(); x++)
+        if (bits[x]) {
+            ASSERT_LT(k, positions.size());
+            ASSERT_EQ(x, positions[k++]);
+        }
+    ASSERT_EQ(k, positions.size());
+    delete runs;
+}
+
 } /* namespace */
 
 int main(int argc, char **argv) {
@@ -1,19 +1,689 @@
 #include "test.h"
 #include "kmerizer/kmerizer.h"
+#include <stdlib.h>
+#include <map>
+#include <string>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
 
 Kmerizer * initKmerizer() {
     return new Kmerizer(1, 1, "/tmp", CANONICAL);
 }
 
+// the lesser of a kmer and its reverse complement
+string canonical(const string &kmer) {
+    string rc(kmer.rbegin(), kmer.rend());
+    for (size_t i = 0; i < rc.size(); i++)
+        rc[i] = (rc[i] == 'A') ? 'T' : (rc[i] == 'C') ? 'G' : (rc[i] == 'G') ? 'C' : 'A';
+    return (rc < kmer) ? rc : kmer;
+}
+
+// n random bases
+string randomBases(size_t n) {
+    string seq;
+    for (size_t i = 0; i < n; i++)
+        seq += "ACGT"[rand() % 4];
+    return seq;
+}
+
 namespace {
     
 class KmerizerTest : public ::testing::Test {
+protected:
+    vector<string> dirs; // made by newDir(), removed by TearDown()
+
+    virtual void TearDown() {
+        char cmd[300];
+        for (size_t d = 0; d < dirs.size(); d++) {
+            sprintf(cmd, "rm -rf %s", dirs[d].c_str());
+            system(cmd);
+        }
+    }
+
+    // a new empty directory
+    string newDir() {
+        char dir[200] = "/tmp/kmers.XXXXXX";
+        EXPECT_TRUE(mkdtemp(dir) != NULL);
+        dirs.push_back(dir);
+        return dir;
+    }
+
+    // count the kmers of seqs into an index in a new directory, and the
+    // slow way into expected. returns the directory
+    string buildIndex(size_t k, const vector<string> &seqs,
+                      map<string, uint32_t> &expected,
+                      size_t maximem = 1 << 22, size_t fanIn = 16) {
+        string dir = newDir();
+        Kmerizer *counter = new Kmerizer(k, 2, dir.c_str(), CANONICAL);
+        counter->allocate(maximem);
+        counter->setFanIn(fanIn);
+        for (size_t s = 0; s < seqs.size(); s++) {
+            counter->addSequence(seqs[s].c_str(), seqs[s].size());
+            for (size_t i = 0; i + k <= seqs[s].size(); i++)
+                expected[canonical(seqs[s].substr(i, k))]++;
+        }
+        counter->save();
+        delete counter;
+        return dir;
+    }
 };
 
-TEST(KmerizerTest, DoesInstantiation) {
+TEST_F(KmerizerTest, DoesInstantiation) {
     EXPECT_TRUE(initKmerizer() != NULL);
 }
 
+TEST_F(KmerizerTest, RoundTripsSortedRuns) {
+    // three word kmers with small deltas, word carries and large gaps
+    const size_t nwords = 3;
+    vector<kword_t> kmers;
+    kword_t kmer[nwords] = { 0, 0xFFFFFFFFFFFFFFF0ULL, 5 };
+    srand(2);
+    for (size_t i = 0; i < 1000; i++) {
+        kmers.insert(kmers.end(), kmer, kmer + nwords);
+        if (i % 100 == 0) kmer[0] += rand();
+        kword_t step = (i % 7 == 0) ? ((kword_t)rand() << 40) : rand() % 50 + 1;
+        kword_t before = kmer[2];
+        kmer[2] += step;
+        if (kmer[2] < before && ++kmer[1] == 0) kmer[0]++;
+    }
+    char fname[200] = "/tmp/run.XXXXXX";
+    mkstemp(fname);
+    KmerRunWriter *writer = new KmerRunWriter(fname, nwords);
+    for (size_t i = 0; i < 1000; i++)
+        writer->append(&kmers[i * nwords], i + 1);
+    delete writer;
+
+    KmerRunReader reader(fname, nwords);
+    EXPECT_EQ(1000u, reader.size());
+    for (size_t i = 0; i < 1000; i++) {
+        ASSERT_TRUE(reader.next());
+        for (size_t w = 0; w < nwords; w++)
+            ASSERT_EQ(kmers[i * nwords + w], reader.kmer()[w]) << "kmer " << i;
+        ASSERT_EQ(i + 1, reader.count());
+    }
+    EXPECT_FALSE(reader.next());
+    remove(fname);
+}
+
+TEST_F(KmerizerTest, SeeksSortedRunsFromSamples) {
+    // enough records to span several samples
+    const size_t n = 3 * KMERRUN_SAMPLE + 100;
+    char fname[200] = "/tmp/run.XXXXXX";
+    mkstemp(fname);
+    KmerRunWriter *writer = new KmerRunWriter(fname, 1);
+    for (kword_t i = 0; i < n; i++) {
+        kword_t kmer = 3 * i + 1;
+        writer->append(&kmer, 1);
+    }
+    delete writer;
+
+    KmerRunReader reader(fname, 1);
+    vector<kword_t> samples;
+    reader.samples(samples);
+    ASSERT_EQ(4u, samples.size());
+    EXPECT_EQ(3 * KMERRUN_SAMPLE + 1, samples[1]);
+    // seek to a present kmer, to a gap, and past the end
+    kword_t target = 3 * (2 * KMERRUN_SAMPLE + 5) + 1;
+    ASSERT_TRUE(reader.seek(&target));
+    EXPECT_EQ(target, reader.kmer()[0]);
+    target = 3 * (KMERRUN_SAMPLE - 1) + 2;
+    ASSERT_TRUE(reader.seek(&target));
+    EXPECT_EQ(target + 2, reader.kmer()[0]);
+    // decoding continues across the following samples
+    for (kword_t i = KMERRUN_SAMPLE + 1; i < n; i++) {
+        ASSERT_TRUE(reader.next());
+        ASSERT_EQ(3 * i + 1, reader.kmer()[0]);
+    }
+    EXPECT_FALSE(reader.next());
+    target = 3 * n;
+    EXPECT_FALSE(reader.seek(&target));
+    remove(fname);
+}
+
+TEST_F(KmerizerTest, MergesSpilledRuns) {
+    const size_t k = 21;
+    // 16 kmers per bin, so the sequences spill about twenty runs, merged two
+    // at a time in the background
+    map<string, uint32_t> expected;
+    vector<string> seqs;
+    srand(23);
+    for (size_t s = 0; s < 400; s++)
+        seqs.push_back((s % 4 == 3) ? seqs[s / 2] : randomBases(100));
+    string dir = buildIndex(k, seqs, expected, 1 << 15, 2);
+
+    Kmerizer *index = new Kmerizer(k, 2, dir.c_str(), CANONICAL);
+    vector<const char *> queries;
+    map<string, uint32_t>::iterator it;
+    for (it = expected.begin(); it != expected.end(); ++it)
+        queries.push_back(it->first.c_str());
+    vector<uint32_t> freqs(queries.size());
+    index->find(queries.data(), queries.size(), freqs.data());
+    for (size_t i = 0; i < queries.size(); i++)
+        ASSERT_EQ(expected[queries[i]], freqs[i]) << queries[i];
+    EXPECT_EQ(expected.size(), index->spectrum().distinct());
+    delete index;
+}
+
+TEST_F(KmerizerTest, SplitsTheMergeOfALargeBin) {
+    const size_t k = 21;
+    // the kmers of the fullest bin of a long sequence
+    map<string, uint32_t> all;
+    srand(29);
+    vector<string> seqs(1, randomBases(1200000));
+    Kmerizer *index = new Kmerizer(k, 2, buildIndex(k, seqs, all).c_str(), CANONICAL);
+    BitVector *mask[NBINS];
+    index->filter(1, 0, mask);
+    string fname = dirs.back() + "/all.bin";
+    index->exportBinary((char *)fname.c_str(), mask);
+    for (size_t bin = 0; bin < NBINS; bin++)
+        delete mask[bin];
+    delete index;
+    KmerExportReader reader(fname.c_str());
+    size_t fullest = 0;
+    for (size_t bin = 1; bin < NBINS; bin++)
+        if (reader.binStart(bin + 1) - reader.binStart(bin) >
+            reader.binStart(fullest + 1) - reader.binStart(fullest))
+            fullest = bin;
+    char kmer[k + 1];
+    seqs.clear();
+    for (uint64_t i = reader.binStart(fullest); i < reader.binStart(fullest + 1); i++) {
+        reader.unpack(i, kmer);
+        seqs.push_back(kmer);
+    }
+    ASSERT_LE((size_t)KMERRUN_SAMPLE, seqs.size());
+
+    // that bin then holds most of the kmers of an index, and spills with
+    // them, so it is merged in key ranges on both threads
+    for (size_t s = 0; s < 20; s++)
+        seqs.push_back(randomBases(100));
+    map<string, uint32_t> expected;
+    index = new Kmerizer(k, 2, buildIndex(k, seqs, expected, 1 << 19).c_str(), CANONICAL);
+    vector<const char *> queries;
+    map<string, uint32_t>::iterator it;
+    for (it = expected.begin(); it != expected.end(); ++it)
+        queries.push_back(it->first.c_str());
+    vector<uint32_t> freqs(queries.size());
+    index->find(queries.data(), queries.size(), freqs.data());
+    for (size_t i = 0; i < queries.size(); i++)
+        ASSERT_EQ(expected[queries[i]], freqs[i]) << queries[i];
+    EXPECT_EQ(expected.size(), index->spectrum().distinct());
+    delete index;
+}
+
+TEST_F(KmerizerTest, FindsBatchesOfKmers) {
+    const size_t k = 11;
+    // a few repetitive sequences
+    map<string, uint32_t> expected;
+    vector<string> seqs;
+    srand(5);
+    string repeat = randomBases(40);
+    for (size_t s = 0; s < 50; s++)
+        seqs.push_back(((s % 3 == 0) ? repeat : "") + randomBases(120));
+    string dir = buildIndex(k, seqs, expected);
+
+    Kmerizer *index = new Kmerizer(k, 1, dir.c_str(), CANONICAL);
+    vector<const char *> queries;
+    map<string, uint32_t>::iterator it;
+    for (it = expected.begin(); it != expected.end(); ++it)
+        queries.push_back(it->first.c_str());
+    queries.push_back("CCCCCCCCCCC"); // absent
+    vector<uint32_t> freqs(queries.size());
+    index->find(queries.data(), queries.size(), freqs.data());
+    for (size_t i = 0; i + 1 < queries.size(); i++)
+        ASSERT_EQ(expected[queries[i]], freqs[i]) << queries[i];
+    EXPECT_EQ(0u, freqs.back());
+
+    // every kmer of a sequence, in order
+    vector<uint32_t> all(seqs[0].size() - k + 1);
+    index->findAll(seqs[0].c_str(), seqs[0].size(), all.data());
+    for (size_t i = 0; i < all.size(); i++)
+        ASSERT_EQ(expected[canonical(seqs[0].substr(i, k))], all[i]) << "kmer " << i;
+    EXPECT_EQ(expected[canonical(seqs[1].substr(0, k))], index->find(seqs[1].c_str()));
+
+    // per read summaries, including a read shorter than k
+    const char *reads[3] = { seqs[0].c_str(), seqs[1].c_str(), "ACGT" };
+    int lengths[3] = { (int)seqs[0].size(), (int)seqs[1].size(), 4 };
+    ReadProfile profiles[3];
+    index->profile(reads, lengths, 3, 2, profiles);
+    sort(all.begin(), all.end());
+    EXPECT_EQ(all.size(), profiles[0].kmers);
+    EXPECT_EQ(all.front(), profiles[0].min);
+    EXPECT_EQ(all[all.size() / 2], profiles[0].median);
+    EXPECT_EQ(all.back(), profiles[0].max);
+    EXPECT_EQ((uint32_t)(all.end() - lower_bound(all.begin(), all.end(), 2u)), profiles[0].solid);
+    EXPECT_EQ(seqs[1].size() - k + 1, profiles[1].kmers);
+    EXPECT_EQ(0u, profiles[2].kmers);
+    delete index;
+}
+
+TEST_F(KmerizerTest, FindsKmersAcrossSamples) {
+    const size_t k = 23;
+    // several sampled kmers per bin, some kmers repeated
+    map<string, uint32_t> expected;
+    vector<string> seqs;
+    srand(31);
+    for (size_t s = 0; s < 1000; s++)
+        seqs.push_back((s % 5 == 4) ? seqs[s / 3] : randomBases(300));
+    string dir = buildIndex(k, seqs, expected);
+    ASSERT_LT((size_t)(3 * NBINS * SAMPLE_BLOCKS * BitVector::LITERAL_SIZE), expected.size());
+
+    Kmerizer *index = new Kmerizer(k, 2, dir.c_str(), CANONICAL);
+    vector<string> absent;
+    for (size_t i = 0; i < 1000; i++) {
+        string kmer = canonical(randomBases(k));
+        if (expected.count(kmer) == 0) absent.push_back(kmer);
+    }
+    vector<const char *> queries;
+    map<string, uint32_t>::iterator it;
+    for (it = expected.begin(); it != expected.end(); ++it)
+        queries.push_back(it->first.c_str());
+    for (size_t i = 0; i < absent.size(); i++)
+        queries.push_back(absent[i].c_str());
+    random_shuffle(queries.begin(), queries.end());
+    vector<uint32_t> freqs(queries.size());
+    index->find(queries.data(), queries.size(), freqs.data());
+    for (size_t i = 0; i < queries.size(); i++) {
+        map<string, uint32_t>::iterator found = expected.find(queries[i]);
+        ASSERT_EQ(found == expected.end() ? 0 : found->second, freqs[i]) << queries[i];
+    }
+    delete index;
+}
+
+TEST_F(KmerizerTest, EvictsBinsBeyondTheCacheLimit) {
+    const size_t k = 19;
+    map<string, uint32_t> expected;
+    vector<string> seqs;
+    srand(37);
+    for (size_t s = 0; s < 200; s++)
+        seqs.push_back((s % 4 == 3) ? seqs[s / 2] : randomBases(150));
+    string dir = buildIndex(k, seqs, expected);
+    vector<const char *> queries;
+    map<string, uint32_t>::iterator it;
+    for (it = expected.begin(); it != expected.end(); ++it)
+        queries.push_back(it->first.c_str());
+    vector<uint32_t> freqs(queries.size());
+
+    // the size of every bin loaded at once
+    Kmerizer *index = new Kmerizer(k, 2, dir.c_str(), CANONICAL);
+    index->find(queries.data(), queries.size(), freqs.data());
+    size_t all = index->cacheSize();
+    delete index;
+
+    // room for about a sixteenth of the bins, so most are evicted and
+    // some loaded again on the second pass
+    index = new Kmerizer(k, 2, dir.c_str(), CANONICAL);
+    index->setCacheLimit(all / 16);
+    for (int pass = 0; pass < 2; pass++) {
+        fill(freqs.begin(), freqs.end(), 0);
+        index->find(queries.data(), queries.size(), freqs.data());
+        for (size_t i = 0; i < queries.size(); i++)
+            ASSERT_EQ(expected[queries[i]], freqs[i]) << queries[i];
+        EXPECT_LT(0u, index->cacheSize());
+        EXPECT_GE(all / 16, index->cacheSize());
+    }
+    for (size_t i = 0; i < queries.size(); i += 97)
+        ASSERT_EQ(expected[queries[i]], index->find(queries[i])) << queries[i];
+    EXPECT_GE(all / 16, index->cacheSize());
+    delete index;
+}
+
+// find every query a few times and count the wrong answers
+static void find_concurrently(Kmerizer *index, vector<const char *> *queries,
+                              map<string, uint32_t> *expected, int *errors) {
+    vector<uint32_t> freqs(queries->size());
+    for (int pass = 0; pass < 3; pass++) {
+        index->find(queries->data(), queries->size(), freqs.data());
+        for (size_t i = 0; i < queries->size(); i++)
+            if (freqs[i] != expected->find((*queries)[i])->second) (*errors)++;
+    }
+}
+
+TEST_F(KmerizerTest, SharesBinsBetweenConcurrentFinds) {
+    const size_t k = 15;
+    map<string, uint32_t> expected;
+    vector<string> seqs;
+    srand(41);
+    for (size_t s = 0; s < 200; s++)
+        seqs.push_back((s % 3 == 2) ? seqs[s / 2] : randomBases(150));
+    string dir = buildIndex(k, seqs, expected);
+    vector<const char *> queries;
+    map<string, uint32_t>::iterator it;
+    for (it = expected.begin(); it != expected.end(); ++it)
+        queries.push_back(it->first.c_str());
+
+    // every thread looks up every bin, while a small cache makes the
+    // others load and evict bins under it
+    Kmerizer *index = new Kmerizer(k, 2, dir.c_str(), CANONICAL);
+    index->setCacheLimit(1 << 16);
+    const int nthreads = 4;
+    vector<int> errors(nthreads, 0);
+    boost::thread_group tg;
+    for (int t = 0; t < nthreads; t++)
+        tg.create_thread(boost::bind(find_concurrently, index, &queries, &expected, &errors[t]));
+    tg.join_all();
+    for (int t = 0; t < nthreads; t++)
+        EXPECT_EQ(0, errors[t]) << "thread " << t;
+    delete index;
+}
+
+TEST_F(KmerizerTest, KeepsEmptyBinsLoaded) {
+    const size_t k = 15;
+    map<string, uint32_t> expected;
+    vector<string> seqs(1, randomBases(40));
+    string dir = buildIndex(k, seqs, expected);
+    // 26 kmers leave most of the bins empty, and the absent queries hit them
+    vector<string> absent;
+    srand(43);
+    for (size_t i = 0; i < 500; i++)
+        absent.push_back(randomBases(k));
+    vector<const char *> queries;
+    map<string, uint32_t>::iterator it;
+    for (it = expected.begin(); it != expected.end(); ++it)
+        queries.push_back(it->first.c_str());
+    for (size_t i = 0; i < absent.size(); i++)
+        queries.push_back(absent[i].c_str());
+
+    Kmerizer *index = new Kmerizer(k, 2, dir.c_str(), CANONICAL);
+    vector<uint32_t> freqs(queries.size());
+    index->find(queries.data(), queries.size(), freqs.data());
+    // every bin queried is loaded now, empty or not, so none is read again
+    char cmd[300];
+    sprintf(cmd, "rm -f %s/*", dir.c_str());
+    ASSERT_EQ(0, system(cmd));
+    vector<uint32_t> again(queries.size());
+    index->find(queries.data(), queries.size(), again.data());
+    for (size_t i = 0; i < queries.size(); i++) {
+        uint32_t count = expected.count(queries[i]) ? expected[queries[i]] : 0;
+        ASSERT_EQ(count, freqs[i]) << queries[i];
+        ASSERT_EQ(count, again[i]) << queries[i];
+    }
+    delete index;
+}
+
+TEST_F(KmerizerTest, DumpsFilteredKmers) {
+    const size_t k = 13;
+    // counts with one to three digits
+    map<string, uint32_t> expected;
+    vector<string> seqs;
+    srand(7);
+    for (size_t s = 0; s < 300; s++) {
+        string seq;
+        for (size_t i = 0; i < 60; i++)
+            seq += "ACGT"[(s % 25 == 0 || s % 2 == 0) ? (i * 7 + s % 3) % 4 : rand() % 4];
+        seqs.push_back(seq);
+    }
+    string dir = buildIndex(k, seqs, expected);
+
+    Kmerizer *index = new Kmerizer(k, 4, dir.c_str(), CANONICAL);
+    BitVector *mask[NBINS];
+    index->filter(2, 0, mask);
+    char fname[300];
+    map<string, uint32_t> solid;
+    map<string, uint32_t>::iterator it;
+    for (it = expected.begin(); it != expected.end(); ++it)
+        if (it->second >= 2) solid[it->first] = it->second;
+    sprintf(fname, "%s/dump.txt", dir.c_str());
+    for (int parallel = 0; parallel < 2; parallel++) {
+        if (parallel)
+            index->pdump(fname, mask);
+        else
+            index->sdump(fname, mask);
+        map<string, uint32_t> dumped;
+        FILE *fp = fopen(fname, "r");
+        char line[100];
+        while (fgets(line, sizeof(line), fp) != NULL) {
+            char kmer[100];
+            uint32_t count;
+            ASSERT_EQ(2, sscanf(line, "%99s %u", kmer, &count));
+            ASSERT_EQ('\t', line[k]) << line;
+            ASSERT_EQ('\n', line[strlen(line) - 1]);
+            dumped[kmer] = count;
+        }
+        fclose(fp);
+        EXPECT_EQ(solid, dumped);
+    }
+
+    // the same kmers from the binary export
+    sprintf(fname, "%s/dump.bin", dir.c_str());
+    index->exportBinary(fname, mask);
+    KmerExportReader reader(fname);
+    EXPECT_EQ(k, reader.k());
+    EXPECT_EQ((size_t)NBINS, reader.nbins());
+    EXPECT_EQ(reader.size(), reader.binStart(NBINS));
+    map<string, uint32_t> exported;
+    char kmer[k + 1];
+    for (uint64_t i = 0; i < reader.size(); i++) {
+        reader.unpack(i, kmer);
+        exported[kmer] = reader.count(i);
+    }
+    EXPECT_EQ(solid, exported);
+    for (size_t bin = 0; bin < NBINS; bin++)
+        delete mask[bin];
+    delete index;
+}
+
+TEST_F(KmerizerTest, FiltersOnKmerContent) {
+    const size_t k = 35; // two words, the second one partial
+    map<string, uint32_t> expected[2];
+    vector<string> seqs[2];
+    srand(13);
+    for (size_t s = 0; s < 60; s++) {
+        seqs[0].push_back(randomBases(100));
+        // shares half of the kmers
+        seqs[1].push_back((s % 2 == 0) ? seqs[0][s] : randomBases(100));
+    }
+    string dir = buildIndex(k, seqs[0], expected[0]);
+    string otherDir = buildIndex(k, seqs[1], expected[1]);
+
+    Kmerizer *index = new Kmerizer(k, 4, dir.c_str(), CANONICAL);
+    Kmerizer *other = new Kmerizer(k, 4, otherDir.c_str(), CANONICAL);
+    KmerFilter conditions;
+    conditions.prefix("A").suffix("C").base(5, 'G').gc(15, 20).excluding(other);
+    BitVector *mask[NBINS];
+    index->filter(conditions, mask);
+    char fname[300];
+    sprintf(fname, "%s/dump.txt", dir.c_str());
+    index->pdump(fname, mask);
+    map<string, uint32_t> dumped;
+    FILE *fp = fopen(fname, "r");
+    char kmer[100];
+    uint32_t count;
+    while (fscanf(fp, "%99s %u", kmer, &count) == 2)
+        dumped[kmer] = count;
+    fclose(fp);
+    map<string, uint32_t> selected;
+    map<string, uint32_t>::iterator it;
+    for (it = expected[0].begin(); it != expected[0].end(); ++it) {
+        const string &m = it->first;
+        size_t gc = 0;
+        for (size_t i = 0; i < k; i++)
+            gc += (m[i] == 'G' || m[i] == 'C');
+        if (m[0] == 'A' && m[k - 1] == 'C' && m[5] == 'G' && gc >= 15 && gc <= 20
+            && expected[1].count(m) == 0)
+            selected[m] = it->second;
+    }
+    EXPECT_LT(0u, selected.size());
+    EXPECT_EQ(selected, dumped);
+    for (size_t bin = 0; bin < NBINS; bin++)
+        delete mask[bin];
+    delete index;
+    delete other;
+}
+
+TEST_F(KmerizerTest, CombinesTwoIndexes) {
+    const size_t k = 17;
+    map<string, uint32_t> expected[2];
+    vector<string> seqs[2];
+    srand(17);
+    for (size_t s = 0; s < 50; s++) {
+        seqs[0].push_back(randomBases(90));
+        seqs[1].push_back((s % 3 == 0) ? seqs[0][s] : randomBases(90));
+    }
+    // shared kmers with a higher count on either side, or on both
+    for (size_t s = 0; s < 50; s += 6)
+        seqs[1].push_back(seqs[0][s]);
+    for (size_t s = 0; s < 50; s += 9)
+        seqs[0].push_back(seqs[0][s]);
+    Kmerizer *left = new Kmerizer(k, 2, buildIndex(k, seqs[0], expected[0]).c_str(), CANONICAL);
+    Kmerizer *right = new Kmerizer(k, 2, buildIndex(k, seqs[1], expected[1]).c_str(), CANONICAL);
+
+    // every kmer of either index, and its counts in each
+    map<string, pair<uint32_t, uint32_t> > both;
+    map<string, uint32_t>::iterator it;
+    for (it = expected[0].begin(); it != expected[0].end(); ++it)
+        both[it->first].first = it->second;
+    for (it = expected[1].begin(); it != expected[1].end(); ++it)
+        both[it->first].second = it->second;
+    vector<const char *> queries;
+    map<string, pair<uint32_t, uint32_t> >::iterator kt;
+    for (kt = both.begin(); kt != both.end(); ++kt)
+        queries.push_back(kt->first.c_str());
+    // some kmers are only in the right index, some in both
+    ASSERT_LT(expected[0].size(), both.size());
+    ASSERT_LT(both.size(), expected[0].size() + expected[1].size());
+
+    const char combinations[6][2] = {
+        { INTERSECTION, SUM_COUNTS }, { INTERSECTION, RIGHT_COUNTS },
+        { DIFFERENCE, LEFT_COUNTS }, { UNION, SUM_COUNTS },
+        { UNION, MIN_COUNTS }, { UNION, RIGHT_COUNTS } };
+    for (size_t c = 0; c < 6; c++) {
+        const char op = combinations[c][0];
+        const char how = combinations[c][1];
+        map<string, uint32_t> combined;
+        for (kt = both.begin(); kt != both.end(); ++kt) {
+            uint32_t l = kt->second.first;
+            uint32_t r = kt->second.second;
+            if (l && r && op != DIFFERENCE)
+                combined[kt->first] = (how == SUM_COUNTS) ? l + r
+                                    : (how == MIN_COUNTS) ? min(l, r)
+                                    : (how == LEFT_COUNTS) ? l : r;
+            else if (l && !r && op != INTERSECTION)
+                combined[kt->first] = l;
+            else if (!l && r && op == UNION)
+                combined[kt->first] = r;
+        }
+        Kmerizer *index = new Kmerizer(k, 4, newDir().c_str(), CANONICAL);
+        index->combine(left, right, op, how);
+        vector<uint32_t> freqs(queries.size());
+        index->find(queries.data(), queries.size(), freqs.data());
+        for (size_t i = 0; i < queries.size(); i++) {
+            uint32_t count = combined.count(queries[i]) ? combined[queries[i]] : 0;
+            ASSERT_EQ(count, freqs[i]) << op << how << " " << queries[i];
+        }
+        EXPECT_LT(0u, combined.size()) << op << how;
+        EXPECT_EQ(combined.size(), index->spectrum().distinct()) << op << how;
+        delete index;
+    }
+    delete left;
+    delete right;
+}
+
+TEST_F(KmerizerTest, JoinsSamples) {
+    const size_t k = 19;
+    const size_t nsamples = 3;
+    map<string, vector<uint32_t> > expected;
+    vector<string> seqs[nsamples];
+    srand(19);
+    vector<Kmerizer*> samples;
+    vector<string> names;
+    for (size_t d = 0; d < nsamples; d++) {
+        for (size_t s = 0; s < 40; s++)
+            seqs[d].push_back((d > 0 && s % (d + 1) == 0) ? seqs[0][s] : randomBases(80));
+        map<string, uint32_t> kmers;
+        names.push_back(buildIndex(k, seqs[d], kmers));
+        samples.push_back(new Kmerizer(k, 2, names[d].c_str(), CANONICAL));
+        map<string, uint32_t>::iterator it;
+        for (it = kmers.begin(); it != kmers.end(); ++it) {
+            vector<uint32_t> &tally = expected[it->first];
+            tally.resize(nsamples);
+            tally[d] = it->second;
+        }
+    }
+    string jointDir = newDir();
+    Kmerizer *joint = new Kmerizer(k, 4, jointDir.c_str(), CANONICAL);
+    joint->joinSamples(samples, names, true);
+    Kmerizer *shared = new Kmerizer(k, 4, newDir().c_str(), CANONICAL);
+    shared->joinSamples(samples, names, false);
+    delete joint;
+    joint = new Kmerizer(k, 4, jointDir.c_str(), CANONICAL);
+    ASSERT_EQ(names, joint->samplesJoined());
+    EXPECT_TRUE(samples[0]->samplesJoined().empty());
+
+    vector<const char *> queries;
+    map<string, vector<uint32_t> >::iterator it;
+    for (it = expected.begin(); it != expected.end(); ++it)
+        queries.push_back(it->first.c_str());
+    queries.push_back("ACGTACGTACGTACGTACG"); // in none of them
+    size_t n = queries.size();
+    vector<uint32_t> freqs(n), counts(n * nsamples), present(n * nsamples);
+    joint->find(queries.data(), n, freqs.data());
+    joint->findInSamples(queries.data(), n, counts.data());
+    shared->findInSamples(queries.data(), n, present.data());
+    // in the first two samples but not the third
+    vector<size_t> all, none;
+    all.push_back(0);
+    all.push_back(1);
+    none.push_back(2);
+    BitVector *mask[NBINS];
+    shared->sampleFilter(all, none, mask);
+    size_t selected = 0, expected_selected = 0;
+    for (size_t bin = 0; bin < NBINS; bin++) {
+        selected += mask[bin]->cnt();
+        delete mask[bin];
+    }
+    for (size_t i = 0; i + 1 < n; i++) {
+        vector<uint32_t> &tally = expected[queries[i]];
+        uint32_t total = 0;
+        for (size_t s = 0; s < nsamples; s++) {
+            ASSERT_EQ(tally[s], counts[i*nsamples + s]) << queries[i];
+            ASSERT_EQ(tally[s] > 0, present[i*nsamples + s]) << queries[i];
+            total += tally[s];
+        }
+        ASSERT_EQ(total, freqs[i]) << queries[i];
+        expected_selected += tally[0] && tally[1] && !tally[2];
+    }
+    for (size_t s = 0; s < nsamples; s++)
+        EXPECT_EQ(0u, counts[(n - 1)*nsamples + s]);
+    EXPECT_LT(0u, expected_selected);
+    EXPECT_EQ(expected_selected, selected);
+    for (size_t d = 0; d < nsamples; d++)
+        delete samples[d];
+    delete joint;
+    delete shared;
+}
+
+TEST_F(KmerizerTest, ComputesSpectraOfSeveralIndexes) {
+    const size_t k = 15;
+    const size_t nsamples = 3;
+    vector<Kmerizer*> indexes;
+    vector< map<uint32_t, uint64_t> > expected(nsamples);
+    vector<uint64_t> totals(nsamples, 0);
+    srand(11);
+    for (size_t sample = 0; sample < nsamples; sample++) {
+        string repeat = randomBases(30);
+        vector<string> seqs;
+        for (size_t s = 0; s < 40 * (sample + 1); s++) {
+            seqs.push_back(((s % (sample + 2) == 0) ? repeat : "") + randomBases(80));
+            totals[sample] += seqs.back().size() - k + 1;
+        }
+        map<string, uint32_t> kmers;
+        string dir = buildIndex(k, seqs, kmers);
+        map<string, uint32_t>::iterator it;
+        for (it = kmers.begin(); it != kmers.end(); ++it)
+            expected[sample][it->second]++;
+        indexes.push_back(new Kmerizer(k, 2, dir.c_str(), CANONICAL));
+    }
+    vector<Spectrum> spectra;
+    Kmerizer::spectra(indexes, 3, spectra);
+    ASSERT_EQ(nsamples, spectra.size());
+    for (size_t sample = 0; sample < nsamples; sample++) {
+        EXPECT_EQ(expected[sample], spectra[sample].counts());
+        EXPECT_EQ(expected[sample], indexes[sample]->spectrum().counts());
+        EXPECT_EQ(totals[sample], spectra[sample].total());
+        delete indexes[sample];
+    }
+}
+
 } /* namespace */
 
 int main(int argc, char *argv[]) {